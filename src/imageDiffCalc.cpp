@@ -32,67 +32,473 @@
 #include <vector> // for std::vector
 #include <time.h> // for tm
 #include <sys/stat.h> //for mkdir for Linux
+#include <sys/resource.h> // for getrusage
+#include <sys/mman.h> // for mmap
+#include <sys/file.h> // for flock
+#include <fcntl.h> // for open
+#include <unistd.h> // for close, getpid
+#include <dirent.h> // for opendir
+#include <utime.h> // for utime
+#include <sys/socket.h> // for socket
+#include <sys/un.h> // for sockaddr_un
+#include <iomanip> // for std::setw
 #include <map>
+#include <thread> // for std::thread
+#include <functional> // for std::function
+#include <atomic> // for std::atomic
+#include <mutex> // for std::mutex
+#include <condition_variable> // for std::condition_variable
+#include <deque> // for std::deque
+#include <memory> // for std::shared_ptr
+#include <chrono> // for std::chrono
+#include <fstream> // for std::ifstream
+#include <stdint.h> // for uint64_t
+#include <string.h> // for memcpy
+#include <errno.h> // for errno
+#include <stdlib.h> // for posix_memalign
+#include <new> // for std::bad_alloc
+#include <float.h> // for DBL_MAX
 #include "cxxopts.hpp" // for option phrase
+#include "imageDiffCalc.h"
 
 ////////// Global variables //////////
-// old/new part file list (Relative Path)
-std::vector<std::string> g_strOldPartFileList;
-std::vector<std::string> g_strNewPartFileList;
+// input image, decoded once. Derived planes are computed on first use and kept (not thread safe).
+class ImageContext
+{
+public:
+	explicit ImageContext(const std::string& strFile);
+	explicit ImageContext(const cv::Mat& img, const bool& bIsOwned=false); // already decoded image (shared, not copied), bIsOwned : not used by the caller any more
+	explicit ImageContext(const BaselineIndex& index); // precomputed planes of the index (shared, the index must outlive this)
+
+	const std::string& GetFile() const { return m_strFile; }
+	const cv::Mat& GetColor();  // BGR
+	const cv::Mat& GetGray();   // BGR -> gray
+	const cv::Mat& GetHSV();    // BGR -> HSV
+	const cv::Mat& GetBinary(); // gray -> binary (threshold 200)
+	const cv::Mat& GetGrayPyramid(const int& nLevel); // gray, 1/2^nLevel size
+	const std::vector<uint64_t>& GetStripHash();      // color, by kStripHeight rows
+
+	void ApplyIgnoreRegion(const DiffOptions& options);
+
+private:
+	std::string m_strFile;
+	bool m_bIsLoaded;
+	bool m_bIsOwned; // the color image can be written in place
+	cv::Mat m_clrImg;
+	cv::Mat m_gryImg;
+	cv::Mat m_hsvImg;
+	cv::Mat m_binImg;
+	std::vector<cv::Mat> m_gryPyramidList;
+	std::vector<uint64_t> m_stripHashList;
+};
+
+// TM_SQDIFF of parts against one gray image in the frequency domain.
+// The forward DFT and the integral of squares of the image are computed on first use,
+// and shared by all parts matched against the same image.
+class FrameCorrelator
+{
+public:
+	explicit FrameCorrelator(const cv::Mat& gryImg);
+
+	void MatchTemplate(const cv::Mat& partGryImg, double& dMinVal, cv::Point& ptMin);
+	static size_t GetMemorySize(const cv::Size& imgSize); // [byte]
+
+private:
+	cv::Mat m_gryImg;
+	cv::Size m_dftSize;
+	cv::Mat m_dftImg;   // CV_64FC1, CCS packed spectrum
+	cv::Mat m_sqSumImg; // CV_64FC1, integral of squares
+};
+
+// SHA-256 of data given in pieces
+class SHA256Digest
+{
+public:
+	SHA256Digest();
+
+	void Update(const unsigned char* pData, const size_t& nSize);
+	std::string GetHex(); // 64 hex digits, no Update after this
+
+private:
+	void Transform(const unsigned char* pBlock);
+
+	uint32_t m_nState[8];
+	unsigned char m_block[64];
+	size_t m_nBlockSize;
+	uint64_t m_nTotalSize;
+};
+
+// Part rects and native (binary) AKAZE descriptors of images, one file per image in a directory
+// shared by processes. A file is written to a temporary name and renamed, so readers never see a
+// partial file. Files are touched on each hit, and the least recently used ones are removed above
+// the size limit.
+class PartCache
+{
+public:
+	PartCache(const std::string& strDir, const unsigned int& nMaxMB);
+
+	static std::string GetKey(const cv::Mat& clrImg, const DiffOptions& options);
+	bool Load(const std::string& strKey, const cv::Size& imgSize, std::vector<cv::Rect>& partRectList, std::vector<cv::Mat>& descriptorList) const;
+	bool Store(const std::string& strKey, const cv::Size& imgSize, const std::vector<cv::Rect>& partRectList, const std::vector<cv::Mat>& descriptorList) const;
 
-// output file name
-std::string g_strFileName;
-// file list
-std::vector<std::string> g_strFileList;
-// between files difference info ([0]/[1] : same/remove image between old and new, [2]/[3] : same/add image between new and old)
-std::map<int, std::vector<std::string> > g_strFileDiffInfoListMap;
+private:
+	std::string GetFile(const std::string& strKey) const;
+	void Evict(const std::string& strKeepFile) const;
+
+	std::string m_strDir;
+	unsigned long long m_nMaxBytes;
+};
+// part cache file : header, part table and descriptor rows (8 byte aligned), mapped by mmap to read
+struct PartCacheHeader
+{
+	uint32_t nMagic;
+	uint32_t nVersion;
+	uint32_t nPartNum;
+	uint32_t nReserved;
+	int32_t nImgW, nImgH;          // image size, which bounds the part rects
+	char szKey[64];                // key of the entry (not terminated when 64 chars)
+};
+struct PartCacheRecord
+{
+	int32_t nX, nY, nW, nH;        // part rect
+	int32_t nRows, nCols, nType;   // descriptors (0 rows : no key point)
+	uint32_t nOffset;              // descriptors from the file top [byte]
+};
+const uint32_t kPartCacheMagic = 0x4341475a; // "ZGAC"
+// bump when the segmentation or the descriptor changes
+const uint32_t kPartCacheVersion = 2;
+// baseline index file : header, image table, strip hashes, part table, image rows (64 byte aligned) and descriptor rows (8 byte aligned)
+struct BaselineIndexHeader
+{
+	uint32_t nMagic;
+	uint32_t nVersion;
+	uint32_t nStripH;
+	uint32_t nImageNum; // color, gray and gray pyramid levels
+	uint32_t nStripNum;
+	uint32_t nPartNum;
+	uint32_t nSegmenterType; // of the parts
+	uint32_t nBandH;         // rows of a segmentation band (by --max-memory), which change the parts
+};
+struct BaselineIndexImage
+{
+	int32_t nRows, nCols, nType, nReserved;
+	uint64_t nOffset;
+};
+struct BaselineIndexPart
+{
+	int32_t nX, nY, nW, nH;        // part rect
+	int32_t nRows, nCols;          // CV_8UC1 descriptors (0 rows : no key point)
+	uint64_t nOffset;
+};
+const uint32_t kBaselineIndexMagic = 0x4941475a; // "ZGAI"
+// bump when the segmentation or the descriptor changes
+const uint32_t kBaselineIndexVersion = 2;
+// gray pyramid levels stored in an index at least
+const int kIndexPyramidLevel = 3;
+
+// segmented part (ROI of the source image and its bounding rect in the source image)
+struct Part
+{
+	cv::Rect rect;
+	cv::Mat clrImg;
+	cv::Mat gryImg;
+	cv::Mat descriptors; // native AKAZE descriptors from the part cache (empty : no key point)
+	bool bHasDescriptor; // descriptors is set
+
+	Part()
+		: bHasDescriptor(false)
+	{
+	}
+};
+// state of a part after ImgSeg02
+enum PartStatus
+{
+	kPartPending,      // not matched yet
+	kPartSamePosition, // same rect in the unchanged rows of the other image
+	kPartFeatureMatch, // full or almost match of the descriptors
+	kPartNoMatch       // deleted (old part) or added (new part)
+};
+// Parts of one image as arrays indexed by part id (the index in its part list).
+// The descriptors of all parts are rows of one matrix, part nId has nDescriptorNumList[nId] rows
+// from nDescriptorStartList[nId].
+struct PartTable
+{
+	std::vector<cv::Rect> rectList;
+	std::vector<int> nDescriptorStartList;
+	std::vector<int> nDescriptorNumList; // 0 : no key point or not computed
+	std::vector<int> nMatchIdList;       // part id in the other image (-1 : none)
+	std::vector<PartStatus> statusList;
+	cv::Mat descriptors;
+
+	void Init(const std::vector<Part>& partList); // all parts pending, no descriptor
+	void SetDescriptors(const std::vector<int>& nIdList, const std::vector<cv::Mat>& descriptorList); // descriptorList[k] : part nIdList[k]
+	cv::Mat GetDescriptors(const int& nId) const; // rows of the part (empty : no key point)
+	void GetIdList(const PartStatus& status, std::vector<int>& nIdList) const;
+	int GetSize() const { return (int)rectList.size(); }
+};
+// entry of a match table which isn't computed (after the first match of the new part)
+const int kMatchUnknown = -2;
+// number of rows hashed together by the strip hash
+const int kStripHeight = 16;
+// max mean squared gray difference per pixel of a match found by the coarse-to-fine search
+// (e.g. 1% of the pixels changed by 80 levels), so a part with a few changed pixels is found near its position
+const double kMaxLocalMatchScore = 64.0;
+// windows of the template search around the matched old part (margin x1, x4, x16), then the full frame
+const int kMaxSearchWindowNum = 3;
+// min part area [px] matched in the frequency domain by the full frame search
+const int kMinFFTPartArea = 128*128;
+// memory budget of the full frame search in the frequency domain without --max-memory [MB]
+// (24 bytes per pixel of the padded image and 8 of the image, e.g. a 1920x1920 page fits)
+const unsigned int kMaxFFTMemoryMB = 128;
+// rows added above and below each band of the tiled segmentation (morphology reaches 7 rows)
+const int kBandOverlap = 16;
+// margin of the block segmentation [px], the reach of the 7 gradient iterations of the watershed path
+const int kBlockMargin = 7;
+// working memory of the segmentation per pixel [byte] (binary, gradient, markers, watershed image and work buffers)
+const int kSegmentationBytesPerPixel = 32;
+// alignment of the buffers of WorkArena [byte]
+const size_t kArenaAlignment = 64;
+// arena blocks kept by a batch or serve worker between diffs [byte], more are freed
+const size_t kMaxArenaKeepSize = 256*1024*1024;
+// STL allocator on a WorkArena (NULL : heap). Memory of the arena is given back by its Rewind().
+template <typename T>
+struct ArenaAllocator
+{
+	typedef T value_type;
+	WorkArena* pArena;
 
+	explicit ArenaAllocator(WorkArena* pWorkArena=NULL)
+		: pArena(pWorkArena)
+	{
+	}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other)
+		: pArena(other.pArena)
+	{
+	}
+	T* allocate(const size_t n)
+	{
+		return static_cast<T*>((pArena!=NULL) ? pArena->Allocate(n*sizeof(T)) : ::operator new(n*sizeof(T)));
+	}
+	void deallocate(T* p, const size_t)
+	{
+		if (pArena==NULL) ::operator delete(p);
+	}
+};
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.pArena==b.pArena; }
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.pArena!=b.pArena; }
 // pixel connectibity
 struct PixelConnectivity
 {
 	int nIdx;
 	std::vector<int> nNeighborIdxList;
 };
-// segmented region information
-struct SegmentedRegionInfo
-{
-	cv::Point ptOrigin;
-	int nW;
-	int nH;
-	cv::Scalar clrFrame;
-	std::vector<cv::Point> ptPixList;
+// 8-connected components of non-zero pixels (CV_8UC1), fed row by row from the top.
+// Only the runs of 2 rows are kept, so the memory doesn't depend on the image height.
+class RunLengthGrouper
+{
+public:
+	explicit RunLengthGrouper(WorkArena* pArena=NULL); // runs and labels on pArena (NULL : heap)
+
+	void AddRow(const unsigned char* pRow, const int& nW);
+	void GetPartRectList(std::vector<cv::Rect>& partRectList) const;
+
+private:
+	struct Run
+	{
+		int nXs;    // first pixel
+		int nXe;    // last pixel + 1
+		int nLabel;
+	};
+
+	int m_nY;
+	std::vector<int, ArenaAllocator<int> > m_nParentList;
+	std::vector<cv::Vec4i, ArenaAllocator<cv::Vec4i> > m_nBoxList; // left, top, right, bottom (inclusive) of the root labels
+	std::vector<Run, ArenaAllocator<Run> > m_prevRunList;
+	std::vector<Run, ArenaAllocator<Run> > m_curRunList;
+};
+// connected parts of a 3 channel image (128 : not part), fed row by row from the top.
+// Only 2 rows of labels are kept, so the memory doesn't depend on the image height.
+class PartGrouper
+{
+public:
+	explicit PartGrouper(const int& nW, WorkArena* pArena=NULL); // labels on pArena (NULL : heap)
+
+	void AddRow(const unsigned char* pRow);
+	void GetPartRectList(std::vector<cv::Rect>& partRectList) const;
+
+private:
+	int FindRoot(int nLabel);
+	void Merge(const int& nRoot, const int& nChildRoot);
+
+	int m_nW;
+	int m_nY;
+	std::vector<int, ArenaAllocator<int> > m_nPrevLabelList;
+	std::vector<int, ArenaAllocator<int> > m_nCurLabelList;
+	std::vector<unsigned char, ArenaAllocator<unsigned char> > m_nPrevClrList;
+	std::vector<int, ArenaAllocator<int> > m_nParentList;
+	std::vector<cv::Vec4i, ArenaAllocator<cv::Vec4i> > m_nBoxList;
+};
+
+// image pair of the batch manifest and of the serve client
+struct BatchPair
+{
+	int nLineNo;
+	std::string strNewFile;
+	std::string strOldFile;
+	std::string strFileName;
+};
+// image given by a file path or by encoded data in memory (serve mode)
+struct ImageSource
+{
+	std::string strFile;            // path (".gzi" : baseline index)
+	std::vector<unsigned char> buf; // encoded image, used instead of strFile when not empty
+};
+// client connection of serve mode, closed when the last request of it is answered
+struct ServeConnection
+{
+	int nFd;
+	std::mutex mtxWrite; // one response line at a time
+
+	explicit ServeConnection(const int& nSocketFd)
+		: nFd(nSocketFd)
+	{
+	}
+	~ServeConnection()
+	{
+		close(nFd);
+	}
+	bool WriteLine(const std::string& strLine);
+};
+// diff request of serve mode
+struct ServeJob
+{
+	std::shared_ptr<ServeConnection> pConnection;
+	std::string strId;
+	ImageSource newSrc;
+	ImageSource oldSrc;
+	std::string strFileName; // output prefix (empty : no result image)
+};
+// Bounded queue of serve mode. Push() blocks while the queue is full, so a client which sends
+// faster than the workers diff is held back by its own socket buffer (backpressure).
+class ServeQueue
+{
+public:
+	explicit ServeQueue(const size_t& nMaxSize);
+
+	bool Push(ServeJob& job); // false : closed
+	bool Pop(ServeJob& job);  // false : closed and empty
+	void Close();
+
+private:
+	std::mutex m_mtx;
+	std::condition_variable m_cvNotFull;
+	std::condition_variable m_cvNotEmpty;
+	std::deque<ServeJob> m_jobList;
+	size_t m_nMaxSize;
+	bool m_bClosed;
 };
-// part frame color list for rectangle
-std::vector<cv::Vec3b> g_clrPartFrameList;
-unsigned int g_nClrPartFrameIndex;
+// buffered reader of a socket : request / response lines and inline image data
+class SocketReader
+{
+public:
+	explicit SocketReader(const int& nFd);
 
-int g_nPartFileNo = 0;
-bool g_bCreateChangeImg = false;
+	bool ReadLine(std::string& strLine); // without '\n', false : closed
+	bool Read(const size_t& nSize, std::vector<unsigned char>& buf);
 
+private:
+	bool Fill();
 
-////////// Global function //////////
-int ImgSegMain(int argc, const char** argv);
-int ImgSeg00(const std::string& strOldImgFile, const std::string& strNewImgFile);
-void ImgSeg01(const std::string& strImgFile, const std::string& strOutputFolder);
-void ImgSeg02(const std::string& strOldFile, const std::vector<std::string>& strOldPartFileList, const std::string& strNewFile, const std::vector<std::string>& strNewPartFileList, const std::string& strOutputFolder);
-void ImgSeg03(const std::string& strOldFile, std::map<int, std::vector<std::string> > strPartFileListMap, const std::string& strOutputFolder);
+	int m_nFd;
+	std::vector<char> m_buf;
+	size_t m_nPos;
+	size_t m_nEnd;
+};
+// max inline image data of one serve request [byte]
+const size_t kMaxServeImageSize = 256*1024*1024;
 
-void ExecuteFeatureDetectorAndMatching(const std::vector<std::string>& strOldPartFileList, const std::vector<std::string>& strNewPartFileList, std::map<int, std::vector<std::string> >& strMap);
-void ComputeKeypointAndDescriptor(const std::vector<std::string>& strPartFileList, std::map<std::string, cv::Mat>& strMap);
-void ExecuteTemplateMatch(const std::string& strImgFile, const std::vector<std::string>& strPartFileList, cv::Mat& clrImg, std::vector<SegmentedRegionInfo>& segRegionInfoList);
-void ExecuteTemplateMatchEx(const std::string& strImgFile, const std::vector<std::string>& strPartFileList, cv::Mat& clrImg, std::vector<SegmentedRegionInfo>& segRegionInfoList);
+////////// Global function //////////
+int ExecuteImgSeg(const std::string& strNewFile, const std::string& strOldFile, const DiffOptions& options, const std::string& strOutputFolder);
+int ExecuteImgSeg(const ImageSource& newSrc, const ImageSource& oldSrc, const DiffOptions& options, const std::string& strOutputFolder, DiffResult& result);
+bool WriteReport(const std::string& strReportFile, const std::string& strNewFile, const std::string& strOldFile, const int& nRet, const DiffResult& result, const DiffOptions& options, const std::string& strOutputFolder, const long long& nTimeNs);
+std::string GetStatusName(const int& nRet);
+void GetOutputFileList(const DiffResult& result, const DiffOptions& options, const std::string& strOutputFolder, std::vector<std::string>& strFileList);
+long long GetChangedArea(const DiffResult& result);
+bool HasFailThreshold(const DiffOptions& options);
+bool IsOverFailThreshold(const DiffResult& result, const DiffOptions& options);
+bool IsRenderNeeded(const DiffResult& result, const DiffOptions& options);
+bool ParseFailThreshold(const std::string& strThreshold, DiffOptions& options);
+int ExecuteBatch(const std::string& strManifestFile, const DiffOptions& options, const unsigned int& nJobNum);
+bool ReadManifest(const std::string& strManifestFile, const std::string& strFileName, std::vector<BatchPair>& pairList);
+int ExecuteServe(const std::string& strSocketFile, const DiffOptions& options, const unsigned int& nJobNum, const unsigned int& nQueueSize);
+void ExecuteServeConnection(std::shared_ptr<ServeConnection> pConnection, ServeQueue& queue, std::atomic<bool>& bStop, const int& nListenFd);
+int ExecuteClient(const std::string& strSocketFile, const std::vector<BatchPair>& pairList, const bool& bInline);
+int ExecuteStop(const std::string& strSocketFile);
+int ConnectServeSocket(const std::string& strSocketFile);
+bool SetSocketAddress(const std::string& strSocketFile, struct sockaddr_un& addr);
+bool SendAll(const int& nFd, const char* pData, const size_t& nSize);
+bool ReadFileBuffer(const std::string& strFile, std::vector<unsigned char>& buf);
+std::string GetAbsolutePath(const std::string& strFile);
+int ExecuteDiff(ImageContext& oldImg, ImageContext& newImg, const DiffOptions& options, DiffResult& result, const BaselineIndex* pOldIndex=NULL);
+int ImgSegIndexMain(int argc, const char** argv);
+bool IsIndexFile(const std::string& strFile);
+bool HasIgnoreRegion(const DiffOptions& options);
+void FillIgnoreRegion(const DiffOptions& options, cv::Mat& clrImg);
+bool ParseRectList(const std::string& strRectList, std::vector<cv::Rect>& rectList);
+int ImgSeg00(ImageContext& oldImg, ImageContext& newImg, const DiffOptions& options, std::vector<cv::Range>& changedBandList);
+void ImgSeg01(ImageContext& img, const DiffOptions& options, std::vector<Part>& partList);
+void LoadOrCreatePartList(ImageContext& img, const DiffOptions& options, std::vector<Part>& partList);
+void CreatePartListFromIndex(ImageContext& img, const BaselineIndex& index, std::vector<Part>& partList);
+void ImgSeg02(const std::vector<Part>& oldPartList, const std::vector<Part>& newPartList, const std::vector<cv::Range>& changedBandList, const DiffOptions& options, PartTable& oldTable, PartTable& newTable);
+void ImgSeg03(ImageContext& oldImg, const std::vector<Part>& newPartList, const PartTable& oldTable, const PartTable& newTable, const DiffOptions& options, DiffResult& result);
+void ImgSeg04(ImageContext& oldImg, ImageContext& newImg, const DiffResult& result, const DiffOptions& options, const std::string& strOutputFolder);
+
+void ExecuteFeatureDetectorAndMatching(const std::vector<Part>& oldPartList, const std::vector<Part>& newPartList, const DiffOptions& options, PartTable& oldTable, PartTable& newTable);
+void MatchSamePositionPart(const std::vector<cv::Range>& changedBandList, PartTable& oldTable, PartTable& newTable);
+bool IsInUnchangedBand(const cv::Rect& rect, const std::vector<cv::Range>& changedBandList);
+void ComputeKeypointAndDescriptor(const std::vector<Part>& partList, std::vector<cv::Mat>& descriptorList, const unsigned int& nThreadNum, const DescriptorType& descriptorType, Profiler* pProfiler=NULL);
+void ComputeKeypointAndDescriptor(const std::vector<Part>& partList, const std::vector<int>& nIdList, std::vector<cv::Mat>& descriptorList, const unsigned int& nThreadNum, const DescriptorType& descriptorType, Profiler* pProfiler=NULL);
+void ComputeMatchTable(const PartTable& oldTable, const std::vector<int>& nOldIdList, const PartTable& newTable, const std::vector<int>& nNewIdList, std::vector<int>& nMatchTable, const unsigned int& nThreadNum, const DescriptorType& descriptorType, const double& dPruneRatio, const bool& bFirstMatchOnly, Profiler* pProfiler=NULL);
+cv::Ptr<cv::DescriptorMatcher> CreatePartMatcher(const PartTable& newTable, const int& nNewId, const DescriptorType& descriptorType);
+int ComputePartMatch(const PartTable& oldTable, const int& nOldId, const PartTable& newTable, const int& nNewId, const cv::Ptr<cv::DescriptorMatcher>& matcher, const DescriptorType& descriptorType, const double& dPruneRatio, Profiler* pProfiler=NULL);
+int CheckDescriptorMatchDecision(const std::vector<Part>& oldPartList, const std::vector<Part>& newPartList, const unsigned int& nThreadNum);
+int ExecuteCheckDescriptor(const std::string& strNewFile, const std::string& strOldFile, const DiffOptions& options);
+bool IsMatchCandidate(const cv::Rect& oldRect, const cv::Rect& newRect, const double& dPruneRatio);
+void ExecuteTemplateMatchEx(ImageContext& img, const std::vector<Part>& partList, const std::vector<int>& nIdList, const std::vector<cv::Rect>& matchedRectList, const DiffOptions& options, std::vector<DiffRegion>& regionList);
+bool LocateTemplate(ImageContext& img, const Part& part, const cv::Rect& matchedRect, const DiffOptions& options, FrameCorrelator* pCorrelator, cv::Point& ptMin);
+bool MatchTemplateInRect(const cv::Mat& gryImg, const cv::Mat& partGryImg, const cv::Rect& searchRect, double& dMinVal, cv::Point& ptMin);
+
+uint64_t ComputeHash(const unsigned char* pData, const size_t& nSize, const uint64_t& nSeed);
+void ComputeStripHash(const cv::Mat& img, const int& nStripH, std::vector<uint64_t>& hashList);
+void GetChangedBand(const cv::Mat& oldImg, const cv::Mat& newImg, const int& nStripH, std::vector<cv::Range>& changedBandList);
+void GetChangedBand(const std::vector<uint64_t>& oldHashList, const std::vector<uint64_t>& newHashList, const cv::Mat& oldImg, const cv::Mat& newImg, const int& nStripH, std::vector<cv::Range>& changedBandList);
+bool IsSameRows(const cv::Mat& oldImg, const cv::Mat& newImg, const int& nYs, const int& nYe);
 
 void CreateDirectory(const std::string& strFolderPath);
 std::vector<std::string> Split(const std::string& s, const std::string& delim);
 std::vector<std::string> Split(const std::string& s, char delim);
+std::string EscapeJSON(const std::string& str);
 
+int ComputeDiffMask(const cv::Mat& clrImg1, const cv::Mat& clrImg2, cv::Mat& diffMask);
+void DrawDiffMask(cv::Mat& img, const cv::Point& ptOrigin, const cv::Mat& diffMask, const cv::Scalar& clr);
 void ConvertColorToGray(cv::Mat& img);
 unsigned char* ConvertCVMATtoUCHAR(const cv::Mat& img, const int& nH=-1, const int& nW=-1);
 
 void CreatePNGfromCVMAT(const int& nNum, const cv::Mat& img, const std::string& strOutputFolder);
-void CreatePNGfromUCHAR(const int& nNum, const int& nW, const int& nH, unsigned char* pImg, const std::string& strOutputFolder);
-void CreateBMP(const std::string& strFile, const int& nW, const int& nH, unsigned char* pImg);
-void ConvertBMPtoPNG(const std::string& strBMPFile, const std::string& strPNGFile);
+void CreatePNGfromCVMATEx(const int& nNum, const cv::Mat& img, const std::string& strOutputFolder, Profiler* pProfiler);
+long long GetFileSize(const std::string& strFile);
+bool IsTooSmallPart(const int& nW, const int& nH);
+int GetBandHeight(const int& nW, const int& nH, const unsigned int& nMaxMemoryMB);
+bool CreateWatershedImage(const cv::Mat& clrImg, const cv::Mat& binImg, cv::Mat& wsdImg, Profiler* pProfiler=NULL, WorkArena* pArena=NULL);
+int CreateMarkerImage(const cv::Size& size, const std::vector< std::vector<cv::Point> >& contours, const std::vector<cv::Vec4i>& hierarchy, cv::Mat& markers);
+void CreateBlockPartRectList(const cv::Mat& gryImg, const int& nBandH, std::vector<cv::Rect>& partRectList, Profiler* pProfiler=NULL, WorkArena* pArena=NULL);
+void GetRunLengthPartRectList(const cv::Mat& binImg, std::vector<cv::Rect>& partRectList, WorkArena* pArena=NULL);
+void ReuseArena(WorkArena& arena);
+void RunWorkers(const std::function<void()>& worker, const unsigned int& nThreadNum);
+bool ParseSegmenterType(const std::string& strSegmenter, SegmenterType& segmenterType);
 std::string GetPNGFile(const int& nNum, const std::string& strOutputFolder);
 
 bool GetTimeYYYYMMDDHHMMSS(tm* pTM, std::string& strYYYYMMDD, std::string& strHHMMSS);
@@ -100,15 +506,24 @@ bool GetTimeYYYYMMDD(tm* pTM, std::string& strYYYYMMDD);
 bool GetTimeHHMMSS(tm* pTM, std::string& strHHMMSS);
 
 bool GetGroupedDataTest(const int& nSrcW, const int& nSrcH, unsigned char* pSrcImg, std::vector<std::vector<PixelConnectivity*>*>& solid);
+bool GetGroupedData(const int& nSrcW, const int& nSrcH, unsigned char* pSrcImg, std::vector<cv::Rect>& partRectList);
 
-inline void SetProcessStartMsg(const std::string& strFuncName, const int& nStepNo, const std::string& strStepName)
+inline std::string GetProfileStepName(const std::string& strFuncName, const int& nStepNo)
+{
+	std::ostringstream strStep;
+	strStep << strFuncName << ".Step" << nStepNo;
+	return strStep.str();
+}
+inline void SetProcessStartMsg(const std::string& strFuncName, const int& nStepNo, const std::string& strStepName, Profiler* pProfiler=NULL)
 {
 	std::string strHHMMSS;
 	GetTimeHHMMSS(NULL, strHHMMSS);
 	std::clog << strFuncName << " : Step" << nStepNo << ". " << strStepName << " --START ( " << strHHMMSS << " )--" << std::endl;
+	if (pProfiler!=NULL) pProfiler->StartStep(GetProfileStepName(strFuncName, nStepNo));
 }
-inline void SetProcessEndMsg(const std::string& strFuncName, const int& nStepNo, const std::string& strStepName)
+inline void SetProcessEndMsg(const std::string& strFuncName, const int& nStepNo, const std::string& strStepName, Profiler* pProfiler=NULL)
 {
+	if (pProfiler!=NULL) pProfiler->EndStep(GetProfileStepName(strFuncName, nStepNo));
 	std::string strHHMMSS;
 	GetTimeHHMMSS(NULL, strHHMMSS);
 	std::clog << strFuncName << " : Step" << nStepNo << ". " << strStepName << " --END ( " << strHHMMSS << " )--" << std::endl;
@@ -117,21 +532,93 @@ inline void SetProcessErrorMsg(const int& nStepNo)
 {
 	std::clog << " -> Error : Step" << nStepNo << std::endl;
 }
+// timings of the sub steps (pProfiler NULL : nothing is recorded)
+inline long long StartProfile(Profiler* pProfiler)
+{
+	return (pProfiler!=NULL) ? Profiler::GetTimeNs() : 0;
+}
+inline void EndProfile(Profiler* pProfiler, const std::string& strName, const long long& nStartNs, const long long& nValue=-1)
+{
+	if (pProfiler!=NULL) pProfiler->AddTime(strName, nStartNs, nValue);
+}
+inline void AddProfileCount(Profiler* pProfiler, const std::string& strName, const long long& nCount)
+{
+	if (pProfiler!=NULL) pProfiler->AddCount(strName, nCount);
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 int ImgSegMain(int argc, const char** argv)
 {
+	// subcommands : "index" creates a baseline index, "serve" diffs the requests on a socket,
+	// "client" and "stop" send requests to it, "diff" is the same as no subcommand
+	if (argc>=2 && std::string(argv[1])=="index")
+	{
+		return (ImgSegIndexMain(argc-1, argv+1)==0) ? 0 : kExitCodeError;
+	}
+	std::string strCommand = "diff";
+	if (argc>=2)
+	{
+		std::string strArg = argv[1];
+		if (strArg=="diff" || strArg=="serve" || strArg=="client" || strArg=="stop")
+		{
+			strCommand = strArg;
+			--argc;
+			++argv;
+		}
+	}
+
 	std::clog.setstate(std::ios_base::failbit);
 	std::string strOldFile, strNewFile;
+	std::string strDescriptorType;
+	std::string strManifestFile;
+	std::string strProfileFile;
+	std::string strOldIndexFile;
+	std::string strSocketFile;
+	std::string strReportFile;
+	std::string strFailThreshold;
+	std::string strIgnoreRects;
+	std::string strIgnoreMaskFile;
+	std::string strROI;
+	std::string strSegmenter;
+	unsigned int nJobNum = 0;
+	unsigned int nQueueSize = 0;
+	bool bCheckDescriptor = false;
+	bool bInline = false;
+	DiffOptions diffOptions;
 	//Set the options
 	cxxopts::Options options("options");
 	try {
 		options.add_options()
 			("new_image", "New image file path", cxxopts::value<std::string>(strNewFile))
 			("old_image", "Old image file path", cxxopts::value<std::string>(strOldFile))
-			("o,output_name", "Output prefix name", cxxopts::value<std::string>(g_strFileName)->default_value("image_difference"))
+			("o,output_name", "Output prefix name", cxxopts::value<std::string>(diffOptions.strFileName)->default_value("image_difference"))
 			("v,verbose", "Enable verbose output message")
 			("create-change-image", "Generate 2 more output files. 1.Output_delete.png: An image shows decreasing part as the green rectangle on the old image. 2.Output_add.png: An image shows increasing part as the green rectangle on the new image.")
+			("threads", "Number of worker threads", cxxopts::value<unsigned int>(diffOptions.nThreadNum))
+			("prune-ratio", "Max part size ratio to match", cxxopts::value<double>(diffOptions.dPruneRatio))
+			("descriptor", "Descriptor type (binary or float)", cxxopts::value<std::string>(strDescriptorType))
+			("check-descriptor", "Compare binary and float match results")
+			("histogram-check", "Treat same color histogram as no difference")
+			("max-memory", "Segmentation memory budget in MB", cxxopts::value<unsigned int>(diffOptions.nMaxMemoryMB))
+			("search-margin", "Template search window margin in px", cxxopts::value<int>(diffOptions.nSearchMargin))
+			("pyramid", "Pyramid levels of template search", cxxopts::value<int>(diffOptions.nPyramidLevel))
+			("profile", "Write stage timings to a JSON file", cxxopts::value<std::string>(strProfileFile))
+			("cache-dir", "Part and descriptor cache directory", cxxopts::value<std::string>(diffOptions.strCacheDir))
+			("cache-size", "Cache size limit in MB", cxxopts::value<unsigned int>(diffOptions.nCacheMaxMB))
+			("old-index", "Index file of the old image", cxxopts::value<std::string>(strOldIndexFile))
+			("batch", "Diff image pairs listed in a TSV file", cxxopts::value<std::string>(strManifestFile))
+			("jobs", "Number of pairs diffed at once", cxxopts::value<unsigned int>(nJobNum))
+			("socket", "Unix socket of serve mode", cxxopts::value<std::string>(strSocketFile))
+			("queue", "Max requests waiting in serve mode", cxxopts::value<unsigned int>(nQueueSize))
+			("inline", "Send image data to serve mode")
+			("report", "Write the diff result to a JSON file", cxxopts::value<std::string>(strReportFile))
+			("no-images", "Don't write result images")
+			("fail-threshold", "Fail over this changed ratio or pixels", cxxopts::value<std::string>(strFailThreshold))
+			("always-render", "Write result images under the threshold")
+			("ignore-rects", "Regions to ignore (x,y,w,h;...)", cxxopts::value<std::string>(strIgnoreRects))
+			("ignore-mask", "Mask image of pixels to ignore", cxxopts::value<std::string>(strIgnoreMaskFile))
+			("roi", "Region to diff (x,y,w,h)", cxxopts::value<std::string>(strROI))
+			("segmenter", "Part segmenter (watershed or blocks)", cxxopts::value<std::string>(strSegmenter))
 			("h,help", "Print help")
 			;
 		options.parse_positional({ "new_image", "old_image", "output_name" });
@@ -142,13 +629,28 @@ int ImgSegMain(int argc, const char** argv)
 			std::cout << options.help() << std::endl;
 			return 0;
 		}
-		if (result.count("new_image")==false || result.count("old_image")==false)
+		if (result.count("old-index"))
+		{
+			// the output prefix is given by -o, not by the position of the old image
+			if (result.count("old_image"))
+			{
+				std::cerr << "Old image and --old-index can't be used together (output prefix : -o)" << std::endl;
+				return kExitCodeError;
+			}
+			strOldFile = strOldIndexFile;
+		}
+		if (strCommand!="diff" && strSocketFile.empty())
+		{
+			std::cerr << "--socket is required by " << strCommand << std::endl;
+			return kExitCodeError;
+		}
+		if (strCommand!="serve" && strCommand!="stop" && result.count("batch")==false && (result.count("new_image")==false || strOldFile.empty()))
 		{
 			std::cerr << "Not enough input" << std::endl;
 			std::cerr << " -> 1st : Relative path for new color image file" << std::endl;
 			std::cerr << " -> 2nd : Relative path for old color image file" << std::endl;
 			std::cerr << " -> 3rd : Result file name prefix (default: image_difference) " << std::endl;
-			return -1;
+			return kExitCodeError;
 		}
 		if (result.count("verbose"))
 		{
@@ -156,609 +658,3672 @@ int ImgSegMain(int argc, const char** argv)
 		}
 		if (result.count("create-change-image"))
 		{
-			g_bCreateChangeImg = true;
+			diffOptions.bCreateChangeImg = true;
+		}
+		if (result.count("descriptor"))
+		{
+			if (strDescriptorType=="binary")
+			{
+				diffOptions.descriptorType = kDescriptorBinary;
+			}
+			else if (strDescriptorType=="float")
+			{
+				diffOptions.descriptorType = kDescriptorFloat;
+			}
+			else
+			{
+				std::cerr << "Unknown descriptor type : " << strDescriptorType << std::endl;
+				return kExitCodeError;
+			}
+		}
+		if (result.count("check-descriptor"))
+		{
+			bCheckDescriptor = true;
+		}
+		if (result.count("histogram-check"))
+		{
+			diffOptions.bHistogramCheck = true;
+		}
+		if (result.count("inline"))
+		{
+			bInline = true;
+		}
+		if (result.count("fail-threshold") && ParseFailThreshold(strFailThreshold, diffOptions)==false)
+		{
+			std::cerr << "Invalid fail threshold : " << strFailThreshold << std::endl;
+			return kExitCodeError;
+		}
+		if (result.count("always-render"))
+		{
+			diffOptions.bAlwaysRender = true;
+		}
+		if (result.count("ignore-rects") && ParseRectList(strIgnoreRects, diffOptions.ignoreRectList)==false)
+		{
+			std::cerr << "Invalid ignore rects : " << strIgnoreRects << std::endl;
+			return kExitCodeError;
+		}
+		if (result.count("ignore-mask"))
+		{
+			// white (non-zero) pixels are ignored
+			diffOptions.ignoreMask = cv::imread(strIgnoreMaskFile, cv::IMREAD_GRAYSCALE);
+			if (diffOptions.ignoreMask.empty())
+			{
+				std::cerr << "Can't load ignore mask : " << strIgnoreMaskFile << std::endl;
+				return kExitCodeError;
+			}
+		}
+		if (result.count("segmenter") && ParseSegmenterType(strSegmenter, diffOptions.segmenterType)==false)
+		{
+			std::cerr << "Unknown segmenter : " << strSegmenter << std::endl;
+			return kExitCodeError;
+		}
+		if (result.count("roi"))
+		{
+			std::vector<cv::Rect> roiRectList;
+			if (ParseRectList(strROI, roiRectList)==false || roiRectList.size()!=1)
+			{
+				std::cerr << "Invalid roi : " << strROI << std::endl;
+				return kExitCodeError;
+			}
+			diffOptions.roiRect = roiRectList.at(0);
+		}
+		if (result.count("no-images"))
+		{
+			diffOptions.bCreateDiffImg = false;
+			diffOptions.bCreateChangeImg = false;
+		}
+		if (diffOptions.nThreadNum==0)
+		{
+			diffOptions.nThreadNum = std::max(1u, std::thread::hardware_concurrency());
 		}
 	}
 	catch (cxxopts::OptionException &e) {
 		std::cerr << e.what() << std::endl;
-		return -1;
+		return kExitCodeError;
 	}
 
-	//ImgSeg00
+	Profiler profiler;
+	if (strProfileFile.empty()==false || strReportFile.empty()==false)
+	{
+		diffOptions.pProfiler = &profiler;
+	}
+
+	int nRet = 0;
+	if (strCommand=="serve")
 	{
-		int ImgSeg00_return = ImgSeg00(strOldFile, strNewFile);
-		if (ImgSeg00_return == -2)
+		nRet = ExecuteServe(strSocketFile, diffOptions, nJobNum, nQueueSize);
+	}
+	else if (strCommand=="stop")
+	{
+		nRet = ExecuteStop(strSocketFile);
+	}
+	else if (strCommand=="client")
+	{
+		std::vector<BatchPair> pairList;
+		if (strManifestFile.empty()==false)
 		{
-			std::cerr << "Can't load images." << std::endl;
-			return -1;
+			if (ReadManifest(strManifestFile, diffOptions.strFileName, pairList)==false)
+			{
+				std::cerr << "Can't open manifest file." << std::endl;
+				return kExitCodeError;
+			}
 		}
-		else if (ImgSeg00_return == -1)
+		else
 		{
-			std::cerr << "There isn't any difference in those images." << std::endl;
-			return -1;
+			BatchPair pair;
+			pair.nLineNo = 1;
+			pair.strNewFile = strNewFile;
+			pair.strOldFile = strOldFile;
+			pair.strFileName = diffOptions.strFileName;
+			pairList.push_back(pair);
 		}
+		nRet = ExecuteClient(strSocketFile, pairList, bInline);
 	}
-
-	//ImgSeg01
+	else if (strManifestFile.empty()==false)
 	{
-		// create new folder under temporary folder, and parts division
-		std::string strOutputFolder = "/tmp/image_diff_temp/new/";
-		CreateDirectory(strOutputFolder);
-		g_nPartFileNo = 1;
-		ImgSeg01(strNewFile, strOutputFolder);
-		g_strNewPartFileList = g_strFileList;
-		g_strFileList.clear();
-
-		// create old folder under temporary folder, and parts division
-		strOutputFolder = "/tmp/image_diff_temp/old/";
-		CreateDirectory(strOutputFolder);
-		g_nPartFileNo = 1;
-		ImgSeg01(strOldFile, strOutputFolder);
-		g_strOldPartFileList = g_strFileList;
-		g_strFileList.clear();
+		nRet = ExecuteBatch(strManifestFile, diffOptions, nJobNum);
 	}
-
-	//ImgSeg02
+	else if (bCheckDescriptor == true)
 	{
-		std::string strOutputFolder = "./";
-		ImgSeg02(strOldFile, g_strOldPartFileList, strNewFile, g_strNewPartFileList, strOutputFolder);
+		nRet = ExecuteCheckDescriptor(strNewFile, strOldFile, diffOptions);
+		if (nRet == -2)
+		{
+			std::cerr << "Can't load images." << std::endl;
+		}
+		else if (nRet == kExitCodeDecisionDiffer)
+		{
+			std::cerr << "Binary and float descriptor decide differently." << std::endl;
+		}
 	}
-
-	//ImgSeg03
+	else
 	{
-		std::string strOutputFolder = "./";
-		ImgSeg03(strOldFile, g_strFileDiffInfoListMap, strOutputFolder);
-		if (system("exec rm -r /tmp/image_diff_temp") != 0)
+		ImageSource newSrc, oldSrc;
+		newSrc.strFile = strNewFile;
+		oldSrc.strFile = strOldFile;
+		DiffResult result;
+		long long nStartNs = Profiler::GetTimeNs();
+		nRet = ExecuteImgSeg(newSrc, oldSrc, diffOptions, "./", result);
+		if (strReportFile.empty()==false && WriteReport(strReportFile, strNewFile, strOldFile, nRet, result, diffOptions, "./", Profiler::GetTimeNs()-nStartNs)==false)
 		{
-			std::cerr << "Fail in delete temp directoty." << std::endl;
-			return -1;
+			std::cerr << "Can't write report file." << std::endl;
+		}
+		if (nRet == 0 && HasFailThreshold(diffOptions) && IsOverFailThreshold(result, diffOptions))
+		{
+			std::cerr << "Changed area is over the fail threshold." << std::endl;
+			nRet = kExitCodeOverThreshold;
+		}
+		else if (nRet == -2)
+		{
+			std::cerr << "Can't load images." << std::endl;
+		}
+		else if (nRet == -4)
+		{
+			std::cerr << "The index was created with other --segmenter or --max-memory." << std::endl;
+		}
+		else if (nRet == -1)
+		{
+			std::cerr << "There isn't any difference in those images." << std::endl;
+			nRet = 0;
 		}
 	}
 
-	return 0;
+	if (strProfileFile.empty()==false && profiler.WriteJSON(strProfileFile)==false)
+	{
+		std::cerr << "Can't write profile file." << std::endl;
+	}
+
+	// an error must not look like a pass of --fail-threshold
+	return (nRet<0) ? kExitCodeError : nRet;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int ImgSeg00(const std::string& strOldImgFile, const std::string& strNewImgFile)
+// "gazosan index IMAGE INDEX_FILE" : write the baseline index of IMAGE
+int ImgSegIndexMain(int argc, const char** argv)
 {
-	cv::Mat clrOldImg = cv::imread(strOldImgFile, cv::IMREAD_COLOR);
-	cv::Mat clrNewImg = cv::imread(strNewImgFile, cv::IMREAD_COLOR);
-	if (clrOldImg.data==NULL || clrNewImg.data == NULL)
-	{
-		return -2;
-	}
-
-	cv::Mat hsvOldImg, hsvNewImg;
-	cv::cvtColor(clrOldImg, hsvOldImg, cv::COLOR_BGR2HSV);
-	cv::cvtColor(clrNewImg, hsvNewImg, cv::COLOR_BGR2HSV);
-
-	int nHistSize[] = { 256, 256 };
-	float fHRanges[] = { 0, 180 };
-    float fSRanges[] = { 0, 256 };
-	const float* pRanges[] = { fHRanges, fSRanges };
-
-	int nChannels[] = {0,1};
-
-	cv::Mat histOld, histNew;
-	cv::calcHist(&hsvOldImg, 1, nChannels, cv::Mat(), histOld, 2, nHistSize, pRanges, true, false);
-	cv::normalize(histOld, histOld, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
-	cv::calcHist(&hsvNewImg, 1, nChannels, cv::Mat(), histNew, 2, nHistSize, pRanges, true, false);
-	cv::normalize(histNew, histNew, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
+	std::clog.setstate(std::ios_base::failbit);
+	std::string strImageFile, strIndexFile;
+	std::string strSegmenter;
+	DiffOptions diffOptions;
+	cxxopts::Options options("index");
+	try {
+		options.add_options()
+			("image", "Image file path", cxxopts::value<std::string>(strImageFile))
+			("index_file", "Index file path", cxxopts::value<std::string>(strIndexFile))
+			("v,verbose", "Enable verbose output message")
+			("threads", "Number of worker threads", cxxopts::value<unsigned int>(diffOptions.nThreadNum))
+			("max-memory", "Segmentation memory budget in MB", cxxopts::value<unsigned int>(diffOptions.nMaxMemoryMB))
+			("pyramid", "Pyramid levels stored in the index", cxxopts::value<int>(diffOptions.nPyramidLevel))
+			("segmenter", "Part segmenter (watershed or blocks)", cxxopts::value<std::string>(strSegmenter))
+			("h,help", "Print help")
+			;
+		options.parse_positional({ "image", "index_file" });
 
-	double dOldToNew = cv::compareHist(histOld, histNew, 1);
-	std::clog << " Compare Old to New : " << dOldToNew << std::endl;
+		auto result = options.parse(argc, argv);
+		if (result.count("help"))
+		{
+			std::cout << options.help() << std::endl;
+			return 0;
+		}
+		if (result.count("image")==false || result.count("index_file")==false)
+		{
+			std::cerr << "Not enough input" << std::endl;
+			std::cerr << " -> 1st : Relative path for image file" << std::endl;
+			std::cerr << " -> 2nd : Relative path for index file" << std::endl;
+			return -1;
+		}
+		if (result.count("verbose"))
+		{
+			std::clog.clear();
+		}
+		if (result.count("segmenter") && ParseSegmenterType(strSegmenter, diffOptions.segmenterType)==false)
+		{
+			std::cerr << "Unknown segmenter : " << strSegmenter << std::endl;
+			return -1;
+		}
+	}
+	catch (cxxopts::OptionException &e) {
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
 
-    if (dOldToNew <= 0.00001)
-    {
+	ImageContext img(strImageFile);
+	if (img.GetColor().data==NULL)
+	{
+		std::cerr << "Can't load images." << std::endl;
 		return -1;
 	}
-        return 0;
+	if (BaselineIndex::Create(img.GetColor(), diffOptions, strIndexFile)==false)
+	{
+		std::cerr << "Can't write index file." << std::endl;
+		return -1;
+	}
+	return 0;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void ImgSeg01(const std::string& strImgFile, const std::string& strOutputFolder)
+// baseline index file (created by "gazosan index")
+bool IsIndexFile(const std::string& strFile)
 {
-	std::string strFuncName = "ImgSeg01";
-	int nStepNo = 0;
-	std::string strStepName = "";
+	return strFile.size()>4 && strFile.compare(strFile.size()-4, 4, ".gzi")==0;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	// Step1 : load image
-	++nStepNo;
-	strStepName = "Load image";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	cv::Mat clrImg = cv::imread(strImgFile, cv::IMREAD_COLOR);
-	if (clrImg.data==NULL)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool HasIgnoreRegion(const DiffOptions& options)
+{
+	return options.ignoreRectList.empty()==false || options.ignoreMask.empty()==false || options.roiRect.area()>0;
+}
+// Fill the ignored pixels (ignore rects, ignore mask and outside of the roi) of a BGR image with white
+// in place, the background of the binary image, so they have no edge for the segmentation.
+void FillIgnoreRegion(const DiffOptions& options, cv::Mat& clrImg)
+{
+	const cv::Scalar clrIgnore(255,255,255);
+	const cv::Rect imgRect(0, 0, clrImg.cols, clrImg.rows);
+	if (options.roiRect.area()>0)
 	{
-		SetProcessErrorMsg(nStepNo);
-		return;
+		cv::Rect roiRect = options.roiRect & imgRect;
+		if (roiRect.area()>0)
+		{
+			// the rows above and below the roi, and the pixels left and right of it
+			int nRoiXe = roiRect.x + roiRect.width;
+			clrImg.rowRange(0, roiRect.y).setTo(clrIgnore);
+			clrImg.rowRange(roiRect.y+roiRect.height, clrImg.rows).setTo(clrIgnore);
+			clrImg(cv::Rect(0, roiRect.y, roiRect.x, roiRect.height)).setTo(clrIgnore);
+			clrImg(cv::Rect(nRoiXe, roiRect.y, clrImg.cols-nRoiXe, roiRect.height)).setTo(clrIgnore);
+		}
+		else
+		{
+			clrImg.setTo(clrIgnore);
+		}
 	}
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step1 : load image
-
-
-	// Step2 : color -> gray -> binary
-	++nStepNo;
-	strStepName = "Transform image color -> gray -> binary";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	cv::Mat gryImg;
-	cv::cvtColor(clrImg, gryImg, cv::COLOR_BGR2GRAY);
-
-	cv::Mat binImg;
-	cv::threshold(gryImg, binImg, 200, 255, cv::THRESH_BINARY);
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step2 : color -> gray -> binary
-
-
-	// Step 3 : morphology process
-	++nStepNo;
-	strStepName = "Morphology process";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	int nIter = 7;
-	cv::Mat grdImg;
-	//cv::Mat kernel(3, 3, CV_8U, cv::Scalar(1)); // =cv::MORPH_RECT
-	cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3,3));
-	cv::morphologyEx(binImg, grdImg, cv::MORPH_GRADIENT, kernel, cv::Point(-1,-1), nIter);
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step 3 : morphology process
-
+	for (unsigned int i=0; i<options.ignoreRectList.size(); ++i)
+	{
+		cv::Rect rect = options.ignoreRectList.at(i) & imgRect;
+		if (rect.area()>0)
+		{
+			clrImg(rect).setTo(clrIgnore);
+		}
+	}
+	if (options.ignoreMask.empty()==false)
+	{
+		cv::Rect rect = cv::Rect(0, 0, options.ignoreMask.cols, options.ignoreMask.rows) & imgRect;
+		if (rect.area()>0)
+		{
+			clrImg(rect).setTo(clrIgnore, options.ignoreMask(rect));
+		}
+	}
+}
+// "x,y,w,h;x,y,w,h;..."
+bool ParseRectList(const std::string& strRectList, std::vector<cv::Rect>& rectList)
+{
+	std::vector<std::string> strRectItemList = Split(strRectList, ';');
+	for (unsigned int i=0; i<strRectItemList.size(); ++i)
+	{
+		cv::Rect rect;
+		char chEnd = 0;
+		if (sscanf(strRectItemList.at(i).c_str(), "%d,%d,%d,%d%c", &rect.x, &rect.y, &rect.width, &rect.height, &chEnd)!=4
+			|| rect.width<=0 || rect.height<=0)
+		{
+			return false;
+		}
+		rectList.push_back(rect);
+	}
+	return rectList.empty()==false;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	// Step 4 : find contours and auto labeling
-	++nStepNo;
-	strStepName = "Find contours and Auto labeling";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	int compCount = 0;
-	std::vector< std::vector<cv::Point> > contours;
-	std::vector<cv::Vec4i> hierarchy;
-	grdImg.convertTo(grdImg, CV_32SC1, 1.0);
-	cv::findContours(grdImg, contours, hierarchy, cv::RETR_CCOMP, cv::CHAIN_APPROX_SIMPLE);
-	if(contours.empty()==true)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Diff one pair of images, and create the result images named strOutputFolder + options.strFileName + "_*.png".
+// return 0 : success, -1 : no difference, -2 : can't load images, -4 : index of other segmentation options
+int ExecuteImgSeg(const std::string& strNewFile, const std::string& strOldFile, const DiffOptions& options, const std::string& strOutputFolder)
+{
+	ImageSource newSrc, oldSrc;
+	newSrc.strFile = strNewFile;
+	oldSrc.strFile = strOldFile;
+	DiffResult result;
+	return ExecuteImgSeg(newSrc, oldSrc, options, strOutputFolder, result);
+}
+// no result image when options.strFileName is empty, or when the result is under the fail threshold
+int ExecuteImgSeg(const ImageSource& newSrc, const ImageSource& oldSrc, const DiffOptions& options, const std::string& strOutputFolder, DiffResult& result)
+{
+	// each image is decoded only once, and shared by the engine and the result images
+	// (an old image index is mapped, and used as it is)
+	BaselineIndex oldIndex;
+	bool bUseIndex = oldSrc.buf.empty() && IsIndexFile(oldSrc.strFile);
+	ImageContext oldImg(oldSrc.strFile);
+	ImageContext newImg(newSrc.strFile);
+	long long nStartNs = StartProfile(options.pProfiler);
+	if (bUseIndex)
 	{
-		SetProcessErrorMsg(nStepNo);
-		return;
+		if (oldIndex.Open(oldSrc.strFile)==false)
+		{
+			return -2;
+		}
+		oldImg = ImageContext(oldIndex);
+		EndProfile(options.pProfiler, "index_open", nStartNs);
 	}
-	cv::Mat markers = cv::Mat::zeros(grdImg.rows, grdImg.cols, CV_32SC1);
-	int idx = 0;
-	for( ;idx>=0; idx=hierarchy[idx][0], compCount++)
+	else
 	{
-		cv::drawContours(markers, contours, idx, cv::Scalar::all(compCount+1), -1, 8, hierarchy, INT_MAX);
-		markers = markers + 1;
+		if (oldSrc.buf.empty()==false)
+		{
+			oldImg = ImageContext(cv::imdecode(oldSrc.buf, cv::IMREAD_COLOR));
+		}
+		oldImg.GetColor();
+		EndProfile(options.pProfiler, "decode", nStartNs);
+	}
+	nStartNs = StartProfile(options.pProfiler);
+	if (newSrc.buf.empty()==false)
+	{
+		newImg = ImageContext(cv::imdecode(newSrc.buf, cv::IMREAD_COLOR));
 	}
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step 4 : find contours and auto labeling
+	newImg.GetColor();
+	EndProfile(options.pProfiler, "decode", nStartNs);
 
+	DiffEngine engine(options);
+	int nRet = bUseIndex ? engine.Diff(newImg.GetColor(), oldIndex, result) : engine.Diff(newImg.GetColor(), oldImg.GetColor(), result);
+	if (nRet != 0)
+	{
+		return nRet;
+	}
 
-	// Step 5 : watershed
-	++nStepNo;
-	strStepName = "Watershed process";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	cv::watershed(clrImg, markers);
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step 5 : watershed
+	//ImgSeg04
+	if (options.strFileName.empty()==false && IsRenderNeeded(result, options))
+	{
+		ImgSeg04(oldImg, newImg, result, options, strOutputFolder);
+	}
 
+	return 0;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	// Step 6 : change color and create watershed png image
-	++nStepNo;
-	strStepName = "Change color and Create Watershed png image";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	cv::Mat wsdImg(markers.size(), CV_8UC3);
-	for (int y=0; y<markers.rows; ++y)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Write the result of one pair as JSON : the rects of the parts, the changed pixels of each matched part,
+// the changed area (see GetChangedArea) and its ratio to the old image pixels, the result images and the stage timings.
+bool WriteReport(const std::string& strReportFile, const std::string& strNewFile, const std::string& strOldFile, const int& nRet, const DiffResult& result, const DiffOptions& options, const std::string& strOutputFolder, const long long& nTimeNs)
+{
+	std::ofstream ofs(strReportFile.c_str());
+	if (ofs.is_open()==false)
 	{
-		for (int x=0; x<markers.cols; ++x)
-		{
-			int index = markers.at<int>(y, x);
-			if (index==-1)
-			{
-				wsdImg.at<cv::Vec3b>(y, x) = cv::Vec3b(128,128,128);
-			}
-			else if (index==0 || index>compCount)
-			{
-				wsdImg.at<cv::Vec3b>(y, x) = cv::Vec3b(0,0,0);
-			}
-			else
-			{
-				wsdImg.at<cv::Vec3b>(y, x) = cv::Vec3b(128,128,128);
-			}
-		}
+		return false;
+	}
+	// the same changed area as the fail threshold
+	long long nChangedPixelNum = GetChangedArea(result);
+	long long nOldPixelNum = (long long)result.oldSize.width * result.oldSize.height;
+	std::vector<std::string> strOutputList;
+	if (nRet==0)
+	{
+		GetOutputFileList(result, options, strOutputFolder, strOutputList);
 	}
-	CreatePNGfromCVMAT(0, wsdImg, strOutputFolder);
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step 6 : change color and allocate memory for watershed png
 
+	ofs << "{\n  \"status\": \"" << GetStatusName(nRet) << "\","
+	    << "\n  \"new\": {\"file\": \"" << EscapeJSON(strNewFile) << "\", \"width\": " << result.newSize.width << ", \"height\": " << result.newSize.height << "},"
+	    << "\n  \"old\": {\"file\": \"" << EscapeJSON(strOldFile) << "\", \"width\": " << result.oldSize.width << ", \"height\": " << result.oldSize.height << "},"
+	    << "\n  \"time_ns\": " << nTimeNs << ","
+	    << "\n  \"changed_pixels\": " << nChangedPixelNum << ","
+	    << "\n  \"diff_ratio\": " << ((nOldPixelNum>0) ? (double)nChangedPixelNum / nOldPixelNum : 0.0) << ",";
+	if (HasFailThreshold(options))
+	{
+		ofs << "\n  \"over_threshold\": " << (IsOverFailThreshold(result, options) ? "true" : "false") << ",";
+	}
+	ofs << "\n  \"matched\": [";
+	for (unsigned int i=0; i<result.matchedRegionList.size(); ++i)
+	{
+		const DiffRegion& region = result.matchedRegionList.at(i);
+		ofs << (i==0 ? "\n" : ",\n") << "    {\"old\": [" << region.oldRect.x << ", " << region.oldRect.y << ", " << region.oldRect.width << ", " << region.oldRect.height << "]"
+		    << ", \"new\": [" << region.newRect.x << ", " << region.newRect.y << ", " << region.newRect.width << ", " << region.newRect.height << "]"
+		    << ", \"changed_pixels\": " << region.nDiffPixelNum << "}";
+	}
+	ofs << (result.matchedRegionList.empty() ? "]," : "\n  ],") << "\n  \"deleted\": [";
+	for (unsigned int i=0; i<result.deletedRectList.size(); ++i)
+	{
+		const cv::Rect& rect = result.deletedRectList.at(i);
+		ofs << (i==0 ? "" : ", ") << "[" << rect.x << ", " << rect.y << ", " << rect.width << ", " << rect.height << "]";
+	}
+	ofs << "],\n  \"added\": [";
+	for (unsigned int i=0; i<result.addedRectList.size(); ++i)
+	{
+		const cv::Rect& rect = result.addedRectList.at(i);
+		ofs << (i==0 ? "" : ", ") << "[" << rect.x << ", " << rect.y << ", " << rect.width << ", " << rect.height << "]";
+	}
+	ofs << "],\n  \"output\": [";
+	for (unsigned int i=0; i<strOutputList.size(); ++i)
+	{
+		ofs << (i==0 ? "" : ", ") << "\"" << EscapeJSON(strOutputList.at(i)) << "\"";
+	}
+	ofs << "],\n  \"stages\": ";
+	if (options.pProfiler!=NULL)
+	{
+		options.pProfiler->WriteStageJSON(ofs, "  ");
+	}
+	else
+	{
+		ofs << "{}";
+	}
+	ofs << "\n}" << std::endl;
+	return ofs.good();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	// Step 7 : grouping and create png for each parts
-	++nStepNo;
-	strStepName = "Grouping and Create png for each parts";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	int nH = wsdImg.rows;
-	int nW = wsdImg.cols;
-	unsigned char* pSrcImg = ConvertCVMATtoUCHAR(wsdImg);
-	std::vector<std::vector<PixelConnectivity*>*> solid;
-	GetGroupedDataTest(nW, nH, pSrcImg, solid);
-	delete [] pSrcImg;
-	pSrcImg = NULL;
-
-	for (unsigned int i=0; i<solid.size(); ++i)
-	{
-		std::vector<PixelConnectivity*>* pShell = solid.at(i);
-
-		int nMinX = 2*nW;
-		int nMinY = 2*nH;
-		int nMaxX = -1;
-		int nMaxY = -1;
-		for (unsigned int j=0; j<pShell->size(); ++j)
-		{
-			PixelConnectivity* pPix = pShell->at(j);
-			int y = pPix->nIdx/nW;
-			int x = pPix->nIdx%nW;
-			if (x<nMinX) nMinX=x;
-			if (y<nMinY) nMinY=y;
-			if (x>nMaxX) nMaxX=x;
-			if (y>nMaxY) nMaxY=y;
-		}//for(j)
-
-		int w = nMaxX - nMinX + 1;
-		int h = nMaxY - nMinY + 1;
-		unsigned char* pDstImg = new unsigned char[w*h*3];
-		for (int y=nMinY; y<nMinY+h; ++y)
-		{
-			int dstImgIdx = (y-nMinY)*w*3;
-			for (int x=nMinX; x<nMinX+w; ++x)
-			{
-				pDstImg[dstImgIdx+0] = clrImg.at<cv::Vec3b>(y, x)[0];
-				pDstImg[dstImgIdx+1] = clrImg.at<cv::Vec3b>(y, x)[1];
-				pDstImg[dstImgIdx+2] = clrImg.at<cv::Vec3b>(y, x)[2];
-				dstImgIdx += 3;
-			}//for(x)
-		}//for(y)
-		CreatePNGfromUCHAR(i+1, w, h, pDstImg, strOutputFolder);
-		delete [] pDstImg;
-		pDstImg = NULL;
-	}//for(i)
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step 7 : grouping and create png for each parts
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// status of a result record : return value of ExecuteImgSeg (-3 : exception)
+std::string GetStatusName(const int& nRet)
+{
+	switch (nRet)
+	{
+	case 0:  return "diff";
+	case -1: return "same";
+	case -2: return "load_error";
+	case -4: return "index_mismatch";
+	default: return "error";
+	}
+}
+// result images written by ExecuteImgSeg (when there is a difference)
+void GetOutputFileList(const DiffResult& result, const DiffOptions& options, const std::string& strOutputFolder, std::vector<std::string>& strFileList)
+{
+	strFileList.clear();
+	if (options.strFileName.empty() || IsRenderNeeded(result, options)==false)
+	{
+		return;
+	}
+	if (options.bCreateDiffImg)
+	{
+		strFileList.push_back(GetPNGFile(10000, strOutputFolder + options.strFileName));
+	}
+	if (options.bCreateChangeImg)
+	{
+		strFileList.push_back(GetPNGFile(8000, strOutputFolder + options.strFileName));
+		strFileList.push_back(GetPNGFile(9000, strOutputFolder + options.strFileName));
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	std::clog << "\n" << std::endl;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// changed pixels of the matched parts + pixels of the deleted and added parts
+long long GetChangedArea(const DiffResult& result)
+{
+	long long nArea = 0;
+	for (unsigned int i=0; i<result.matchedRegionList.size(); ++i)
+	{
+		nArea += result.matchedRegionList.at(i).nDiffPixelNum;
+	}
+	for (unsigned int i=0; i<result.deletedRectList.size(); ++i)
+	{
+		nArea += (long long)result.deletedRectList.at(i).area();
+	}
+	for (unsigned int i=0; i<result.addedRectList.size(); ++i)
+	{
+		nArea += (long long)result.addedRectList.at(i).area();
+	}
+	return nArea;
+}
+bool HasFailThreshold(const DiffOptions& options)
+{
+	return options.dFailRatio>=0.0 || options.nFailPixelNum>=0;
+}
+bool IsOverFailThreshold(const DiffResult& result, const DiffOptions& options)
+{
+	long long nArea = GetChangedArea(result);
+	if (options.nFailPixelNum>=0 && nArea>options.nFailPixelNum)
+	{
+		return true;
+	}
+	long long nOldPixelNum = (long long)result.oldSize.width * result.oldSize.height;
+	if (options.dFailRatio>=0.0 && nOldPixelNum>0 && (double)nArea / nOldPixelNum>options.dFailRatio)
+	{
+		return true;
+	}
+	return false;
+}
+// result images are rendered and encoded only when the pair fails (or always without fail threshold)
+bool IsRenderNeeded(const DiffResult& result, const DiffOptions& options)
+{
+	if ((options.bCreateDiffImg || options.bCreateChangeImg)==false)
+	{
+		return false;
+	}
+	return HasFailThreshold(options)==false || options.bAlwaysRender || IsOverFailThreshold(result, options);
+}
+// "500" (digits only) : pixels, "0.01", "1e-3" or "1%" : ratio of the old image pixels (0 to 1)
+bool ParseFailThreshold(const std::string& strThreshold, DiffOptions& options)
+{
+	if (strThreshold.empty()==false && strThreshold.find_first_not_of("0123456789")==std::string::npos)
+	{
+		options.nFailPixelNum = atoll(strThreshold.c_str());
+		return true;
+	}
+	char* pEnd = NULL;
+	double dValue = strtod(strThreshold.c_str(), &pEnd);
+	// "nan" fails both comparisons
+	if (pEnd==strThreshold.c_str() || (dValue>=0.0)==false)
+	{
+		return false;
+	}
+	std::string strUnit(pEnd);
+	if (strUnit=="%")
+	{
+		dValue /= 100.0;
+	}
+	else if (strUnit.empty()==false)
+	{
+		return false;
+	}
+	if (dValue>1.0)
+	{
+		return false;
+	}
+	options.dFailRatio = dValue;
+	return true;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void ImgSeg02(const std::string& strOldFile, const std::vector<std::string>& strOldPartFileList, const std::string& strNewFile, const std::vector<std::string>& strNewPartFileList, const std::string& strOutputFolder)
+DiffEngine::DiffEngine(const DiffOptions& options)
+	: m_options(options)
 {
-	std::string strFuncName = "ImgSeg02";
-	int nStepNo = 0;
-	std::string strStepName = "";
+	if (m_options.nThreadNum==0)
+	{
+		m_options.nThreadNum = std::max(1u, std::thread::hardware_concurrency());
+	}
+}
+int DiffEngine::Diff(const cv::Mat& newImg, const cv::Mat& oldImg, DiffResult& result) const
+{
+	// all intermediate images are owned by this call
+	ImageContext oldImgContext(oldImg);
+	ImageContext newImgContext(newImg);
+	return ExecuteDiff(oldImgContext, newImgContext, m_options, result);
+}
+int DiffEngine::Diff(const std::vector<unsigned char>& newBuf, const std::vector<unsigned char>& oldBuf, DiffResult& result) const
+{
+	cv::Mat newImg, oldImg;
+	if (newBuf.empty()==false)
+	{
+		long long nStartNs = StartProfile(m_options.pProfiler);
+		newImg = cv::imdecode(newBuf, cv::IMREAD_COLOR);
+		EndProfile(m_options.pProfiler, "decode", nStartNs);
+	}
+	if (oldBuf.empty()==false)
+	{
+		long long nStartNs = StartProfile(m_options.pProfiler);
+		oldImg = cv::imdecode(oldBuf, cv::IMREAD_COLOR);
+		EndProfile(m_options.pProfiler, "decode", nStartNs);
+	}
+	// the decoded images are owned by this call, so the ignored pixels are filled without a copy
+	ImageContext oldImgContext(oldImg, true);
+	ImageContext newImgContext(newImg, true);
+	return ExecuteDiff(oldImgContext, newImgContext, m_options, result);
+}
+int DiffEngine::Diff(const cv::Mat& newImg, const BaselineIndex& oldIndex, DiffResult& result) const
+{
+	ImageContext oldImgContext(oldIndex);
+	ImageContext newImgContext(newImg);
+	return ExecuteDiff(oldImgContext, newImgContext, m_options, result, &oldIndex);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	/* old <-> new */
-	// Step1 : feature detector and matching between base and target image
-	++nStepNo;
-	strStepName = "Feature detector and matching between old and new image";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	std::clog << "  old (" << strOldPartFileList.size() << ")" << " <-> new (" << strNewPartFileList.size() << ")" << std::endl;
-	ExecuteFeatureDetectorAndMatching(strOldPartFileList, strNewPartFileList, g_strFileDiffInfoListMap);
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step1 : feature detector and matching between base and target image
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Diff one pair of images into result, without any file output.
+// return 0 : success, -1 : no difference, -2 : can't load images, -4 : pOldIndex of other segmentation options
+// pOldIndex : parts and descriptors of oldImg (NULL : computed from oldImg)
+// The ignored pixels of the options are filled in oldImg and newImg (see ImageContext::ApplyIgnoreRegion).
+int ExecuteDiff(ImageContext& oldImg, ImageContext& newImg, const DiffOptions& options, DiffResult& result, const BaselineIndex* pOldIndex/*=NULL*/)
+{
+	result = DiffResult();
+	result.oldSize = oldImg.GetColor().size();
+	result.newSize = newImg.GetColor().size();
 
+	// ignored pixels are filled with the background color before all stages, so no part is segmented
+	// in them, and their changes aren't detected (the parts of an old image index can't be used)
+	if (HasIgnoreRegion(options) && oldImg.GetColor().data!=NULL && newImg.GetColor().data!=NULL)
+	{
+		long long nStartNs = StartProfile(options.pProfiler);
+		oldImg.ApplyIgnoreRegion(options);
+		newImg.ApplyIgnoreRegion(options);
+		pOldIndex = NULL;
+		EndProfile(options.pProfiler, "ignore", nStartNs);
+	}
+	if (pOldIndex!=NULL && pOldIndex->IsSegmentedBy(options)==false)
+	{
+		std::clog << "Index of other segmentation options (--segmenter, --max-memory)" << std::endl;
+		return -4;
+	}
 
-	if (g_bCreateChangeImg == true) {
-	// Step2 : create base image with difference part frame
-		++nStepNo;
-		strStepName = "Create base image with difference part frame";
-		SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-		std::clog << "  old difference parts (" << g_strFileDiffInfoListMap[1].size() << ")" << std::endl;
-		cv::Mat clrOldImg;
-		std::vector<SegmentedRegionInfo> oldSegRegionInfoList;
-		ExecuteTemplateMatch(strOldFile, g_strFileDiffInfoListMap[1], clrOldImg, oldSegRegionInfoList);
-		for (unsigned int i=0; i<oldSegRegionInfoList.size(); ++i)
+	//ImgSeg00
+	{
+		long long nStartNs = StartProfile(options.pProfiler);
+		int ImgSeg00_return = ImgSeg00(oldImg, newImg, options, result.changedBandList);
+		EndProfile(options.pProfiler, "ImgSeg00", nStartNs);
+		if (ImgSeg00_return != 0)
 		{
-			SegmentedRegionInfo info = oldSegRegionInfoList.at(i);
-			cv::rectangle(clrOldImg, info.ptOrigin, cv::Point(info.ptOrigin.x+info.nW, info.ptOrigin.y+info.nH), info.clrFrame, 2);
+			return ImgSeg00_return;
 		}
-		CreatePNGfromCVMAT(8000, clrOldImg, strOutputFolder);
+	}
 
-		std::clog << "  new difference parts (" << g_strFileDiffInfoListMap[3].size() << ")" << std::endl;
-		cv::Mat clrNewImg;
-		std::vector<SegmentedRegionInfo> newSegRegionInfoList;
-		ExecuteTemplateMatch(strNewFile, g_strFileDiffInfoListMap[3], clrNewImg, newSegRegionInfoList);
-		for (unsigned int i=0; i<newSegRegionInfoList.size(); ++i)
+	//ImgSeg01
+	std::vector<Part> newPartList, oldPartList;
+	{
+		// parts division. Only the old (baseline) image is cached, since it comes again in the later runs.
+		ImgSeg01(newImg, options, newPartList);
+		if (pOldIndex!=NULL)
+		{
+			CreatePartListFromIndex(oldImg, *pOldIndex, oldPartList);
+		}
+		else
 		{
-			SegmentedRegionInfo info = newSegRegionInfoList.at(i);
-			cv::rectangle(clrNewImg, info.ptOrigin, cv::Point(info.ptOrigin.x+info.nW, info.ptOrigin.y+info.nH), info.clrFrame, 2);
+			LoadOrCreatePartList(oldImg, options, oldPartList);
 		}
-		CreatePNGfromCVMAT(9000, clrNewImg, strOutputFolder);
-		SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-		// Step2 : Create base image with difference part frame
+		AddProfileCount(options.pProfiler, "new_parts", newPartList.size());
+		AddProfileCount(options.pProfiler, "old_parts", oldPartList.size());
 	}
 
-	std::clog << "\n" << std::endl;
+	//ImgSeg02
+	PartTable oldPartTable, newPartTable;
+	{
+		ImgSeg02(oldPartList, newPartList, result.changedBandList, options, oldPartTable, newPartTable);
+	}
+
+	//ImgSeg03
+	{
+		ImgSeg03(oldImg, newPartList, oldPartTable, newPartTable, options, result);
+		AddProfileCount(options.pProfiler, "matched_parts", result.matchedRegionList.size());
+		AddProfileCount(options.pProfiler, "deleted_parts", result.deletedRectList.size());
+		AddProfileCount(options.pProfiler, "added_parts", result.addedRectList.size());
+	}
+
+	return 0;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void ImgSeg03(const std::string& strOldFile, std::map<int, std::vector<std::string> > strPartFileListMap, const std::string& strOutputFolder)
+// Diff image pairs listed in a manifest file (see ReadManifest) by nJobNum workers.
+// A result record (one JSON object per line) is written to std::cout as soon as each pair finishes.
+// The memory is bounded by the number of pairs in flight (nJobNum).
+int ExecuteBatch(const std::string& strManifestFile, const DiffOptions& options, const unsigned int& nJobNum)
 {
-	std::string strFuncName = "ImgSeg03";
-	int nStepNo = 0;
-	std::string strStepName = "";
-
-	// Step 1 : check template match for old file and new->old same part files
-	++nStepNo;
-	strStepName = "Check template match for old file and new->old same part files";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	cv::Mat oldClrImg;
-	std::vector<SegmentedRegionInfo> newSegRegionInfoList;
-	ExecuteTemplateMatchEx(strOldFile, strPartFileListMap[2], oldClrImg, newSegRegionInfoList);
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step 1 : check template match for old file and new->old same part files
-
+	std::vector<BatchPair> pairList;
+	if (ReadManifest(strManifestFile, options.strFileName, pairList)==false)
+	{
+		std::cerr << "Can't open manifest file." << std::endl;
+		return -1;
+	}
 
-	// Step 2 : draw information in old file
-	++nStepNo;
-	strStepName = "Draw information in old file";
-	SetProcessStartMsg(strFuncName, nStepNo, strStepName);
-	cv::Mat oldImg = oldClrImg;
-	ConvertColorToGray(oldImg);
-	for (unsigned int i=0; i<newSegRegionInfoList.size(); ++i)
+	unsigned int nWorkerNum = (nJobNum==0) ? std::max(1u, std::thread::hardware_concurrency()) : nJobNum;
+	nWorkerNum = std::max(1u, std::min(nWorkerNum, (unsigned int)pairList.size()));
+	// threads are shared by the pairs in flight
+	DiffOptions pairOptions = options;
+	pairOptions.nThreadNum = std::max(1u, options.nThreadNum / nWorkerNum);
+
+	std::mutex mtxOutput;
+	std::atomic<unsigned int> nNextIdx(0);
+	std::atomic<int> nErrorCount(0);
+	std::atomic<int> nOverCount(0);
+	std::vector<std::thread> threadList;
+	for (unsigned int t=0; t<nWorkerNum; ++t)
 	{
-		SegmentedRegionInfo info = newSegRegionInfoList.at(i);
-		cv::rectangle(oldImg, info.ptOrigin, cv::Point(info.ptOrigin.x+info.nW, info.ptOrigin.y+info.nH), info.clrFrame, 0);
-		for (unsigned int k=0; k<info.ptPixList.size(); ++k)
+		threadList.push_back(std::thread([&]()
 		{
-			cv::Point pt = info.ptPixList.at(k);
-			int x = info.ptOrigin.x + pt.x;
-			int y = info.ptOrigin.y + pt.y;
-			oldImg.at<cv::Vec3b>(y, x) = cv::Vec3b(info.clrFrame[0], info.clrFrame[1], info.clrFrame[2]);
-		}
+			// working buffers reused by the pairs of this worker
+			WorkArena arena;
+			for (unsigned int i=nNextIdx++; i<pairList.size(); i=nNextIdx++)
+			{
+				const BatchPair& pair = pairList.at(i);
+				DiffOptions curOptions = pairOptions;
+				curOptions.strFileName = pair.strFileName;
+				curOptions.pArena = &arena;
+
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				ImageSource newSrc, oldSrc;
+				newSrc.strFile = pair.strNewFile;
+				oldSrc.strFile = pair.strOldFile;
+				DiffResult result;
+				int nRet = -2;
+				try
+				{
+					nRet = ExecuteImgSeg(newSrc, oldSrc, curOptions, "./", result);
+				}
+				catch (std::exception&)
+				{
+					// e.g. cv::Exception or std::bad_alloc by a huge image, which fails only this pair
+					nRet = -3;
+				}
+				ReuseArena(arena);
+				long long nTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+				std::string strStatus = GetStatusName(nRet);
+				if (nRet<=-2) ++nErrorCount;
+				bool bIsOver = (nRet==0 && HasFailThreshold(curOptions) && IsOverFailThreshold(result, curOptions));
+				if (bIsOver) ++nOverCount;
+
+				std::lock_guard<std::mutex> lock(mtxOutput);
+				std::cout << "{\"line\": " << pair.nLineNo
+				          << ", \"new\": \"" << EscapeJSON(pair.strNewFile) << "\""
+				          << ", \"old\": \"" << EscapeJSON(pair.strOldFile) << "\""
+				          << ", \"output\": \"" << EscapeJSON(pair.strFileName) << "\""
+				          << ", \"status\": \"" << strStatus << "\"";
+				if (HasFailThreshold(curOptions))
+				{
+					std::cout << ", \"over_threshold\": " << (bIsOver ? "true" : "false");
+				}
+				std::cout << ", \"time_ms\": " << nTimeMs << "}" << std::endl;
+			}
+		}));
+	}
+	for (unsigned int t=0; t<threadList.size(); ++t)
+	{
+		threadList.at(t).join();
 	}
-	CreatePNGfromCVMAT(10000, oldImg, strOutputFolder);
-	SetProcessEndMsg(strFuncName, nStepNo, strStepName);
-	// Step 2 : draw information in old file
 
-	std::clog << "\n" << std::endl;
+	if (nErrorCount>0)
+	{
+		return -1;
+	}
+	return (nOverCount==0) ? 0 : kExitCodeOverThreshold;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Manifest : one pair per line, "new image<TAB>old image[<TAB>output prefix]" ('#' : comment line).
+// The output prefix is strFileName + "_" + line number when it is omitted.
+bool ReadManifest(const std::string& strManifestFile, const std::string& strFileName, std::vector<BatchPair>& pairList)
+{
+	std::ifstream ifs(strManifestFile.c_str());
+	if (ifs.is_open()==false)
+	{
+		return false;
+	}
+	std::string strLine;
+	for (int nLineNo=1; std::getline(ifs, strLine); ++nLineNo)
+	{
+		if (strLine.empty() || strLine[0]=='#') continue;
+		if (strLine[strLine.size()-1]=='\r') strLine.erase(strLine.size()-1);
 
+		std::vector<std::string> strItemList = Split(strLine, '\t');
+		if (strItemList.size()<2)
+		{
+			std::cerr << "Invalid manifest line : " << nLineNo << std::endl;
+			continue;
+		}
+		BatchPair pair;
+		pair.nLineNo = nLineNo;
+		pair.strNewFile = strItemList.at(0);
+		pair.strOldFile = strItemList.at(1);
+		if (strItemList.size()>=3)
+		{
+			pair.strFileName = strItemList.at(2);
+		}
+		else
+		{
+			std::ostringstream strLineNo;
+			strLineNo << nLineNo;
+			pair.strFileName = strFileName + "_" + strLineNo.str();
+		}
+		pairList.push_back(pair);
+	}
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void ExecuteFeatureDetectorAndMatching(const std::vector<std::string>& strOldPartFileList, const std::vector<std::string>& strNewPartFileList, std::map<int, std::vector<std::string> >& strMap)
+// Serve diff requests on a Unix domain socket by nJobNum workers, until a "QUIT" request.
+// Request  : one line "id<TAB>new image<TAB>old image[<TAB>output prefix]". An image "@N" is N bytes of
+//            encoded image which follow the line (new image first). Without output prefix, no result image.
+// Response : one JSON line per request in order of completion, with the id of the request.
+// Requests of a connection can be pipelined. At most nQueueSize requests wait for a worker, and then
+// the connection isn't read any more, so a fast client is held back by its socket buffer.
+// Paths are relative to the current directory of the server.
+int ExecuteServe(const std::string& strSocketFile, const DiffOptions& options, const unsigned int& nJobNum, const unsigned int& nQueueSize)
 {
-	std::clog << "   Compute 'key points' and 'descriptor' of old part" << std::endl;
-	std::map<std::string, cv::Mat> strOldPartDescriptorInfoMap;
-	ComputeKeypointAndDescriptor(strOldPartFileList, strOldPartDescriptorInfoMap);
-
-	std::clog << "   Compute 'key points' and 'descriptor' of new part" << std::endl;
-	std::map<std::string, cv::Mat> strNewPartDescriptorInfoMap;
-	ComputeKeypointAndDescriptor(strNewPartFileList, strNewPartDescriptorInfoMap);
+	struct sockaddr_un addr;
+	if (SetSocketAddress(strSocketFile, addr)==false)
+	{
+		std::cerr << "Invalid socket path : " << strSocketFile << std::endl;
+		return -1;
+	}
+	int nRunningFd = ConnectServeSocket(strSocketFile);
+	if (nRunningFd>=0)
+	{
+		close(nRunningFd);
+		std::cerr << "Server is already running on socket : " << strSocketFile << std::endl;
+		return -1;
+	}
+	int nListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (nListenFd<0)
+	{
+		std::cerr << "Can't create socket." << std::endl;
+		return -1;
+	}
+	// socket file left by a server which didn't stop. Any other file on the path is left as it is.
+	struct stat fileStat;
+	if (lstat(strSocketFile.c_str(), &fileStat)==0)
+	{
+		if (S_ISSOCK(fileStat.st_mode)==false)
+		{
+			std::cerr << "Not a socket : " << strSocketFile << std::endl;
+			close(nListenFd);
+			return -1;
+		}
+		unlink(strSocketFile.c_str());
+	}
+	// only the user of the server can connect, since a request reads and writes files as that user
+	if (bind(nListenFd, (struct sockaddr*)&addr, sizeof(addr))!=0 || chmod(strSocketFile.c_str(), S_IRUSR | S_IWUSR)!=0
+		|| listen(nListenFd, SOMAXCONN)!=0)
+	{
+		std::cerr << "Can't listen on socket : " << strSocketFile << std::endl;
+		close(nListenFd);
+		return -1;
+	}
+	std::clog << "Serve on socket : " << strSocketFile << std::endl;
 
+	unsigned int nWorkerNum = (nJobNum==0) ? std::max(1u, std::thread::hardware_concurrency()) : nJobNum;
+	// threads are shared by the requests in flight
+	DiffOptions jobOptions = options;
+	jobOptions.nThreadNum = std::max(1u, options.nThreadNum / nWorkerNum);
 
-	std::clog << "   Compute 'feature match' of old to new part" << std::endl;
-	cv::Ptr<cv::DescriptorMatcher> matcher = cv::DescriptorMatcher::create("FlannBased");
-	std::map<std::string, std::string> strMatchedPartFilesMap;
-	// old -> new
+	ServeQueue queue((nQueueSize==0) ? nWorkerNum*2 : nQueueSize);
+	std::vector<std::thread> workerList;
+	for (unsigned int t=0; t<nWorkerNum; ++t)
 	{
-		unsigned int i = 0;
-		for (std::map<std::string, cv::Mat>::iterator itrOld=strOldPartDescriptorInfoMap.begin(); itrOld!=strOldPartDescriptorInfoMap.end(); ++itrOld)
+		workerList.push_back(std::thread([&]()
 		{
-			std::clog << "    Old No. " << ++i << " : " << std::flush;
-			//std::string strOldPartFile = itrOld->first;
-			//cv::Mat desOldPart = itrOld->second;
-
-			bool bIsMatched = false;
-			if (itrOld->second.data==NULL)
+			// working buffers reused by the requests of this worker
+			WorkArena arena;
+			ServeJob job;
+			while (queue.Pop(job))
 			{
-				std::clog << "key point size = 0." << std::endl;
+				DiffOptions curOptions = jobOptions;
+				curOptions.strFileName = job.strFileName;
+				curOptions.pArena = &arena;
+
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				DiffResult result;
+				int nRet = -2;
+				try
+				{
+					nRet = ExecuteImgSeg(job.newSrc, job.oldSrc, curOptions, "", result);
+				}
+				catch (std::exception&)
+				{
+					// e.g. cv::Exception or std::bad_alloc by a huge image, which fails only this pair
+					nRet = -3;
+				}
+				ReuseArena(arena);
+				long long nTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+				std::string strStatus = GetStatusName(nRet);
+				std::vector<std::string> strOutputList;
+				if (nRet==0)
+				{
+					GetOutputFileList(result, curOptions, "", strOutputList);
+				}
+
+				std::ostringstream strResponse;
+				strResponse << "{\"id\": \"" << EscapeJSON(job.strId) << "\""
+				            << ", \"status\": \"" << strStatus << "\""
+				            << ", \"time_ms\": " << nTimeMs
+				            << ", \"matched\": " << result.matchedRegionList.size()
+				            << ", \"deleted\": " << result.deletedRectList.size()
+				            << ", \"added\": " << result.addedRectList.size();
+				if (HasFailThreshold(curOptions))
+				{
+					strResponse << ", \"over_threshold\": " << ((nRet==0 && IsOverFailThreshold(result, curOptions)) ? "true" : "false");
+				}
+				strResponse << ", \"output\": [";
+				for (unsigned int i=0; i<strOutputList.size(); ++i)
+				{
+					strResponse << (i==0 ? "" : ", ") << "\"" << EscapeJSON(strOutputList.at(i)) << "\"";
+				}
+				strResponse << "]}";
+				job.pConnection->WriteLine(strResponse.str());
+				// the connection is closed with its last request
+				job = ServeJob();
+			}
+		}));
+	}
+
+	// one reader thread per connection
+	struct ServeReader
+	{
+		std::weak_ptr<ServeConnection> pConnection;
+		std::shared_ptr<std::atomic<bool> > pIsDone;
+		std::thread thread;
+	};
+	std::vector<ServeReader> readerList;
+	std::atomic<bool> bStop(false);
+	while (bStop==false)
+	{
+		int nFd = accept(nListenFd, NULL, NULL);
+		if (nFd<0)
+		{
+			if (bStop==false && errno!=EINTR)
+			{
+				std::cerr << "Can't accept connection : " << strerror(errno) << std::endl;
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			continue;
+		}
+		// join the readers of closed connections
+		for (unsigned int i=0; i<readerList.size(); )
+		{
+			if (*readerList.at(i).pIsDone)
+			{
+				readerList.at(i).thread.join();
+				readerList.erase(readerList.begin()+i);
 			}
 			else
 			{
-				std::clog << "" << std::endl;
+				++i;
+			}
+		}
+		std::shared_ptr<ServeConnection> pConnection = std::make_shared<ServeConnection>(nFd);
+		std::shared_ptr<std::atomic<bool> > pIsDone = std::make_shared<std::atomic<bool> >(false);
+		ServeReader reader;
+		reader.pConnection = pConnection;
+		reader.pIsDone = pIsDone;
+		reader.thread = std::thread([&queue, &bStop, nListenFd, pConnection, pIsDone]()
+		{
+			ExecuteServeConnection(pConnection, queue, bStop, nListenFd);
+			*pIsDone = true;
+		});
+		readerList.push_back(std::move(reader));
+	}
 
-				unsigned int j = 0;
-				for (std::map<std::string, cv::Mat>::iterator itrNew=strNewPartDescriptorInfoMap.begin(); itrNew!=strNewPartDescriptorInfoMap.end(); ++itrNew)
-				{
-					std::clog << "     New No." << ++j << " : " << std::flush;
-					//std::string strNewPartFile = itrNew->first;
-					//cv::Mat desNewPart = itrNew->second;
+	// stop reading, and answer the requests already read
+	for (unsigned int i=0; i<readerList.size(); ++i)
+	{
+		std::shared_ptr<ServeConnection> pConnection = readerList.at(i).pConnection.lock();
+		if (pConnection)
+		{
+			shutdown(pConnection->nFd, SHUT_RD);
+		}
+		pConnection.reset();
+		readerList.at(i).thread.join();
+	}
+	queue.Close();
+	for (unsigned int t=0; t<workerList.size(); ++t)
+	{
+		workerList.at(t).join();
+	}
+	close(nListenFd);
+	unlink(strSocketFile.c_str());
+	std::clog << "Serve stopped." << std::endl;
 
-					std::vector<cv::DMatch> matches;
-					if (itrOld->second.data && itrNew->second.data)
-					{
-						matcher->match(itrOld->second, itrNew->second, matches);
-						std::sort(matches.begin(), matches.end()); // sorted by cv::DMatch::distance
-					}
+	return 0;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-					if (matches.size()>0 && matches[ matches.size()/2 ].distance <= 1.0f)
-					{
-						std::clog << "Match" << std::endl;
-						bIsMatched = true; // full or almost match
-						strMatchedPartFilesMap[itrNew->first] = itrOld->first;
-						strNewPartDescriptorInfoMap.erase(itrNew);
-						break;
-					}
-					else
-					{
-						std::clog << "No Match" << std::endl;
-					}
-				}//for(j)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Read the requests of one connection into the queue, until the client closes it or sends "QUIT".
+void ExecuteServeConnection(std::shared_ptr<ServeConnection> pConnection, ServeQueue& queue, std::atomic<bool>& bStop, const int& nListenFd)
+{
+	SocketReader reader(pConnection->nFd);
+	std::string strLine;
+	while (reader.ReadLine(strLine))
+	{
+		if (strLine.empty()==false && strLine[strLine.size()-1]=='\r') strLine.erase(strLine.size()-1);
+		if (strLine.empty()) continue;
+		if (strLine=="QUIT")
+		{
+			// wakes up accept() of the server
+			bStop = true;
+			shutdown(nListenFd, SHUT_RDWR);
+			return;
+		}
+
+		std::vector<std::string> strItemList = Split(strLine, '\t');
+		if (strItemList.size()<3)
+		{
+			pConnection->WriteLine("{\"id\": \"" + EscapeJSON(strItemList.empty() ? "" : strItemList.at(0)) + "\", \"status\": \"bad_request\"}");
+			continue;
+		}
+		ServeJob job;
+		job.pConnection = pConnection;
+		job.strId = strItemList.at(0);
+		if (strItemList.size()>=4)
+		{
+			job.strFileName = strItemList.at(3);
+		}
+		ImageSource* pSrcList[2] = { &job.newSrc, &job.oldSrc };
+		for (int i=0; i<2; ++i)
+		{
+			const std::string& strItem = strItemList.at(i+1);
+			if (strItem[0]!='@')
+			{
+				pSrcList[i]->strFile = strItem;
+				continue;
+			}
+			long long nSize = atoll(strItem.c_str()+1);
+			if (nSize<=0 || nSize>(long long)kMaxServeImageSize)
+			{
+				// the image data can't be skipped, so the connection is closed
+				pConnection->WriteLine("{\"id\": \"" + EscapeJSON(job.strId) + "\", \"status\": \"bad_request\"}");
+				return;
+			}
+			bool bRead = false;
+			try
+			{
+				bRead = reader.Read((size_t)nSize, pSrcList[i]->buf);
+			}
+			catch (std::bad_alloc&)
+			{
+				pConnection->WriteLine("{\"id\": \"" + EscapeJSON(job.strId) + "\", \"status\": \"error\"}");
 			}
+			if (bRead==false)
+			{
+				return;
+			}
+		}
+		if (queue.Push(job)==false)
+		{
+			return;
+		}
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Send the pairs to a server as pipelined requests, and write the responses to std::cout.
+// Paths are sent as absolute paths. bInline : send the encoded images instead of their paths.
+// return 0 : all pairs are diffed (with or without difference), kExitCodeOverThreshold : a pair is over
+// the fail threshold of the server, -1 : otherwise
+int ExecuteClient(const std::string& strSocketFile, const std::vector<BatchPair>& pairList, const bool& bInline)
+{
+	int nFd = ConnectServeSocket(strSocketFile);
+	if (nFd<0)
+	{
+		std::cerr << "Can't connect to socket : " << strSocketFile << std::endl;
+		return -1;
+	}
 
-			if (bIsMatched == true && g_bCreateChangeImg == true)
+	// requests are sent while responses are read, so a server with a full queue doesn't block the client
+	std::thread sender([&]()
+	{
+		for (unsigned int i=0; i<pairList.size(); ++i)
+		{
+			const BatchPair& pair = pairList.at(i);
+			std::vector<unsigned char> newBuf, oldBuf;
+			std::ostringstream strRequest;
+			strRequest << pair.nLineNo << "\t";
+			if (bInline && ReadFileBuffer(pair.strNewFile, newBuf))
 			{
-				strMap[0].push_back(itrOld->first);
+				strRequest << "@" << newBuf.size();
 			}
 			else
 			{
-				strMap[1].push_back(itrOld->first);
+				strRequest << GetAbsolutePath(pair.strNewFile);
 			}
-		}//for(i)
+			strRequest << "\t";
+			// an index is mapped by the server
+			if (bInline && IsIndexFile(pair.strOldFile)==false && ReadFileBuffer(pair.strOldFile, oldBuf))
+			{
+				strRequest << "@" << oldBuf.size();
+			}
+			else
+			{
+				strRequest << GetAbsolutePath(pair.strOldFile);
+			}
+			strRequest << "\t" << GetAbsolutePath(pair.strFileName) << "\n";
+
+			std::string strHeader = strRequest.str();
+			if (SendAll(nFd, strHeader.data(), strHeader.size())==false
+				|| (newBuf.empty()==false && SendAll(nFd, (const char*)&newBuf[0], newBuf.size())==false)
+				|| (oldBuf.empty()==false && SendAll(nFd, (const char*)&oldBuf[0], oldBuf.size())==false))
+			{
+				break;
+			}
+		}
+		shutdown(nFd, SHUT_WR);
+	});
+
+	SocketReader reader(nFd);
+	std::string strLine;
+	unsigned int nResponseNum = 0;
+	int nErrorCount = 0;
+	int nOverCount = 0;
+	while (nResponseNum<pairList.size() && reader.ReadLine(strLine))
+	{
+		std::cout << strLine << std::endl;
+		++nResponseNum;
+		if (strLine.find("\"status\": \"diff\"")==std::string::npos && strLine.find("\"status\": \"same\"")==std::string::npos)
+		{
+			++nErrorCount;
+		}
+		if (strLine.find("\"over_threshold\": true")!=std::string::npos)
+		{
+			++nOverCount;
+		}
+	}
+	sender.join();
+	close(nFd);
+
+	if (nResponseNum<pairList.size())
+	{
+		std::cerr << "Connection closed by server." << std::endl;
+		return -1;
+	}
+	if (nErrorCount>0)
+	{
+		return -1;
+	}
+	return (nOverCount==0) ? 0 : kExitCodeOverThreshold;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stop the server after the requests already read are answered
+int ExecuteStop(const std::string& strSocketFile)
+{
+	int nFd = ConnectServeSocket(strSocketFile);
+	if (nFd<0)
+	{
+		std::cerr << "Can't connect to socket : " << strSocketFile << std::endl;
+		return -1;
+	}
+	std::string strRequest = "QUIT\n";
+	bool bIsSent = SendAll(nFd, strRequest.data(), strRequest.size());
+	close(nFd);
+	return bIsSent ? 0 : -1;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+ServeQueue::ServeQueue(const size_t& nMaxSize)
+	: m_nMaxSize(std::max((size_t)1, nMaxSize))
+	, m_bClosed(false)
+{
+}
+bool ServeQueue::Push(ServeJob& job)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_cvNotFull.wait(lock, [this]() { return m_bClosed || m_jobList.size()<m_nMaxSize; });
+	if (m_bClosed)
+	{
+		return false;
+	}
+	m_jobList.push_back(std::move(job));
+	m_cvNotEmpty.notify_one();
+	return true;
+}
+bool ServeQueue::Pop(ServeJob& job)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_cvNotEmpty.wait(lock, [this]() { return m_bClosed || m_jobList.empty()==false; });
+	if (m_jobList.empty())
+	{
+		return false;
+	}
+	job = std::move(m_jobList.front());
+	m_jobList.pop_front();
+	m_cvNotFull.notify_one();
+	return true;
+}
+void ServeQueue::Close()
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_bClosed = true;
+	m_cvNotFull.notify_all();
+	m_cvNotEmpty.notify_all();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool ServeConnection::WriteLine(const std::string& strLine)
+{
+	std::lock_guard<std::mutex> lock(mtxWrite);
+	std::string strData = strLine + "\n";
+	return SendAll(nFd, strData.data(), strData.size());
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+SocketReader::SocketReader(const int& nFd)
+	: m_nFd(nFd)
+	, m_buf(64*1024)
+	, m_nPos(0)
+	, m_nEnd(0)
+{
+}
+bool SocketReader::Fill()
+{
+	ssize_t nRead = 0;
+	do
+	{
+		nRead = recv(m_nFd, &m_buf[0], m_buf.size(), 0);
+	} while (nRead<0 && errno==EINTR);
+	if (nRead<=0)
+	{
+		return false;
+	}
+	m_nPos = 0;
+	m_nEnd = (size_t)nRead;
+	return true;
+}
+bool SocketReader::ReadLine(std::string& strLine)
+{
+	strLine.clear();
+	while (true)
+	{
+		if (m_nPos==m_nEnd && Fill()==false)
+		{
+			return false;
+		}
+		const char* pBegin = &m_buf[m_nPos];
+		const char* pNewLine = (const char*)memchr(pBegin, '\n', m_nEnd-m_nPos);
+		if (pNewLine!=NULL)
+		{
+			strLine.append(pBegin, pNewLine);
+			m_nPos += pNewLine - pBegin + 1;
+			return true;
+		}
+		strLine.append(pBegin, m_nEnd-m_nPos);
+		m_nPos = m_nEnd;
+	}
+}
+bool SocketReader::Read(const size_t& nSize, std::vector<unsigned char>& buf)
+{
+	buf.resize(nSize);
+	size_t nRead = 0;
+	while (nRead<nSize)
+	{
+		if (m_nPos==m_nEnd && Fill()==false)
+		{
+			return false;
+		}
+		size_t nCopy = std::min(nSize-nRead, m_nEnd-m_nPos);
+		memcpy(&buf[nRead], &m_buf[m_nPos], nCopy);
+		nRead += nCopy;
+		m_nPos += nCopy;
+	}
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool SetSocketAddress(const std::string& strSocketFile, struct sockaddr_un& addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strSocketFile.empty() || strSocketFile.size()>=sizeof(addr.sun_path))
+	{
+		return false;
+	}
+	memcpy(addr.sun_path, strSocketFile.c_str(), strSocketFile.size());
+	return true;
+}
+// return -1 : can't connect
+int ConnectServeSocket(const std::string& strSocketFile)
+{
+	struct sockaddr_un addr;
+	if (SetSocketAddress(strSocketFile, addr)==false)
+	{
+		return -1;
+	}
+	int nFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (nFd<0)
+	{
+		return -1;
+	}
+	if (connect(nFd, (struct sockaddr*)&addr, sizeof(addr))!=0)
+	{
+		close(nFd);
+		return -1;
+	}
+	return nFd;
+}
+bool SendAll(const int& nFd, const char* pData, const size_t& nSize)
+{
+	size_t nSent = 0;
+	while (nSent<nSize)
+	{
+		// a closed peer is an error, not SIGPIPE
+		ssize_t nRet = send(nFd, pData+nSent, nSize-nSent, MSG_NOSIGNAL);
+		if (nRet<0 && errno==EINTR) continue;
+		if (nRet<=0)
+		{
+			return false;
+		}
+		nSent += (size_t)nRet;
+	}
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// return 0 : different, -1 : no difference, -2 : can't load images
+int ImgSeg00(ImageContext& oldImg, ImageContext& newImg, const DiffOptions& options, std::vector<cv::Range>& changedBandList)
+{
+	if (oldImg.GetColor().data==NULL || newImg.GetColor().data == NULL)
+	{
+		return -2;
+	}
+
+	// strip hash (confirmed by the bytes) : exact equality, and the rows which later stages have to look at
+	long long nStartNs = StartProfile(options.pProfiler);
+	const cv::Mat& oldClrImg = oldImg.GetColor();
+	const cv::Mat& newClrImg = newImg.GetColor();
+	if (oldClrImg.size()!=newClrImg.size() || oldClrImg.type()!=newClrImg.type())
+	{
+		changedBandList.assign(1, cv::Range(0, newClrImg.rows));
+	}
+	else
+	{
+		GetChangedBand(oldImg.GetStripHash(), newImg.GetStripHash(), oldClrImg, newClrImg, kStripHeight, changedBandList);
+	}
+	EndProfile(options.pProfiler, "strip_hash", nStartNs, changedBandList.size());
+	std::clog << " Changed row bands : " << changedBandList.size() << std::endl;
+	if (changedBandList.empty())
+	{
+		return -1;
+	}
+
+	if (options.bHistogramCheck == false)
+	{
+		return 0;
+	}
+
+	nStartNs = StartProfile(options.pProfiler);
+	const cv::Mat& hsvOldImg = oldImg.GetHSV();
+	const cv::Mat& hsvNewImg = newImg.GetHSV();
+
+	int nHistSize[] = { 256, 256 };
+	float fHRanges[] = { 0, 180 };
+    float fSRanges[] = { 0, 256 };
+	const float* pRanges[] = { fHRanges, fSRanges };
+
+	int nChannels[] = {0,1};
+
+	cv::Mat histOld, histNew;
+	cv::calcHist(&hsvOldImg, 1, nChannels, cv::Mat(), histOld, 2, nHistSize, pRanges, true, false);
+	cv::normalize(histOld, histOld, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
+	cv::calcHist(&hsvNewImg, 1, nChannels, cv::Mat(), histNew, 2, nHistSize, pRanges, true, false);
+	cv::normalize(histNew, histNew, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
+
+	double dOldToNew = cv::compareHist(histOld, histNew, 1);
+	EndProfile(options.pProfiler, "histogram", nStartNs);
+	std::clog << " Compare Old to New : " << dOldToNew << std::endl;
+
+    if (dOldToNew <= 0.00001)
+    {
+		return -1;
+	}
+        return 0;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void ImgSeg01(ImageContext& img, const DiffOptions& options, std::vector<Part>& partList)
+{
+	std::string strFuncName = "ImgSeg01";
+	int nStepNo = 0;
+	std::string strStepName = "";
+
+	// Step1 : load image
+	++nStepNo;
+	strStepName = "Load image";
+	SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	const cv::Mat& clrImg = img.GetColor();
+	if (clrImg.data==NULL)
+	{
+		SetProcessErrorMsg(nStepNo);
+		return;
+	}
+	SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// Step1 : load image
+
+
+	// Step2 : color -> gray
+	++nStepNo;
+	strStepName = "Transform image color -> gray";
+	SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	const cv::Mat& gryImg = img.GetGray();
+	SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// Step2 : color -> gray
+
+
+	// Step3 : watershed segmentation by row bands, and grouping (or layout block segmentation)
+	++nStepNo;
+	strStepName = (options.segmenterType==kSegmenterBlocks) ? "Block segmentation" : "Watershed segmentation and Grouping";
+	SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// working buffers on the arena of the caller, given back at the end of this step
+	WorkArena localArena;
+	WorkArena& arena = (options.pArena!=NULL) ? *options.pArena : localArena;
+	WorkArena::Mark arenaMark = arena.GetMark();
+	std::vector<cv::Rect> partRectList;
+	if (options.segmenterType==kSegmenterBlocks)
+	{
+		CreateBlockPartRectList(gryImg, GetBandHeight(gryImg.cols, gryImg.rows, options.nMaxMemoryMB), partRectList, options.pProfiler, &arena);
+	}
+	else
+	{
+		int nH = clrImg.rows;
+		int nW = clrImg.cols;
+		int nBandH = GetBandHeight(nW, nH, options.nMaxMemoryMB);
+		// binary and watershed image of the largest band, each band uses their rows from the top
+		int nMaxTileH = std::min(nH, nBandH+2*kBandOverlap);
+		cv::Mat bandBinImg = (nBandH<nH) ? arena.CreateMat(nMaxTileH, nW, CV_8UC1) : cv::Mat();
+		cv::Mat bandWsdImg = arena.CreateMat(nMaxTileH, nW, CV_8UC3);
+		PartGrouper grouper(nW, &arena);
+		for (int nYs=0; nYs<nH; nYs+=nBandH)
+		{
+			int nYe = std::min(nH, nYs+nBandH);
+			// the band with overlap rows, the overlap rows are segmented but not grouped
+			int nTileYs = std::max(0, nYs-kBandOverlap);
+			int nTileYe = std::min(nH, nYe+kBandOverlap);
+			if (nBandH<nH)
+			{
+				std::clog << "  band (" << nYs << " - " << nYe << ")" << std::endl;
+			}
+
+			long long nStartNs = StartProfile(options.pProfiler);
+			cv::Mat binImg;
+			if (nBandH>=nH)
+			{
+				binImg = img.GetBinary();
+			}
+			else
+			{
+				binImg = bandBinImg.rowRange(0, nTileYe-nTileYs);
+				cv::threshold(gryImg.rowRange(nTileYs, nTileYe), binImg, 200, 255, cv::THRESH_BINARY);
+			}
+			EndProfile(options.pProfiler, "threshold", nStartNs);
+			cv::Mat wsdImg = bandWsdImg.rowRange(0, nTileYe-nTileYs);
+			if (CreateWatershedImage(clrImg.rowRange(nTileYs, nTileYe), binImg, wsdImg, options.pProfiler, &arena)==false)
+			{
+				// no contour, no part in this band
+				wsdImg.setTo(cv::Scalar(128,128,128));
+			}
+			nStartNs = StartProfile(options.pProfiler);
+			for (int y=nYs; y<nYe; ++y)
+			{
+				grouper.AddRow(wsdImg.ptr<unsigned char>(y-nTileYs));
+			}
+			EndProfile(options.pProfiler, "grouping", nStartNs);
+		}
+		long long nStartNs = StartProfile(options.pProfiler);
+		grouper.GetPartRectList(partRectList);
+		EndProfile(options.pProfiler, "grouping", nStartNs, partRectList.size());
+	}
+	arena.Rewind(arenaMark);
+	std::clog << "*** Part count after grouping : " << partRectList.size() << std::endl;
+	SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// Step3 : watershed segmentation by row bands, and grouping (or layout block segmentation)
+
+
+	// Step4 : create each parts
+	++nStepNo;
+	strStepName = "Create each parts";
+	SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	for (unsigned int i=0; i<partRectList.size(); ++i)
+	{
+		cv::Rect rect = partRectList.at(i);
+		if (IsTooSmallPart(rect.width, rect.height)==true)
+		{
+			continue;
+		}
+
+		Part part;
+		part.rect = rect;
+		part.clrImg = clrImg(rect);
+		part.gryImg = gryImg(rect);
+		partList.push_back(part);
+	}//for(i)
+	SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// Step4 : create each parts
+
+	std::clog << "\n" << std::endl;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// morphology, contours, watershed, and the watershed image (128 : not part, 0 : part)
+// The gradient and marker images are on pArena (NULL : heap) and given back before return,
+// wsdImg is written in place when it already has the size and type.
+// return false : no contour
+bool CreateWatershedImage(const cv::Mat& clrImg, const cv::Mat& binImg, cv::Mat& wsdImg, Profiler* pProfiler/*=NULL*/, WorkArena* pArena/*=NULL*/)
+{
+	WorkArena localArena;
+	WorkArena& arena = (pArena!=NULL) ? *pArena : localArena;
+	WorkArena::Mark arenaMark = arena.GetMark();
+
+	// morphology process
+	long long nStartNs = StartProfile(pProfiler);
+	int nIter = 7;
+	cv::Mat grdImg = arena.CreateMat(binImg.rows, binImg.cols, CV_8UC1);
+	//cv::Mat kernel(3, 3, CV_8U, cv::Scalar(1)); // =cv::MORPH_RECT
+	cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3,3));
+	cv::morphologyEx(binImg, grdImg, cv::MORPH_GRADIENT, kernel, cv::Point(-1,-1), nIter);
+	EndProfile(pProfiler, "morphology", nStartNs);
+
+	// find contours and auto labeling
+	nStartNs = StartProfile(pProfiler);
+	std::vector< std::vector<cv::Point> > contours;
+	std::vector<cv::Vec4i> hierarchy;
+	cv::Mat cntImg = arena.CreateMat(binImg.rows, binImg.cols, CV_32SC1);
+	grdImg.convertTo(cntImg, CV_32SC1, 1.0);
+	cv::findContours(cntImg, contours, hierarchy, cv::RETR_CCOMP, cv::CHAIN_APPROX_SIMPLE);
+	if(contours.empty()==true)
+	{
+		arena.Rewind(arenaMark);
+		EndProfile(pProfiler, "contours", nStartNs, 0);
+		return false;
+	}
+	cv::Mat markers = cntImg; // the contour image is no longer used
+	int compCount = CreateMarkerImage(grdImg.size(), contours, hierarchy, markers);
+	EndProfile(pProfiler, "contours", nStartNs, contours.size());
+
+	// watershed
+	nStartNs = StartProfile(pProfiler);
+	cv::watershed(clrImg, markers);
+
+	// change color and create watershed image
+	wsdImg.create(markers.size(), CV_8UC3);
+	for (int y=0; y<markers.rows; ++y)
+	{
+		for (int x=0; x<markers.cols; ++x)
+		{
+			int index = markers.at<int>(y, x);
+			if (index==-1)
+			{
+				wsdImg.at<cv::Vec3b>(y, x) = cv::Vec3b(128,128,128);
+			}
+			else if (index==0 || index>compCount)
+			{
+				wsdImg.at<cv::Vec3b>(y, x) = cv::Vec3b(0,0,0);
+			}
+			else
+			{
+				wsdImg.at<cv::Vec3b>(y, x) = cv::Vec3b(128,128,128);
+			}
+		}
+	}
+	arena.Rewind(arenaMark);
+	EndProfile(pProfiler, "watershed", nStartNs);
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Marker image of the watershed (CV_32SC1) from the contours of RETR_CCOMP.
+// The labels are the same as drawing the top level contour i (0 - compCount-1) by i+1 and adding 1
+// to the whole image after each contour : the filled contours (without holes) are compCount+1,
+// and the others are compCount. Each pixel is written by one fill and one drawContours per contour,
+// no pass over the whole image per contour.
+// return compCount : number of the top level contours
+int CreateMarkerImage(const cv::Size& size, const std::vector< std::vector<cv::Point> >& contours, const std::vector<cv::Vec4i>& hierarchy, cv::Mat& markers)
+{
+	int compCount = 0;
+	for (int idx=(contours.empty() ? -1 : 0); idx>=0; idx=hierarchy[idx][0])
+	{
+		++compCount;
+	}
+	markers.create(size, CV_32SC1);
+	markers.setTo(cv::Scalar::all(compCount));
+	for (int idx=(contours.empty() ? -1 : 0); idx>=0; idx=hierarchy[idx][0])
+	{
+		cv::drawContours(markers, contours, idx, cv::Scalar::all(compCount+1), -1, 8, hierarchy, INT_MAX);
+	}
+	return compCount;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Layout block segmentation : the content pixels (gray <= 200) are dilated by kBlockMargin,
+// and the bounding rect of each 8-connected block of them is a part.
+// No contour, marker or watershed image, so the time is near linear in the pixels.
+// The image is processed by bands of nBandH rows with kBandOverlap rows above and below
+// (>= kBlockMargin, so the dilated band rows are the same as on the whole image), and the band
+// rows are fed to one RunLengthGrouper, so the parts don't depend on nBandH.
+void CreateBlockPartRectList(const cv::Mat& gryImg, const int& nBandH, std::vector<cv::Rect>& partRectList, Profiler* pProfiler/*=NULL*/, WorkArena* pArena/*=NULL*/)
+{
+	WorkArena localArena;
+	WorkArena& arena = (pArena!=NULL) ? *pArena : localArena;
+	WorkArena::Mark arenaMark = arena.GetMark();
+
+	int nH = gryImg.rows;
+	int nW = gryImg.cols;
+	int nStepH = std::max(1, std::min(nH, nBandH));
+	// binary image of the largest band, each band uses its rows from the top
+	cv::Mat bandBinImg = arena.CreateMat(std::min(nH, nStepH+2*kBandOverlap), nW, CV_8UC1);
+	cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2*kBlockMargin+1, 2*kBlockMargin+1));
+	RunLengthGrouper grouper(&arena);
+	for (int nYs=0; nYs<nH; nYs+=nStepH)
+	{
+		int nYe = std::min(nH, nYs+nStepH);
+		// the band with overlap rows, the overlap rows are dilated but not grouped
+		int nTileYs = std::max(0, nYs-kBandOverlap);
+		int nTileYe = std::min(nH, nYe+kBandOverlap);
+		if (nStepH<nH)
+		{
+			std::clog << "  band (" << nYs << " - " << nYe << ")" << std::endl;
+		}
+
+		long long nStartNs = StartProfile(pProfiler);
+		cv::Mat binImg = bandBinImg.rowRange(0, nTileYe-nTileYs);
+		cv::threshold(gryImg.rowRange(nTileYs, nTileYe), binImg, 200, 255, cv::THRESH_BINARY_INV);
+		EndProfile(pProfiler, "threshold", nStartNs);
+
+		nStartNs = StartProfile(pProfiler);
+		cv::dilate(binImg, binImg, kernel);
+		EndProfile(pProfiler, "morphology", nStartNs);
+
+		nStartNs = StartProfile(pProfiler);
+		for (int y=nYs; y<nYe; ++y)
+		{
+			grouper.AddRow(binImg.ptr<unsigned char>(y-nTileYs), nW);
+		}
+		EndProfile(pProfiler, "grouping", nStartNs);
+	}
+	long long nStartNs = StartProfile(pProfiler);
+	grouper.GetPartRectList(partRectList);
+	EndProfile(pProfiler, "grouping", nStartNs, partRectList.size());
+	arena.Rewind(arenaMark);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+RunLengthGrouper::RunLengthGrouper(WorkArena* pArena/*=NULL*/)
+	: m_nY(0)
+	, m_nParentList(ArenaAllocator<int>(pArena))
+	, m_nBoxList(ArenaAllocator<cv::Vec4i>(pArena))
+	, m_prevRunList(ArenaAllocator<Run>(pArena))
+	, m_curRunList(ArenaAllocator<Run>(pArena))
+{
+}
+// each run of the row is merged with the runs of the previous row it touches (union-find on runs)
+void RunLengthGrouper::AddRow(const unsigned char* pRow, const int& nW)
+{
+	const int y = m_nY;
+	m_curRunList.clear();
+	unsigned int nPrevIdx = 0;
+	for (int x=0; x<nW; )
+	{
+		if (pRow[x]==0)
+		{
+			++x;
+			continue;
+		}
+		Run run;
+		run.nXs = x;
+		while (x<nW && pRow[x]!=0) ++x;
+		run.nXe = x;
+		run.nLabel = -1;
+
+		// runs of the previous row which touch this run (diagonal included)
+		while (nPrevIdx<m_prevRunList.size() && m_prevRunList.at(nPrevIdx).nXe<run.nXs) ++nPrevIdx;
+		for (unsigned int i=nPrevIdx; i<m_prevRunList.size() && m_prevRunList.at(i).nXs<=run.nXe; ++i)
+		{
+			int nRoot = m_prevRunList.at(i).nLabel;
+			while (m_nParentList.at(nRoot)!=nRoot)
+			{
+				m_nParentList.at(nRoot) = m_nParentList.at(m_nParentList.at(nRoot));
+				nRoot = m_nParentList.at(nRoot);
+			}
+			if (run.nLabel<0)
+			{
+				run.nLabel = nRoot;
+			}
+			else if (nRoot!=run.nLabel)
+			{
+				m_nParentList.at(nRoot) = run.nLabel;
+				cv::Vec4i& box = m_nBoxList.at(run.nLabel);
+				const cv::Vec4i& childBox = m_nBoxList.at(nRoot);
+				box[0] = std::min(box[0], childBox[0]);
+				box[1] = std::min(box[1], childBox[1]);
+				box[2] = std::max(box[2], childBox[2]);
+				box[3] = std::max(box[3], childBox[3]);
+			}
+		}
+		if (run.nLabel<0)
+		{
+			run.nLabel = (int)m_nParentList.size();
+			m_nParentList.push_back(run.nLabel);
+			m_nBoxList.push_back(cv::Vec4i(run.nXs, y, run.nXe-1, y));
+		}
+		else
+		{
+			cv::Vec4i& box = m_nBoxList.at(run.nLabel);
+			box[0] = std::min(box[0], run.nXs);
+			box[2] = std::max(box[2], run.nXe-1);
+			box[3] = y;
+		}
+		m_curRunList.push_back(run);
+	}
+	m_prevRunList.swap(m_curRunList);
+	++m_nY;
+}
+void RunLengthGrouper::GetPartRectList(std::vector<cv::Rect>& partRectList) const
+{
+	for (unsigned int i=0; i<m_nParentList.size(); ++i)
+	{
+		if (m_nParentList.at(i)==(int)i)
+		{
+			const cv::Vec4i& box = m_nBoxList.at(i);
+			partRectList.push_back(cv::Rect(box[0], box[1], box[2]-box[0]+1, box[3]-box[1]+1));
+		}
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bounding rects of the 8-connected components of non-zero pixels (CV_8UC1).
+// Each run of a row is merged with the runs of the previous row it touches (union-find on runs),
+// so the time is linear in the pixels and the memory in the runs of 2 rows and the components.
+// The runs and labels are on pArena (NULL : heap), the caller gives them back.
+void GetRunLengthPartRectList(const cv::Mat& binImg, std::vector<cv::Rect>& partRectList, WorkArena* pArena/*=NULL*/)
+{
+	RunLengthGrouper grouper(pArena);
+	for (int y=0; y<binImg.rows; ++y)
+	{
+		grouper.AddRow(binImg.ptr<unsigned char>(y), binImg.cols);
+	}
+	grouper.GetPartRectList(partRectList);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// "watershed" or "blocks"
+bool ParseSegmenterType(const std::string& strSegmenter, SegmenterType& segmenterType)
+{
+	if (strSegmenter=="watershed")
+	{
+		segmenterType = kSegmenterWatershed;
+	}
+	else if (strSegmenter=="blocks")
+	{
+		segmenterType = kSegmenterBlocks;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// ImgSeg01 of the old (baseline) image through the part cache (options.strCacheDir).
+// On a miss the descriptors of all parts are computed and stored, so that the entry can be used
+// whichever parts the later runs match by position. A broken or foreign entry is a miss.
+void LoadOrCreatePartList(ImageContext& img, const DiffOptions& options, std::vector<Part>& partList)
+{
+	if (options.strCacheDir.empty() || img.GetColor().data==NULL)
+	{
+		ImgSeg01(img, options, partList);
+		return;
+	}
+
+	const cv::Mat& clrImg = img.GetColor();
+	const cv::Mat& gryImg = img.GetGray();
+	PartCache cache(options.strCacheDir, options.nCacheMaxMB);
+	std::string strKey = PartCache::GetKey(clrImg, options);
+	std::vector<cv::Rect> partRectList;
+	std::vector<cv::Mat> descriptorList;
+	long long nStartNs = StartProfile(options.pProfiler);
+	if (cache.Load(strKey, clrImg.size(), partRectList, descriptorList))
+	{
+		EndProfile(options.pProfiler, "cache_load", nStartNs, partRectList.size());
+		AddProfileCount(options.pProfiler, "cache_hits", 1);
+		std::clog << " Part cache hit : " << strKey << " (" << partRectList.size() << " parts)" << std::endl;
+		for (unsigned int i=0; i<partRectList.size(); ++i)
+		{
+			Part part;
+			part.rect = partRectList.at(i);
+			part.clrImg = clrImg(part.rect);
+			part.gryImg = gryImg(part.rect);
+			part.descriptors = descriptorList.at(i);
+			part.bHasDescriptor = true;
+			partList.push_back(part);
+		}
+		return;
+	}
+	AddProfileCount(options.pProfiler, "cache_misses", 1);
+
+	ImgSeg01(img, options, partList);
+	ComputeKeypointAndDescriptor(partList, descriptorList, options.nThreadNum, kDescriptorBinary, options.pProfiler);
+	for (unsigned int i=0; i<partList.size(); ++i)
+	{
+		partRectList.push_back(partList.at(i).rect);
+		partList.at(i).descriptors = descriptorList.at(i);
+		partList.at(i).bHasDescriptor = true;
+	}
+	nStartNs = StartProfile(options.pProfiler);
+	if (cache.Store(strKey, clrImg.size(), partRectList, descriptorList)==false)
+	{
+		std::clog << " Can't store part cache : " << strKey << std::endl;
+	}
+	EndProfile(options.pProfiler, "cache_store", nStartNs);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// parts of an index, img : ImageContext of the same index
+void CreatePartListFromIndex(ImageContext& img, const BaselineIndex& index, std::vector<Part>& partList)
+{
+	const cv::Mat& clrImg = img.GetColor();
+	const cv::Mat& gryImg = img.GetGray();
+	const std::vector<cv::Rect>& partRectList = index.GetPartRectList();
+	for (unsigned int i=0; i<partRectList.size(); ++i)
+	{
+		Part part;
+		part.rect = partRectList.at(i);
+		part.clrImg = clrImg(part.rect);
+		part.gryImg = gryImg(part.rect);
+		part.descriptors = index.GetDescriptorList().at(i);
+		part.bHasDescriptor = true;
+		partList.push_back(part);
+	}
+	std::clog << " Parts from index : " << partList.size() << std::endl;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The status and the matched part of each part are set in oldTable and newTable (part id : index in the part list).
+void ImgSeg02(const std::vector<Part>& oldPartList, const std::vector<Part>& newPartList, const std::vector<cv::Range>& changedBandList, const DiffOptions& options, PartTable& oldTable, PartTable& newTable)
+{
+	std::string strFuncName = "ImgSeg02";
+	int nStepNo = 0;
+	std::string strStepName = "";
+
+	// Step1 : match parts at the same position in unchanged rows
+	++nStepNo;
+	strStepName = "Match parts at the same position in unchanged rows";
+	SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	oldTable.Init(oldPartList);
+	newTable.Init(newPartList);
+	MatchSamePositionPart(changedBandList, oldTable, newTable);
+	std::vector<int> nSamePositionIdList;
+	newTable.GetIdList(kPartSamePosition, nSamePositionIdList);
+	std::clog << "  same position parts (" << nSamePositionIdList.size() << ")" << std::endl;
+	AddProfileCount(options.pProfiler, "same_position_parts", nSamePositionIdList.size());
+	SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// Step1 : match parts at the same position in unchanged rows
+
+
+	/* old <-> new */
+	// Step2 : feature detector and matching between base and target image
+	++nStepNo;
+	strStepName = "Feature detector and matching between old and new image";
+	SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	ExecuteFeatureDetectorAndMatching(oldPartList, newPartList, options, oldTable, newTable);
+	SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// Step2 : feature detector and matching between base and target image
+
+	std::clog << "\n" << std::endl;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Matched new parts are located in the old image in the order of part id (top to bottom).
+void ImgSeg03(ImageContext& oldImg, const std::vector<Part>& newPartList, const PartTable& oldTable, const PartTable& newTable, const DiffOptions& options, DiffResult& result)
+{
+	std::string strFuncName = "ImgSeg03";
+	int nStepNo = 0;
+	std::string strStepName = "";
+
+	// Step 1 : check template match for old file and new->old same part files
+	++nStepNo;
+	strStepName = "Check template match for old file and new->old same part files";
+	SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	std::vector<int> nMatchedIdList;
+	std::vector<cv::Rect> matchedRectList; // the old part paired in ImgSeg02
+	for (int nId=0; nId<newTable.GetSize(); ++nId)
+	{
+		if (newTable.statusList[nId]==kPartSamePosition || newTable.statusList[nId]==kPartFeatureMatch)
+		{
+			nMatchedIdList.push_back(nId);
+			matchedRectList.push_back(oldTable.rectList[newTable.nMatchIdList[nId]]);
+		}
+	}
+	ExecuteTemplateMatchEx(oldImg, newPartList, nMatchedIdList, matchedRectList, options, result.matchedRegionList);
+	SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// Step 1 : check template match for old file and new->old same part files
+
+
+	// Step 2 : collect difference parts
+	++nStepNo;
+	strStepName = "Collect difference parts";
+	SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	for (int nId=0; nId<oldTable.GetSize(); ++nId)
+	{
+		if (oldTable.statusList[nId]==kPartNoMatch) result.deletedRectList.push_back(oldTable.rectList[nId]);
+	}
+	for (int nId=0; nId<newTable.GetSize(); ++nId)
+	{
+		if (newTable.statusList[nId]==kPartNoMatch) result.addedRectList.push_back(newTable.rectList[nId]);
+	}
+	std::clog << "  old difference parts (" << result.deletedRectList.size() << ")" << std::endl;
+	std::clog << "  new difference parts (" << result.addedRectList.size() << ")" << std::endl;
+	SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+	// Step 2 : collect difference parts
+
+	std::clog << "\n" << std::endl;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void ImgSeg04(ImageContext& oldImg, ImageContext& newImg, const DiffResult& result, const DiffOptions& options, const std::string& strOutputFolder)
+{
+	std::string strFuncName = "ImgSeg04";
+	int nStepNo = 0;
+	std::string strStepName = "";
+	const cv::Scalar clrDiffFrame = CV_RGB(255,0,0);
+	const cv::Scalar clrPartFrame = CV_RGB(0,255,0);
+
+	if (options.bCreateDiffImg == true) {
+	// Step 1 : draw information in old file
+		++nStepNo;
+		strStepName = "Draw information in old file";
+		SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+		cv::Mat drawImg = oldImg.GetColor().clone();
+		ConvertColorToGray(drawImg);
+		for (unsigned int i=0; i<result.matchedRegionList.size(); ++i)
+		{
+			const DiffRegion& region = result.matchedRegionList.at(i);
+			const cv::Rect& rect = region.oldRect;
+			cv::rectangle(drawImg, rect.tl(), cv::Point(rect.x+rect.width, rect.y+rect.height), clrDiffFrame, 0);
+			DrawDiffMask(drawImg, rect.tl(), region.diffMask, clrDiffFrame);
+		}
+		CreatePNGfromCVMATEx(10000, drawImg, strOutputFolder + options.strFileName, options.pProfiler);
+		SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+		// Step 1 : draw information in old file
+	}
+
+
+	if (options.bCreateChangeImg == true) {
+	// Step 2 : create base image with difference part frame
+		++nStepNo;
+		strStepName = "Create base image with difference part frame";
+		SetProcessStartMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+		cv::Mat clrOldImg = oldImg.GetColor().clone();
+		for (unsigned int i=0; i<result.deletedRectList.size(); ++i)
+		{
+			const cv::Rect& rect = result.deletedRectList.at(i);
+			cv::rectangle(clrOldImg, rect.tl(), cv::Point(rect.x+rect.width, rect.y+rect.height), clrPartFrame, 2);
+		}
+		CreatePNGfromCVMATEx(8000, clrOldImg, strOutputFolder + options.strFileName, options.pProfiler);
+
+		cv::Mat clrNewImg = newImg.GetColor().clone();
+		for (unsigned int i=0; i<result.addedRectList.size(); ++i)
+		{
+			const cv::Rect& rect = result.addedRectList.at(i);
+			cv::rectangle(clrNewImg, rect.tl(), cv::Point(rect.x+rect.width, rect.y+rect.height), clrPartFrame, 2);
+		}
+		CreatePNGfromCVMATEx(9000, clrNewImg, strOutputFolder + options.strFileName, options.pProfiler);
+		SetProcessEndMsg(strFuncName, nStepNo, strStepName, options.pProfiler);
+		// Step 2 : Create base image with difference part frame
+	}
+
+	std::clog << "\n" << std::endl;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// A new part whose rows are all unchanged, and an old part with the same rect, have the same pixels.
+// They are matched here without feature detection (kPartSamePosition), the other parts stay pending.
+void MatchSamePositionPart(const std::vector<cv::Range>& changedBandList, PartTable& oldTable, PartTable& newTable)
+{
+	for (int j=0; j<newTable.GetSize(); ++j)
+	{
+		const cv::Rect& newRect = newTable.rectList[j];
+		if (IsInUnchangedBand(newRect, changedBandList)==false) continue;
+
+		for (int i=0; i<oldTable.GetSize(); ++i)
+		{
+			if (oldTable.statusList[i]==kPartPending && oldTable.rectList[i]==newRect)
+			{
+				oldTable.statusList[i] = kPartSamePosition;
+				oldTable.nMatchIdList[i] = j;
+				newTable.statusList[j] = kPartSamePosition;
+				newTable.nMatchIdList[j] = i;
+				break;
+			}
+		}
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void PartTable::Init(const std::vector<Part>& partList)
+{
+	rectList.resize(partList.size());
+	for (unsigned int i=0; i<partList.size(); ++i)
+	{
+		rectList[i] = partList[i].rect;
+	}
+	nDescriptorStartList.assign(partList.size(), 0);
+	nDescriptorNumList.assign(partList.size(), 0);
+	nMatchIdList.assign(partList.size(), -1);
+	statusList.assign(partList.size(), kPartPending);
+	descriptors = cv::Mat();
+}
+// the descriptors are copied once into one matrix, so matching reads the parts from one buffer
+void PartTable::SetDescriptors(const std::vector<int>& nIdList, const std::vector<cv::Mat>& descriptorList)
+{
+	int nRows = 0;
+	int nCols = 0;
+	int nType = CV_8UC1;
+	for (unsigned int k=0; k<descriptorList.size(); ++k)
+	{
+		const cv::Mat& partDescriptors = descriptorList[k];
+		if (partDescriptors.data==NULL) continue;
+		nRows += partDescriptors.rows;
+		nCols = partDescriptors.cols;
+		nType = partDescriptors.type();
+	}
+	descriptors.create(nRows, nCols, nType);
+	int nRow = 0;
+	for (unsigned int k=0; k<nIdList.size(); ++k)
+	{
+		int nId = nIdList[k];
+		const cv::Mat& partDescriptors = descriptorList.at(k);
+		nDescriptorStartList.at(nId) = nRow;
+		nDescriptorNumList.at(nId) = (partDescriptors.data!=NULL) ? partDescriptors.rows : 0;
+		if (partDescriptors.data==NULL) continue;
+		partDescriptors.copyTo(descriptors.rowRange(nRow, nRow+partDescriptors.rows));
+		nRow += partDescriptors.rows;
+	}
+}
+cv::Mat PartTable::GetDescriptors(const int& nId) const
+{
+	if (nDescriptorNumList[nId]==0) return cv::Mat();
+	return descriptors.rowRange(nDescriptorStartList[nId], nDescriptorStartList[nId]+nDescriptorNumList[nId]);
+}
+void PartTable::GetIdList(const PartStatus& status, std::vector<int>& nIdList) const
+{
+	nIdList.clear();
+	for (int nId=0; nId<GetSize(); ++nId)
+	{
+		if (statusList[nId]==status) nIdList.push_back(nId);
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool IsInUnchangedBand(const cv::Rect& rect, const std::vector<cv::Range>& changedBandList)
+{
+	for (unsigned int i=0; i<changedBandList.size(); ++i)
+	{
+		const cv::Range& band = changedBandList.at(i);
+		if (rect.y < band.end && band.start < rect.y+rect.height)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The pending parts of oldTable and newTable are matched by their descriptors, and the rest are kPartNoMatch.
+void ExecuteFeatureDetectorAndMatching(const std::vector<Part>& oldPartList, const std::vector<Part>& newPartList, const DiffOptions& options, PartTable& oldTable, PartTable& newTable)
+{
+	std::vector<int> nOldIdList, nNewIdList;
+	oldTable.GetIdList(kPartPending, nOldIdList);
+	newTable.GetIdList(kPartPending, nNewIdList);
+	std::clog << "  old (" << nOldIdList.size() << ")" << " <-> new (" << nNewIdList.size() << ")" << std::endl;
+
+	std::clog << "   Compute 'key points' and 'descriptor' of old part and new part" << std::endl;
+	{
+		std::vector<cv::Mat> oldPartDescriptorList, newPartDescriptorList;
+		if (options.nThreadNum<=1)
+		{
+			// one thread : old and new parts in turn on this thread
+			ComputeKeypointAndDescriptor(oldPartList, nOldIdList, oldPartDescriptorList, 1, options.descriptorType, options.pProfiler);
+			ComputeKeypointAndDescriptor(newPartList, nNewIdList, newPartDescriptorList, 1, options.descriptorType, options.pProfiler);
+		}
+		else
+		{
+			// old and new parts are computed at the same time, threads are shared by part count
+			unsigned int nThreadNum = options.nThreadNum;
+			unsigned int nPartNum = std::max(1u, (unsigned int)(nOldIdList.size() + nNewIdList.size()));
+			unsigned int nOldThreadNum = std::min(nThreadNum-1, std::max(1u, (unsigned int)(nThreadNum*nOldIdList.size()/nPartNum)));
+			unsigned int nNewThreadNum = nThreadNum - nOldThreadNum;
+			std::thread oldThread([&]()
+			{
+				ComputeKeypointAndDescriptor(oldPartList, nOldIdList, oldPartDescriptorList, nOldThreadNum, options.descriptorType, options.pProfiler);
+			});
+			ComputeKeypointAndDescriptor(newPartList, nNewIdList, newPartDescriptorList, nNewThreadNum, options.descriptorType, options.pProfiler);
+			oldThread.join();
+		}
+		oldTable.SetDescriptors(nOldIdList, oldPartDescriptorList);
+		newTable.SetDescriptors(nNewIdList, newPartDescriptorList);
+	}
+
+	std::clog << "   Compute 'key points' and 'descriptor' of old part" << std::endl;
+	for (unsigned int i=0; i<nOldIdList.size(); ++i)
+	{
+		std::clog << "    File No. " << i+1 << " : " << (oldTable.nDescriptorNumList[nOldIdList[i]]>0 ? "OK" : "key point size = 0.") << std::endl;
+	}
+	std::clog << "   Compute 'key points' and 'descriptor' of new part" << std::endl;
+	for (unsigned int j=0; j<nNewIdList.size(); ++j)
+	{
+		std::clog << "    File No. " << j+1 << " : " << (newTable.nDescriptorNumList[nNewIdList[j]]>0 ? "OK" : "key point size = 0.") << std::endl;
+	}
+
+
+	std::clog << "   Compute 'feature match' of old to new part" << std::endl;
+	std::vector<int> nMatchTable;
+	// each new part stops at its first match, the rest is computed below only when it is read
+	ComputeMatchTable(oldTable, nOldIdList, newTable, nNewIdList, nMatchTable, std::max(1u, options.nThreadNum), options.descriptorType, options.dPruneRatio, true, options.pProfiler);
+	const unsigned int nOldNum = nOldIdList.size();
+	// old -> new
+	{
+		for (unsigned int i=0; i<nOldNum; ++i)
+		{
+			int nOldId = nOldIdList[i];
+			std::clog << "    Old No. " << i+1 << " : " << std::flush;
+
+			if (oldTable.nDescriptorNumList[nOldId]==0)
+			{
+				std::clog << "key point size = 0." << std::endl;
+			}
+			else
+			{
+				std::clog << "" << std::endl;
+
+				unsigned int nNo = 0;
+				for (unsigned int j=0; j<nNewIdList.size(); ++j)
+				{
+					int nNewId = nNewIdList[j];
+					// matched new part is no longer a candidate
+					if (newTable.statusList[nNewId]==kPartFeatureMatch) continue;
+
+					std::clog << "     New No." << ++nNo << " : " << std::flush;
+
+					int nMatch = nMatchTable[j*nOldNum+i];
+					if (nMatch==kMatchUnknown)
+					{
+						// the old part of the first match of this new part has matched another new part
+						cv::Ptr<cv::DescriptorMatcher> matcher = CreatePartMatcher(newTable, nNewId, options.descriptorType);
+						nMatch = ComputePartMatch(oldTable, nOldId, newTable, nNewId, matcher, options.descriptorType, options.dPruneRatio, options.pProfiler);
+						nMatchTable[j*nOldNum+i] = nMatch;
+					}
+					if (nMatch==1)
+					{
+						std::clog << "Match" << std::endl;
+						// full or almost match
+						oldTable.statusList[nOldId] = kPartFeatureMatch;
+						oldTable.nMatchIdList[nOldId] = nNewId;
+						newTable.statusList[nNewId] = kPartFeatureMatch;
+						newTable.nMatchIdList[nNewId] = nOldId;
+						break;
+					}
+					else if (nMatch==-1)
+					{
+						std::clog << "Skip" << std::endl;
+					}
+					else
+					{
+						std::clog << "No Match" << std::endl;
+					}
+				}//for(j)
+			}
+
+			if (oldTable.statusList[nOldId]!=kPartFeatureMatch)
+			{
+				oldTable.statusList[nOldId] = kPartNoMatch;
+			}
+		}//for(i)
+	}
+
+	// new -> old
+	{
+		std::clog << "   Compute 'feature match' of new to old part" << std::endl;
+		for (unsigned int j=0; j<nNewIdList.size(); ++j)
+		{
+			int nNewId = nNewIdList[j];
+			std::clog << "    New No. " << j+1 << " : " << std::flush;
+
+			if (newTable.statusList[nNewId]==kPartFeatureMatch)
+			{
+				std::clog << "Match" << std::endl;
+			}
+			else
+			{
+				if (newTable.nDescriptorNumList[nNewId]>0)
+				{
+					std::clog << "No Match" << std::endl;
+				}
+				else
+				{
+					std::clog << "key point size = 0." << std::endl;
+				}
+				newTable.statusList[nNewId] = kPartNoMatch;
+			}
+		}
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// worker on nThreadNum threads, or on the calling thread when nThreadNum<=1
+void RunWorkers(const std::function<void()>& worker, const unsigned int& nThreadNum)
+{
+	if (nThreadNum<=1)
+	{
+		worker();
+		return;
+	}
+	std::vector<std::thread> threadList;
+	for (unsigned int t=0; t<nThreadNum; ++t)
+	{
+		threadList.push_back(std::thread(worker));
+	}
+	for (unsigned int t=0; t<threadList.size(); ++t)
+	{
+		threadList.at(t).join();
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// all parts of partList
+void ComputeKeypointAndDescriptor(const std::vector<Part>& partList, std::vector<cv::Mat>& descriptorList, const unsigned int& nThreadNum, const DescriptorType& descriptorType, Profiler* pProfiler/*=NULL*/)
+{
+	std::vector<int> nIdList(partList.size());
+	for (unsigned int i=0; i<partList.size(); ++i)
+	{
+		nIdList[i] = i;
+	}
+	ComputeKeypointAndDescriptor(partList, nIdList, descriptorList, nThreadNum, descriptorType, pProfiler);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Each part is computed by a worker thread with its own AKAZE (on the calling thread when nThreadNum<=1), and the
+// descriptors are stored in the order of nIdList (descriptorList[k] : partList[nIdList[k]]), so the result doesn't
+// depend on thread scheduling.
+void ComputeKeypointAndDescriptor(const std::vector<Part>& partList, const std::vector<int>& nIdList, std::vector<cv::Mat>& descriptorList, const unsigned int& nThreadNum, const DescriptorType& descriptorType, Profiler* pProfiler/*=NULL*/)
+{
+	descriptorList.assign(nIdList.size(), cv::Mat());
+
+	std::atomic<unsigned int> nNextIdx(0);
+	std::function<void()> worker = [&partList, &nIdList, &descriptorList, &nNextIdx, &descriptorType, pProfiler]()
+	{
+		cv::Ptr<cv::AKAZE> akaze = cv::AKAZE::create();
+		long long nKeypointNum = 0;
+		for (unsigned int i=nNextIdx++; i<nIdList.size(); i=nNextIdx++)
+		{
+			const Part& part = partList.at(nIdList[i]);
+			if (part.bHasDescriptor)
+			{
+				// from the part cache
+				cv::Mat descriptors = part.descriptors;
+				if (descriptors.data && descriptorType==kDescriptorFloat)
+				{
+					descriptors.convertTo(descriptors, CV_32F);
+				}
+				descriptorList.at(i) = descriptors;
+				continue;
+			}
+			const cv::Mat& gryImg = part.gryImg;
+
+			long long nStartNs = StartProfile(pProfiler);
+			std::vector<cv::KeyPoint> kpList;
+			akaze->detect(gryImg, kpList);
+			nKeypointNum += kpList.size();
+			if (kpList.size()==0)
+			{
+				EndProfile(pProfiler, "akaze", nStartNs, 0);
+				continue;
+			}
+			cv::Mat descriptors;
+			akaze->compute(gryImg, kpList, descriptors);
+			if (descriptorType==kDescriptorFloat)
+			{
+				descriptors.convertTo(descriptors, CV_32F);
+			}
+			descriptorList.at(i) = descriptors;
+			EndProfile(pProfiler, "akaze", nStartNs, kpList.size()); // value : key points of the part
+		}
+		AddProfileCount(pProfiler, "keypoints", nKeypointNum);
+	};
+	RunWorkers(worker, nThreadNum);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// nMatchTable[j*nOldIdList.size()+i] (new nNewIdList[j], old nOldIdList[i]) : 1 = match, 0 = no match,
+// -1 = skipped by IsMatchCandidate, kMatchUnknown = not computed.
+// The matcher index of each new part is built once and used by one worker thread only.
+// bFirstMatchOnly : a new part stops at its first matching old part, since the old parts take the new
+// parts in order and the later entries of the new part are read only when that old part takes another one.
+// A pair matches when the median distance is within kMaxMatchDistanceBinary (one changed bit) or
+// kMaxMatchDistanceFloat. The float descriptor is the binary one with each byte as a value (0-255), so
+// L2 <= 1.0 allows only one byte changed by 1. It isn't the same test as the binary one : a changed bit b
+// of a byte gives 2^b (only the lowest bits pass), and a byte changed by 1 can change several bits (127 -> 128).
+void ComputeMatchTable(const PartTable& oldTable, const std::vector<int>& nOldIdList, const PartTable& newTable, const std::vector<int>& nNewIdList, std::vector<int>& nMatchTable, const unsigned int& nThreadNum, const DescriptorType& descriptorType, const double& dPruneRatio, const bool& bFirstMatchOnly, Profiler* pProfiler/*=NULL*/)
+{
+	const unsigned int nOldNum = nOldIdList.size();
+
+	nMatchTable.assign(nNewIdList.size()*nOldNum, 0);
+
+	std::atomic<unsigned int> nNextIdx(0);
+	std::function<void()> worker = [&]()
+	{
+		long long nMatcherCallNum = 0;
+		for (unsigned int j=nNextIdx++; j<nNewIdList.size(); j=nNextIdx++)
+		{
+			int nNewId = nNewIdList[j];
+			if (newTable.nDescriptorNumList[nNewId]==0) continue;
+
+			cv::Ptr<cv::DescriptorMatcher> matcher = CreatePartMatcher(newTable, nNewId, descriptorType);
+			int* pMatchRow = &nMatchTable[j*nOldNum];
+			for (unsigned int i=0; i<nOldNum; ++i)
+			{
+				int nOldId = nOldIdList[i];
+				if (oldTable.nDescriptorNumList[nOldId]==0) continue;
+				pMatchRow[i] = ComputePartMatch(oldTable, nOldId, newTable, nNewId, matcher, descriptorType, dPruneRatio, pProfiler);
+				if (pMatchRow[i]>=0) ++nMatcherCallNum;
+				if (bFirstMatchOnly && pMatchRow[i]==1)
+				{
+					std::fill(pMatchRow+i+1, pMatchRow+nOldNum, kMatchUnknown);
+					break;
+				}
+			}
+		}
+		AddProfileCount(pProfiler, "matcher_calls", nMatcherCallNum);
+	};
+	RunWorkers(worker, nThreadNum);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// matcher with the descriptors of a new part (the part must have descriptors)
+cv::Ptr<cv::DescriptorMatcher> CreatePartMatcher(const PartTable& newTable, const int& nNewId, const DescriptorType& descriptorType)
+{
+	cv::Ptr<cv::DescriptorMatcher> matcher;
+	if (descriptorType==kDescriptorFloat)
+	{
+		matcher = cv::DescriptorMatcher::create("FlannBased");
+	}
+	else
+	{
+		matcher = cv::DescriptorMatcher::create("BruteForce-Hamming");
+	}
+	matcher->add(std::vector<cv::Mat>(1, newTable.GetDescriptors(nNewId)));
+	matcher->train();
+	return matcher;
+}
+// one entry of the match table (see ComputeMatchTable), matcher : CreatePartMatcher of the new part
+int ComputePartMatch(const PartTable& oldTable, const int& nOldId, const PartTable& newTable, const int& nNewId, const cv::Ptr<cv::DescriptorMatcher>& matcher, const DescriptorType& descriptorType, const double& dPruneRatio, Profiler* pProfiler/*=NULL*/)
+{
+	if (oldTable.nDescriptorNumList[nOldId]==0 || newTable.nDescriptorNumList[nNewId]==0)
+	{
+		return 0;
+	}
+	if (IsMatchCandidate(oldTable.rectList[nOldId], newTable.rectList[nNewId], dPruneRatio)==false)
+	{
+		return -1;
+	}
+	const float fMaxDistance = (descriptorType==kDescriptorFloat) ? kMaxMatchDistanceFloat : kMaxMatchDistanceBinary;
+
+	long long nStartNs = StartProfile(pProfiler);
+	std::vector<cv::DMatch> matches;
+	matcher->match(oldTable.GetDescriptors(nOldId), matches);
+	EndProfile(pProfiler, "match", nStartNs);
+	if (matches.size()==0)
+	{
+		return 0;
+	}
+	std::nth_element(matches.begin(), matches.begin() + matches.size()/2, matches.end()); // by cv::DMatch::distance
+	return (matches[ matches.size()/2 ].distance <= fMaxDistance) ? 1 : 0; // full or almost match
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool IsMatchCandidate(const cv::Rect& oldRect, const cv::Rect& newRect, const double& dPruneRatio)
+{
+	if (dPruneRatio<=0.0) return true;
+
+	double dRatioW = (double)std::max(oldRect.width, newRect.width) / std::max(1, std::min(oldRect.width, newRect.width));
+	double dRatioH = (double)std::max(oldRect.height, newRect.height) / std::max(1, std::min(oldRect.height, newRect.height));
+	return (dRatioW<=dPruneRatio && dRatioH<=dPruneRatio) ? true : false;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compute the match table with both binary and float descriptor, and report the pairs which have
+// different decision. Return the number of different pairs.
+int CheckDescriptorMatchDecision(const std::vector<Part>& oldPartList, const std::vector<Part>& newPartList, const unsigned int& nThreadNum)
+{
+	PartTable oldTable, newTable;
+	oldTable.Init(oldPartList);
+	newTable.Init(newPartList);
+	std::vector<int> nOldIdList, nNewIdList;
+	oldTable.GetIdList(kPartPending, nOldIdList);
+	newTable.GetIdList(kPartPending, nNewIdList);
+	std::vector<int> nMatchTable[2];
+	const DescriptorType descriptorTypeList[2] = { kDescriptorBinary, kDescriptorFloat };
+	for (int k=0; k<2; ++k)
+	{
+		std::vector<cv::Mat> oldPartDescriptorList, newPartDescriptorList;
+		ComputeKeypointAndDescriptor(oldPartList, oldPartDescriptorList, std::max(1u, nThreadNum), descriptorTypeList[k]);
+		ComputeKeypointAndDescriptor(newPartList, newPartDescriptorList, std::max(1u, nThreadNum), descriptorTypeList[k]);
+		oldTable.SetDescriptors(nOldIdList, oldPartDescriptorList);
+		newTable.SetDescriptors(nNewIdList, newPartDescriptorList);
+		ComputeMatchTable(oldTable, nOldIdList, newTable, nNewIdList, nMatchTable[k], std::max(1u, nThreadNum), descriptorTypeList[k], 0.0, false);
+	}
+
+	int nDiffCount = 0;
+	int nMatchCount[2] = { 0, 0 };
+	for (unsigned int j=0; j<newPartList.size(); ++j)
+	{
+		for (unsigned int i=0; i<oldPartList.size(); ++i)
+		{
+			int nBinary = nMatchTable[0].at(j*oldPartList.size()+i);
+			int nFloat = nMatchTable[1].at(j*oldPartList.size()+i);
+			if (nBinary==1) ++nMatchCount[0];
+			if (nFloat==1) ++nMatchCount[1];
+			if (nBinary!=nFloat)
+			{
+				++nDiffCount;
+				std::cout << " Old No. " << i+1 << " <-> New No. " << j+1 << " : binary=" << nBinary << " float=" << nFloat << std::endl;
+			}
+		}
+	}
+	std::cout << "Descriptor check : " << oldPartList.size()*newPartList.size() << " pairs, "
+	          << nMatchCount[0] << " binary matches, " << nMatchCount[1] << " float matches, "
+	          << nDiffCount << " different decisions" << std::endl;
+
+	return nDiffCount;
+}
+// --check-descriptor : the parts of both images (with the ignored regions of options) are checked
+// by CheckDescriptorMatchDecision.
+// return 0 : same decisions, kExitCodeDecisionDiffer : different decisions, -2 : can't load images
+int ExecuteCheckDescriptor(const std::string& strNewFile, const std::string& strOldFile, const DiffOptions& options)
+{
+	ImageContext oldImg(strOldFile);
+	ImageContext newImg(strNewFile);
+	if (oldImg.GetColor().data==NULL || newImg.GetColor().data==NULL)
+	{
+		return -2;
+	}
+	oldImg.ApplyIgnoreRegion(options);
+	newImg.ApplyIgnoreRegion(options);
+
+	std::vector<Part> newPartList, oldPartList;
+	ImgSeg01(newImg, options, newPartList);
+	ImgSeg01(oldImg, options, oldPartList);
+	return (CheckDescriptorMatchDecision(oldPartList, newPartList, options.nThreadNum)==0) ? 0 : kExitCodeDecisionDiffer;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// parts partList[nIdList[k]] are located in img, matchedRectList[k] : the part of img paired with it
+void ExecuteTemplateMatchEx(ImageContext& img, const std::vector<Part>& partList, const std::vector<int>& nIdList, const std::vector<cv::Rect>& matchedRectList, const DiffOptions& options, std::vector<DiffRegion>& regionList)
+{
+	// current image
+	const cv::Mat& curClrImg = img.GetColor();
+	// frequency domain matching of large parts, unless its buffers exceed the memory budget
+	// (--max-memory, or kMaxFFTMemoryMB without it), cv::matchTemplate otherwise
+	FrameCorrelator correlator(img.GetGray());
+	unsigned int nFFTMemoryMB = (options.nMaxMemoryMB>0) ? options.nMaxMemoryMB : kMaxFFTMemoryMB;
+	bool bUseFFT = FrameCorrelator::GetMemorySize(curClrImg.size()) <= (size_t)nFFTMemoryMB*1024*1024;
+	for (unsigned int k=0; k<nIdList.size(); ++k)
+	{
+		const Part& part = partList.at(nIdList[k]);
+		// part image
+		const cv::Mat& partClrImg = part.clrImg;
+
+		// best match position
+		long long nStartNs = StartProfile(options.pProfiler);
+		cv::Point ptMin;
+		bool bIsLocated = LocateTemplate(img, part, matchedRectList.at(k), options, bUseFFT ? &correlator : NULL, ptMin);
+		EndProfile(options.pProfiler, "template_match", nStartNs, partClrImg.total());
+		if (bIsLocated==false)
+		{
+			continue; // the part is larger than the current image
+		}
+
+		int nPartH = partClrImg.rows;
+		int nPartW = partClrImg.cols;
+		int nXs = ptMin.x;
+		int nYs = ptMin.y;
+		cv::Mat diffMask;
+		int nDiffPixelNum = ComputeDiffMask(curClrImg(cv::Rect(nXs, nYs, nPartW, nPartH)), partClrImg, diffMask);
+
+		DiffRegion region;
+		region.oldRect = cv::Rect(nXs, nYs, nPartW, nPartH);
+		region.newRect = part.rect;
+		region.diffMask = diffMask;
+		region.nDiffPixelNum = nDiffPixelNum;
+		regionList.push_back(region);
+	}//for(k)
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Position of the part in img (TM_SQDIFF minimum).
+// 1. window around matchedRect (the part of img paired with it), widened up to kMaxSearchWindowNum windows.
+//    The window minimum is taken only when it is exact or at matchedRect itself, so a part moved out of
+//    the window on a page of repeated blocks isn't taken for its neighbor.
+// 2. coarse-to-fine search on the image pyramid
+// 3. full frame (global minimum), when 1 and 2 don't find a good match (large parts : pCorrelator if not NULL)
+// return false : the part is larger than img
+bool LocateTemplate(ImageContext& img, const Part& part, const cv::Rect& matchedRect, const DiffOptions& options, FrameCorrelator* pCorrelator, cv::Point& ptMin)
+{
+	const cv::Mat& gryImg = img.GetGray();
+	const cv::Mat& partGryImg = part.gryImg;
+	const cv::Rect frameRect(0, 0, gryImg.cols, gryImg.rows);
+	const double dMaxScore = kMaxLocalMatchScore * partGryImg.total();
+	double dMinVal;
+
+	// 1. window
+	if (options.nSearchMargin>0)
+	{
+		int nMargin = options.nSearchMargin;
+		for (int n=0; n<kMaxSearchWindowNum; ++n, nMargin*=4)
+		{
+			cv::Rect searchRect(matchedRect.x-nMargin, matchedRect.y-nMargin, std::max(matchedRect.width, part.rect.width)+2*nMargin, std::max(matchedRect.height, part.rect.height)+2*nMargin);
+			if ((searchRect & frameRect)==frameRect)
+			{
+				break; // same as the full frame
+			}
+			if (MatchTemplateInRect(gryImg, partGryImg, searchRect, dMinVal, ptMin) && (dMinVal==0.0 || ptMin==matchedRect.tl()))
+			{
+				AddProfileCount(options.pProfiler, "template_window", 1);
+				return true;
+			}
+		}
+	}
+
+	// 2. coarse-to-fine
+	int nScale = 1 << std::max(0, options.nPyramidLevel);
+	if (options.nPyramidLevel>0 && partGryImg.cols>=nScale*4 && partGryImg.rows>=nScale*4)
+	{
+		cv::Mat coarsePartImg = partGryImg;
+		for (int n=0; n<options.nPyramidLevel; ++n)
+		{
+			cv::pyrDown(coarsePartImg, coarsePartImg);
+		}
+		const cv::Mat& coarseImg = img.GetGrayPyramid(options.nPyramidLevel);
+		cv::Point ptCoarse;
+		if (MatchTemplateInRect(coarseImg, coarsePartImg, cv::Rect(0, 0, coarseImg.cols, coarseImg.rows), dMinVal, ptCoarse))
+		{
+			// refine around the coarse position
+			cv::Rect searchRect(ptCoarse.x*nScale-nScale, ptCoarse.y*nScale-nScale, partGryImg.cols+2*nScale, partGryImg.rows+2*nScale);
+			if (MatchTemplateInRect(gryImg, partGryImg, searchRect, dMinVal, ptMin) && dMinVal<=dMaxScore)
+			{
+				AddProfileCount(options.pProfiler, "template_pyramid", 1);
+				return true;
+			}
+		}
+	}
+
+	// 3. full frame
+	if (pCorrelator!=NULL && (int)partGryImg.total()>=kMinFFTPartArea && partGryImg.cols<=gryImg.cols && partGryImg.rows<=gryImg.rows)
+	{
+		pCorrelator->MatchTemplate(partGryImg, dMinVal, ptMin);
+		AddProfileCount(options.pProfiler, "template_fft", 1);
+		return true;
+	}
+	AddProfileCount(options.pProfiler, "template_full", 1);
+	return MatchTemplateInRect(gryImg, partGryImg, frameRect, dMinVal, ptMin);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// TM_SQDIFF minimum of partGryImg inside searchRect of gryImg (ptMin : gryImg coordinate)
+// return false : searchRect (clipped by gryImg) is smaller than the part
+bool MatchTemplateInRect(const cv::Mat& gryImg, const cv::Mat& partGryImg, const cv::Rect& searchRect, double& dMinVal, cv::Point& ptMin)
+{
+	cv::Rect rect = searchRect & cv::Rect(0, 0, gryImg.cols, gryImg.rows);
+	if (rect.width<partGryImg.cols || rect.height<partGryImg.rows)
+	{
+		return false;
+	}
+	cv::Mat retImg;
+	cv::matchTemplate(gryImg(rect), partGryImg, retImg, cv::TM_SQDIFF);
+	cv::minMaxLoc(retImg, &dMinVal, NULL, &ptMin, NULL);
+	ptMin.x += rect.x;
+	ptMin.y += rect.y;
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+FrameCorrelator::FrameCorrelator(const cv::Mat& gryImg)
+	: m_gryImg(gryImg)
+{
+}
+// SQDIFF(x, y) = sum(T^2) - 2 * sum(I*T) + sum(I^2), sum(I*T) : correlation by DFT, sum(I^2) : integral image
+void FrameCorrelator::MatchTemplate(const cv::Mat& partGryImg, double& dMinVal, cv::Point& ptMin)
+{
+	// image : once for all parts
+	// (no wrap around for the valid positions, as the DFT size is not smaller than the image)
+	if (m_dftImg.empty())
+	{
+		m_dftSize = cv::Size(cv::getOptimalDFTSize(m_gryImg.cols), cv::getOptimalDFTSize(m_gryImg.rows));
+		cv::Mat padImg = cv::Mat::zeros(m_dftSize, CV_64FC1);
+		cv::Mat padRoiImg = padImg(cv::Rect(0, 0, m_gryImg.cols, m_gryImg.rows));
+		m_gryImg.convertTo(padRoiImg, CV_64F);
+		cv::dft(padImg, m_dftImg);
+
+		// integral of squares only (cv::integral also makes the integral of the values)
+		m_sqSumImg = cv::Mat::zeros(m_gryImg.rows+1, m_gryImg.cols+1, CV_64FC1);
+		for (int y=0; y<m_gryImg.rows; ++y)
+		{
+			const unsigned char* pGry = m_gryImg.ptr<unsigned char>(y);
+			const double* pSqSumTop = m_sqSumImg.ptr<double>(y);
+			double* pSqSum = m_sqSumImg.ptr<double>(y+1);
+			double dRowSqSum = 0.0;
+			for (int x=0; x<m_gryImg.cols; ++x)
+			{
+				dRowSqSum += (double)pGry[x]*pGry[x];
+				pSqSum[x+1] = pSqSumTop[x+1] + dRowSqSum;
+			}
+		}
+	}
+
+	// part
+	int nPartW = partGryImg.cols;
+	int nPartH = partGryImg.rows;
+	cv::Mat padPartImg = cv::Mat::zeros(m_dftSize, CV_64FC1);
+	cv::Mat padPartRoiImg = padPartImg(cv::Rect(0, 0, nPartW, nPartH));
+	partGryImg.convertTo(padPartRoiImg, CV_64F);
+	double dPartSqSum = 0.0;
+	for (int y=0; y<nPartH; ++y)
+	{
+		const double* pPart = padPartImg.ptr<double>(y);
+		for (int x=0; x<nPartW; ++x)
+		{
+			dPartSqSum += pPart[x]*pPart[x];
+		}
+	}
+	// the part spectrum in place of the padded part
+	cv::Mat corrImg;
+	cv::dft(padPartImg, padPartImg);
+	cv::mulSpectrums(m_dftImg, padPartImg, padPartImg, 0, true);
+	cv::idft(padPartImg, corrImg, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+	// minimum (the first one in raster order, as cv::minMaxLoc)
+	dMinVal = DBL_MAX;
+	ptMin = cv::Point(0, 0);
+	for (int y=0; y<=m_gryImg.rows-nPartH; ++y)
+	{
+		const double* pCorr = corrImg.ptr<double>(y);
+		const double* pSqSumTop = m_sqSumImg.ptr<double>(y);
+		const double* pSqSumBottom = m_sqSumImg.ptr<double>(y+nPartH);
+		for (int x=0; x<=m_gryImg.cols-nPartW; ++x)
+		{
+			double dSqSum = pSqSumBottom[x+nPartW] - pSqSumBottom[x] - pSqSumTop[x+nPartW] + pSqSumTop[x];
+			double dVal = dPartSqSum - 2.0*pCorr[x] + dSqSum;
+			if (dVal<dMinVal)
+			{
+				dMinVal = dVal;
+				ptMin = cv::Point(x, y);
+			}
+		}
+	}
+}
+// peak memory : image spectrum, padded part (its spectrum in place) and correlation, and the integral of squares
+size_t FrameCorrelator::GetMemorySize(const cv::Size& imgSize)
+{
+	size_t nDftArea = (size_t)cv::getOptimalDFTSize(imgSize.width) * cv::getOptimalDFTSize(imgSize.height);
+	return nDftArea*sizeof(double)*3 + (size_t)(imgSize.width+1)*(imgSize.height+1)*sizeof(double);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+ImageContext::ImageContext(const std::string& strFile)
+	: m_strFile(strFile)
+	, m_bIsLoaded(false)
+	, m_bIsOwned(true)
+{
+}
+ImageContext::ImageContext(const cv::Mat& img, const bool& bIsOwned/*=false*/)
+	: m_strFile("")
+	, m_bIsLoaded(true)
+	, m_bIsOwned(bIsOwned)
+{
+	if (img.empty())
+	{
+		m_clrImg = img;
+	}
+	else if (img.channels()==1)
+	{
+		cv::cvtColor(img, m_clrImg, cv::COLOR_GRAY2BGR);
+		m_bIsOwned = true;
+	}
+	else if (img.channels()==4)
+	{
+		cv::cvtColor(img, m_clrImg, cv::COLOR_BGRA2BGR);
+		m_bIsOwned = true;
+	}
+	else
+	{
+		m_clrImg = img;
+	}
+}
+ImageContext::ImageContext(const BaselineIndex& index)
+	: m_strFile("")
+	, m_bIsLoaded(true)
+	, m_bIsOwned(false)
+	, m_clrImg(index.GetColor())
+	, m_gryPyramidList(index.GetGrayPyramidList())
+	, m_stripHashList(index.GetStripHashList())
+{
+	if (m_gryPyramidList.empty()==false)
+	{
+		m_gryImg = m_gryPyramidList.at(0);
+	}
+}
+const cv::Mat& ImageContext::GetColor()
+{
+	if (m_bIsLoaded==false)
+	{
+		m_clrImg = cv::imread(m_strFile, cv::IMREAD_COLOR);
+		m_bIsLoaded = true;
+	}
+	return m_clrImg;
+}
+const cv::Mat& ImageContext::GetGray()
+{
+	if (m_gryImg.empty() && GetColor().data)
+	{
+		cv::cvtColor(m_clrImg, m_gryImg, cv::COLOR_BGR2GRAY);
+	}
+	return m_gryImg;
+}
+const cv::Mat& ImageContext::GetHSV()
+{
+	if (m_hsvImg.empty() && GetColor().data)
+	{
+		cv::cvtColor(m_clrImg, m_hsvImg, cv::COLOR_BGR2HSV);
+	}
+	return m_hsvImg;
+}
+const cv::Mat& ImageContext::GetBinary()
+{
+	if (m_binImg.empty() && GetGray().data)
+	{
+		cv::threshold(m_gryImg, m_binImg, 200, 255, cv::THRESH_BINARY);
+	}
+	return m_binImg;
+}
+const cv::Mat& ImageContext::GetGrayPyramid(const int& nLevel)
+{
+	if (m_gryPyramidList.empty())
+	{
+		m_gryPyramidList.push_back(GetGray());
+	}
+	while ((int)m_gryPyramidList.size()<=nLevel)
+	{
+		cv::Mat coarseImg;
+		cv::pyrDown(m_gryPyramidList.back(), coarseImg);
+		m_gryPyramidList.push_back(coarseImg);
+	}
+	return m_gryPyramidList.at(nLevel);
+}
+const std::vector<uint64_t>& ImageContext::GetStripHash()
+{
+	if (m_stripHashList.empty() && GetColor().data)
+	{
+		ComputeStripHash(m_clrImg, kStripHeight, m_stripHashList);
+	}
+	return m_stripHashList;
+}
+// Fill the ignored pixels of the options in the color image (see FillIgnoreRegion), in place when this
+// context owns it, otherwise on a copy so the image of the caller isn't changed. The derived planes are dropped.
+void ImageContext::ApplyIgnoreRegion(const DiffOptions& options)
+{
+	if (HasIgnoreRegion(options)==false || GetColor().data==NULL)
+	{
+		return;
+	}
+	if (m_bIsOwned==false)
+	{
+		m_clrImg = m_clrImg.clone();
+		m_bIsOwned = true;
+	}
+	FillIgnoreRegion(options, m_clrImg);
+	m_gryImg.release();
+	m_hsvImg.release();
+	m_binImg.release();
+	m_gryPyramidList.clear();
+	m_stripHashList.clear();
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+Profiler::Profiler()
+	: m_nOriginNs(GetTimeNs())
+{
+}
+long long Profiler::GetTimeNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+int Profiler::GetThreadNo()
+{
+	std::map<std::thread::id, int>::iterator it = m_nThreadNoMap.find(std::this_thread::get_id());
+	if (it==m_nThreadNoMap.end())
+	{
+		int nThreadNo = (int)m_nThreadNoMap.size();
+		m_nThreadNoMap[std::this_thread::get_id()] = nThreadNo;
+		return nThreadNo;
+	}
+	return it->second;
+}
+void Profiler::StartStep(const std::string& strName)
+{
+	long long nStartNs = GetTimeNs();
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_nStepStartNsMap[std::make_pair(GetThreadNo(), strName)] = nStartNs;
+}
+void Profiler::EndStep(const std::string& strName)
+{
+	long long nEndNs = GetTimeNs();
+	std::lock_guard<std::mutex> lock(m_mtx);
+	int nThreadNo = GetThreadNo();
+	std::map<std::pair<int, std::string>, long long>::iterator it = m_nStepStartNsMap.find(std::make_pair(nThreadNo, strName));
+	if (it==m_nStepStartNsMap.end())
+	{
+		return;
+	}
+	Record record = { strName, nThreadNo, it->second - m_nOriginNs, nEndNs - it->second, -1 };
+	m_recordList.push_back(record);
+	m_nStepStartNsMap.erase(it);
+}
+void Profiler::AddTime(const std::string& strName, const long long& nStartNs, const long long& nValue/*=-1*/)
+{
+	long long nEndNs = GetTimeNs();
+	std::lock_guard<std::mutex> lock(m_mtx);
+	Record record = { strName, GetThreadNo(), nStartNs - m_nOriginNs, nEndNs - nStartNs, nValue };
+	m_recordList.push_back(record);
+}
+void Profiler::AddCount(const std::string& strName, const long long& nCount)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_nCountMap[strName] += nCount;
+}
+// {"peak_rss_kb": .., "counters": {name: count}, "stages": {name: {"count", "total_ns", "max_ns"}},
+//  "records": [{"name", "thread", "start_ns", "time_ns"[, "value"]}]}  (start_ns : from the construction)
+bool Profiler::WriteJSON(const std::string& strFile) const
+{
+	std::ofstream ofs(strFile.c_str());
+	if (ofs.is_open()==false)
+	{
+		return false;
+	}
+	struct rusage usage;
+	long long nPeakRSS = (getrusage(RUSAGE_SELF, &usage)==0) ? (long long)usage.ru_maxrss : -1; // [KB] on Linux
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	ofs << "{\n  \"peak_rss_kb\": " << nPeakRSS << ",\n  \"counters\": {";
+	for (std::map<std::string, long long>::const_iterator it=m_nCountMap.begin(); it!=m_nCountMap.end(); ++it)
+	{
+		ofs << (it==m_nCountMap.begin() ? "\n" : ",\n") << "    \"" << EscapeJSON(it->first) << "\": " << it->second;
+	}
+	ofs << "\n  },\n  \"stages\": ";
+	WriteStageList(ofs, "  ");
+	ofs << ",\n  \"records\": [";
+	for (unsigned int i=0; i<m_recordList.size(); ++i)
+	{
+		const Record& record = m_recordList.at(i);
+		ofs << (i==0 ? "\n" : ",\n") << "    {\"name\": \"" << EscapeJSON(record.strName) << "\", \"thread\": " << record.nThreadNo
+		    << ", \"start_ns\": " << record.nStartNs << ", \"time_ns\": " << record.nTimeNs;
+		if (record.nValue>=0)
+		{
+			ofs << ", \"value\": " << record.nValue;
+		}
+		ofs << "}";
+	}
+	ofs << "\n  ]\n}" << std::endl;
+	return ofs.good();
+}
+void Profiler::WriteStageJSON(std::ostream& os, const std::string& strIndent) const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	WriteStageList(os, strIndent);
+}
+// records aggregated by name
+void Profiler::WriteStageList(std::ostream& os, const std::string& strIndent) const
+{
+	struct Stage
+	{
+		long long nCount;
+		long long nTotalNs;
+		long long nMaxNs;
+	};
+	std::map<std::string, Stage> stageMap; // value-initialized (0) on first use
+	for (unsigned int i=0; i<m_recordList.size(); ++i)
+	{
+		Stage& stage = stageMap[m_recordList.at(i).strName];
+		stage.nCount += 1;
+		stage.nTotalNs += m_recordList.at(i).nTimeNs;
+		stage.nMaxNs = std::max(stage.nMaxNs, m_recordList.at(i).nTimeNs);
+	}
+	os << "{";
+	for (std::map<std::string, Stage>::const_iterator it=stageMap.begin(); it!=stageMap.end(); ++it)
+	{
+		os << (it==stageMap.begin() ? "\n" : ",\n") << strIndent << "  \"" << EscapeJSON(it->first) << "\": {\"count\": " << it->second.nCount
+		   << ", \"total_ns\": " << it->second.nTotalNs << ", \"max_ns\": " << it->second.nMaxNs << "}";
+	}
+	os << "\n" << strIndent << "}";
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+WorkArena::WorkArena(const size_t& nBlockSize/*=kArenaBlockSize*/)
+	: m_nBlockSize(nBlockSize)
+	, m_nBlockNo(0)
+	, m_nPos(0)
+{
+}
+WorkArena::~WorkArena()
+{
+	Release();
+}
+// the current block, the next kept block which has room, or a new block
+void* WorkArena::Allocate(const size_t& nSize)
+{
+	for ( ; m_nBlockNo<m_blockList.size(); ++m_nBlockNo, m_nPos=0)
+	{
+		const Block& block = m_blockList[m_nBlockNo];
+		size_t nStart = (m_nPos + kArenaAlignment-1) & ~(kArenaAlignment-1);
+		if (nStart+nSize<=block.nSize)
+		{
+			m_nPos = nStart + nSize;
+			return block.pData + nStart;
+		}
+	}
+	Block block;
+	block.nSize = std::max(m_nBlockSize, nSize);
+	void* pData = NULL;
+	if (posix_memalign(&pData, kArenaAlignment, block.nSize)!=0)
+	{
+		throw std::bad_alloc();
+	}
+	block.pData = static_cast<unsigned char*>(pData);
+	m_blockList.push_back(block);
+	m_nBlockNo = m_blockList.size()-1;
+	m_nPos = nSize;
+	return block.pData;
+}
+cv::Mat WorkArena::CreateMat(const int& nRows, const int& nCols, const int& nType)
+{
+	return cv::Mat(nRows, nCols, nType, Allocate((size_t)nRows*nCols*CV_ELEM_SIZE(nType)));
+}
+WorkArena::Mark WorkArena::GetMark() const
+{
+	Mark mark;
+	mark.nBlockNo = m_nBlockNo;
+	mark.nPos = m_nPos;
+	return mark;
+}
+void WorkArena::Rewind(const Mark& mark)
+{
+	m_nBlockNo = mark.nBlockNo;
+	m_nPos = mark.nPos;
+}
+void WorkArena::Reset()
+{
+	m_nBlockNo = 0;
+	m_nPos = 0;
+}
+void WorkArena::Release()
+{
+	for (unsigned int i=0; i<m_blockList.size(); ++i)
+	{
+		free(m_blockList[i].pData);
+	}
+	m_blockList.clear();
+	Reset();
+}
+size_t WorkArena::GetCapacity() const
+{
+	size_t nCapacity = 0;
+	for (unsigned int i=0; i<m_blockList.size(); ++i)
+	{
+		nCapacity += m_blockList[i].nSize;
+	}
+	return nCapacity;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// after each diff of a batch or serve worker : all buffers are given back, and the blocks are
+// kept for the next diff unless an unusually large image made them over kMaxArenaKeepSize
+void ReuseArena(WorkArena& arena)
+{
+	arena.Reset();
+	if (arena.GetCapacity()>kMaxArenaKeepSize)
+	{
+		arena.Release();
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+PartCache::PartCache(const std::string& strDir, const unsigned int& nMaxMB)
+	: m_strDir(strDir)
+	, m_nMaxBytes((unsigned long long)nMaxMB*1024*1024)
+{
+	if (m_strDir.empty()==false && m_strDir[m_strDir.size()-1]!='/')
+	{
+		m_strDir += "/";
+	}
+}
+// SHA-256 of the pixels and of the parameters which change the parts. Other images never share a key,
+// since the entry is used without comparing the pixels.
+std::string PartCache::GetKey(const cv::Mat& clrImg, const DiffOptions& options)
+{
+	int64_t nParamList[] = { kPartCacheVersion, clrImg.cols, clrImg.rows, clrImg.type(), GetBandHeight(clrImg.cols, clrImg.rows, options.nMaxMemoryMB), options.segmenterType };
+	SHA256Digest digest;
+	digest.Update((const unsigned char*)nParamList, sizeof(nParamList));
+	for (int y=0; y<clrImg.rows; ++y)
+	{
+		digest.Update(clrImg.ptr<unsigned char>(y), clrImg.cols*clrImg.elemSize());
+	}
+	return digest.GetHex();
+}
+std::string PartCache::GetFile(const std::string& strKey) const
+{
+	return m_strDir + strKey + ".gzc";
+}
+// return false : no entry, or broken file (other key or image size, part out of the image, ...)
+bool PartCache::Load(const std::string& strKey, const cv::Size& imgSize, std::vector<cv::Rect>& partRectList, std::vector<cv::Mat>& descriptorList) const
+{
+	partRectList.clear();
+	descriptorList.clear();
+
+	std::string strFile = GetFile(strKey);
+	int fd = open(strFile.c_str(), O_RDONLY);
+	if (fd<0)
+	{
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st)!=0 || st.st_size<(off_t)sizeof(PartCacheHeader))
+	{
+		close(fd);
+		return false;
+	}
+	size_t nFileSize = (size_t)st.st_size;
+	void* pMap = mmap(NULL, nFileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pMap==MAP_FAILED)
+	{
+		return false;
+	}
+
+	const unsigned char* pData = (const unsigned char*)pMap;
+	const PartCacheHeader* pHeader = (const PartCacheHeader*)pData;
+	char szKey[sizeof(pHeader->szKey)] = {};
+	strncpy(szKey, strKey.c_str(), sizeof(szKey));
+	bool bRet = pHeader->nMagic==kPartCacheMagic && pHeader->nVersion==kPartCacheVersion
+	         && strKey.size()<=sizeof(szKey) && memcmp(pHeader->szKey, szKey, sizeof(szKey))==0
+	         && pHeader->nImgW==imgSize.width && pHeader->nImgH==imgSize.height
+	         && sizeof(PartCacheHeader) + (size_t)pHeader->nPartNum*sizeof(PartCacheRecord) <= nFileSize;
+	const cv::Rect imgRect(0, 0, imgSize.width, imgSize.height);
+	const PartCacheRecord* pRecord = (const PartCacheRecord*)(pData + sizeof(PartCacheHeader));
+	for (uint32_t i=0; bRet && i<pHeader->nPartNum; ++i)
+	{
+		const PartCacheRecord& record = pRecord[i];
+		size_t nDataSize = (size_t)std::max(0, record.nRows) * std::max(0, record.nCols);
+		cv::Rect rect(record.nX, record.nY, record.nW, record.nH);
+		if (record.nW<=0 || record.nH<=0 || (rect & imgRect)!=rect || record.nRows<0 || record.nCols<0
+		 || (record.nRows>0 && record.nType!=CV_8UC1) || record.nOffset + nDataSize > nFileSize)
+		{
+			bRet = false;
+			break;
+		}
+		partRectList.push_back(rect);
+		descriptorList.push_back(record.nRows>0 ? cv::Mat(record.nRows, record.nCols, CV_8UC1, (void*)(pData + record.nOffset)).clone() : cv::Mat());
+	}
+	munmap(pMap, nFileSize);
+
+	if (bRet==false)
+	{
+		partRectList.clear();
+		descriptorList.clear();
+		return false;
+	}
+	utime(strFile.c_str(), NULL); // recently used
+	return true;
+}
+bool PartCache::Store(const std::string& strKey, const cv::Size& imgSize, const std::vector<cv::Rect>& partRectList, const std::vector<cv::Mat>& descriptorList) const
+{
+	PartCacheHeader header = { kPartCacheMagic, kPartCacheVersion, (uint32_t)partRectList.size(), 0, imgSize.width, imgSize.height, {} };
+	if (strKey.size()>sizeof(header.szKey))
+	{
+		return false;
+	}
+	strncpy(header.szKey, strKey.c_str(), sizeof(header.szKey));
+	std::vector<PartCacheRecord> recordList(partRectList.size());
+	size_t nOffset = sizeof(PartCacheHeader) + recordList.size()*sizeof(PartCacheRecord);
+	for (unsigned int i=0; i<partRectList.size(); ++i)
+	{
+		const cv::Rect& rect = partRectList.at(i);
+		const cv::Mat& descriptors = descriptorList.at(i);
+		if (descriptors.data && descriptors.type()!=CV_8UC1)
+		{
+			return false; // native descriptors only
+		}
+		PartCacheRecord record = { rect.x, rect.y, rect.width, rect.height, 0, 0, CV_8UC1, 0 };
+		if (descriptors.data)
+		{
+			nOffset = (nOffset + 7) & ~(size_t)7;
+			record.nRows = descriptors.rows;
+			record.nCols = descriptors.cols;
+			record.nOffset = (uint32_t)nOffset;
+			nOffset += (size_t)record.nRows*record.nCols;
+		}
+		recordList.at(i) = record;
+	}
+
+	CreateDirectory(m_strDir);
+	std::ostringstream strTmpFile;
+	strTmpFile << GetFile(strKey) << ".tmp" << getpid() << "_" << std::this_thread::get_id();
+	{
+		std::ofstream ofs(strTmpFile.str().c_str(), std::ios::binary);
+		ofs.write((const char*)&header, sizeof(header));
+		if (recordList.empty()==false)
+		{
+			ofs.write((const char*)&recordList[0], recordList.size()*sizeof(PartCacheRecord));
+		}
+		for (unsigned int i=0; i<recordList.size(); ++i)
+		{
+			const cv::Mat& descriptors = descriptorList.at(i);
+			if (recordList.at(i).nRows==0) continue;
+			ofs.seekp(recordList.at(i).nOffset);
+			for (int y=0; y<recordList.at(i).nRows; ++y)
+			{
+				ofs.write((const char*)descriptors.ptr<unsigned char>(y), descriptors.cols);
+			}
+		}
+		if (ofs.good()==false)
+		{
+			ofs.close();
+			unlink(strTmpFile.str().c_str());
+			return false;
+		}
+	}
+	// atomic replace, readers see the old or the new file
+	if (rename(strTmpFile.str().c_str(), GetFile(strKey).c_str())!=0)
+	{
+		unlink(strTmpFile.str().c_str());
+		return false;
+	}
+
+	Evict(GetFile(strKey));
+	return true;
+}
+// remove the least recently used files until the total size is within the limit (one process at a time)
+void PartCache::Evict(const std::string& strKeepFile) const
+{
+	if (m_nMaxBytes==0)
+	{
+		return;
+	}
+	int fdLock = open((m_strDir + ".lock").c_str(), O_RDWR | O_CREAT, 0644);
+	if (fdLock<0)
+	{
+		return;
+	}
+	flock(fdLock, LOCK_EX);
+
+	struct CacheFile
+	{
+		long long nTimeNs;
+		unsigned long long nSize;
+		std::string strFile;
+		bool operator<(const CacheFile& other) const { return nTimeNs!=other.nTimeNs ? nTimeNs<other.nTimeNs : strFile<other.strFile; }
+	};
+	std::vector<CacheFile> fileList;
+	unsigned long long nTotalSize = 0;
+	DIR* pDir = opendir(m_strDir.c_str());
+	if (pDir!=NULL)
+	{
+		for (struct dirent* pEntry=readdir(pDir); pEntry!=NULL; pEntry=readdir(pDir))
+		{
+			std::string strName = pEntry->d_name;
+			struct stat st;
+			if (strName.size()<=4 || strName.compare(strName.size()-4, 4, ".gzc")!=0 || stat((m_strDir + strName).c_str(), &st)!=0)
+			{
+				continue;
+			}
+			CacheFile file = { (long long)st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec, (unsigned long long)st.st_size, m_strDir + strName };
+			fileList.push_back(file);
+			nTotalSize += file.nSize;
+		}
+		closedir(pDir);
+	}
+	std::sort(fileList.begin(), fileList.end());
+	for (unsigned int i=0; i<fileList.size() && nTotalSize>m_nMaxBytes; ++i)
+	{
+		if (fileList.at(i).strFile==strKeepFile) continue;
+		if (unlink(fileList.at(i).strFile.c_str())==0)
+		{
+			nTotalSize -= fileList.at(i).nSize;
+		}
+	}
+
+	flock(fdLock, LOCK_UN);
+	close(fdLock);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+BaselineIndex::BaselineIndex()
+	: m_pMap(NULL)
+	, m_nMapSize(0)
+	, m_segmenterType(kSegmenterWatershed)
+	, m_nBandH(0)
+{
+}
+BaselineIndex::~BaselineIndex()
+{
+	Close();
+}
+void BaselineIndex::Close()
+{
+	m_clrImg = cv::Mat();
+	m_gryPyramidList.clear();
+	m_stripHashList.clear();
+	m_partRectList.clear();
+	m_descriptorList.clear();
+	if (m_pMap!=NULL)
+	{
+		munmap(m_pMap, m_nMapSize);
+		m_pMap = NULL;
+		m_nMapSize = 0;
+	}
+}
+// segment img and compute the descriptors of all parts, and write them with the planes used by the diff
+bool BaselineIndex::Create(const cv::Mat& img, const DiffOptions& options, const std::string& strFile)
+{
+	ImageContext imgContext(img);
+	if (imgContext.GetColor().data==NULL)
+	{
+		return false;
+	}
+	std::vector<Part> partList;
+	ImgSeg01(imgContext, options, partList);
+	std::vector<cv::Mat> descriptorList;
+	unsigned int nThreadNum = (options.nThreadNum==0) ? std::max(1u, std::thread::hardware_concurrency()) : options.nThreadNum;
+	ComputeKeypointAndDescriptor(partList, descriptorList, nThreadNum, kDescriptorBinary, options.pProfiler);
+
+	std::vector<cv::Mat> imgList;
+	imgList.push_back(imgContext.GetColor());
+	for (int n=0; n<=std::max(kIndexPyramidLevel, options.nPyramidLevel); ++n)
+	{
+		imgList.push_back(imgContext.GetGrayPyramid(n));
+	}
+	const std::vector<uint64_t>& stripHashList = imgContext.GetStripHash();
+
+	// layout
+	int nBandH = GetBandHeight(img.cols, img.rows, options.nMaxMemoryMB);
+	BaselineIndexHeader header = { kBaselineIndexMagic, kBaselineIndexVersion, (uint32_t)kStripHeight, (uint32_t)imgList.size(), (uint32_t)stripHashList.size(), (uint32_t)partList.size(), (uint32_t)options.segmenterType, (uint32_t)nBandH };
+	std::vector<BaselineIndexImage> imageTable(imgList.size());
+	std::vector<BaselineIndexPart> partTable(partList.size());
+	uint64_t nOffset = sizeof(header) + imageTable.size()*sizeof(BaselineIndexImage) + stripHashList.size()*sizeof(uint64_t) + partTable.size()*sizeof(BaselineIndexPart);
+	for (unsigned int i=0; i<imgList.size(); ++i)
+	{
+		nOffset = (nOffset + 63) & ~(uint64_t)63;
+		BaselineIndexImage image = { imgList.at(i).rows, imgList.at(i).cols, imgList.at(i).type(), 0, nOffset };
+		imageTable.at(i) = image;
+		nOffset += (uint64_t)imgList.at(i).rows * imgList.at(i).cols * imgList.at(i).elemSize();
+	}
+	for (unsigned int i=0; i<partList.size(); ++i)
+	{
+		const cv::Rect& rect = partList.at(i).rect;
+		const cv::Mat& descriptors = descriptorList.at(i);
+		BaselineIndexPart part = { rect.x, rect.y, rect.width, rect.height, 0, 0, 0 };
+		if (descriptors.data)
+		{
+			nOffset = (nOffset + 7) & ~(uint64_t)7;
+			part.nRows = descriptors.rows;
+			part.nCols = descriptors.cols;
+			part.nOffset = nOffset;
+			nOffset += (uint64_t)descriptors.rows * descriptors.cols;
+		}
+		partTable.at(i) = part;
 	}
 
-	// new -> old
+	// write to a temporary file, and rename (processes which map the old file keep it)
+	std::ostringstream strTmpFile;
+	strTmpFile << strFile << ".tmp" << getpid();
 	{
-		std::clog << "   Compute 'feature match' of new to old part" << std::endl;
-		unsigned int j = 0;
-		std::vector<std::string> strList = strNewPartFileList;
-		for (std::vector<std::string>::iterator itr=strList.begin(); itr!=strList.end(); ++itr)
+		std::ofstream ofs(strTmpFile.str().c_str(), std::ios::binary);
+		ofs.write((const char*)&header, sizeof(header));
+		ofs.write((const char*)&imageTable[0], imageTable.size()*sizeof(BaselineIndexImage));
+		if (stripHashList.empty()==false)
 		{
-			std::clog << "    New No. " << ++j << " : " << std::flush;
-
-			if (strMatchedPartFilesMap.find(*itr)!=strMatchedPartFilesMap.end())
+			ofs.write((const char*)&stripHashList[0], stripHashList.size()*sizeof(uint64_t));
+		}
+		if (partTable.empty()==false)
+		{
+			ofs.write((const char*)&partTable[0], partTable.size()*sizeof(BaselineIndexPart));
+		}
+		for (unsigned int i=0; i<imgList.size(); ++i)
+		{
+			ofs.seekp(imageTable.at(i).nOffset);
+			for (int y=0; y<imgList.at(i).rows; ++y)
 			{
-				std::clog << "Match" << std::endl;
-				strMap[2].push_back(*itr);
+				ofs.write((const char*)imgList.at(i).ptr<unsigned char>(y), imgList.at(i).cols * imgList.at(i).elemSize());
 			}
-			else if(g_bCreateChangeImg == true)
+		}
+		for (unsigned int i=0; i<partTable.size(); ++i)
+		{
+			if (partTable.at(i).nRows==0) continue;
+			ofs.seekp(partTable.at(i).nOffset);
+			for (int y=0; y<partTable.at(i).nRows; ++y)
 			{
-				if (strNewPartDescriptorInfoMap.find(*itr)->second.data)
-				{
-					std::clog << "No Match" << std::endl;
-				}
-				else
-				{
-					std::clog << "key point size = 0." << std::endl;
-				}
-				strMap[3].push_back(*itr);
+				ofs.write((const char*)descriptorList.at(i).ptr<unsigned char>(y), partTable.at(i).nCols);
 			}
 		}
+		if (ofs.good()==false)
+		{
+			ofs.close();
+			unlink(strTmpFile.str().c_str());
+			return false;
+		}
+	}
+	if (rename(strTmpFile.str().c_str(), strFile.c_str())!=0)
+	{
+		unlink(strTmpFile.str().c_str());
+		return false;
 	}
+	return true;
 }
-////////////////////////////////////////////////////////////////////////////////////////////////////
-
-////////////////////////////////////////////////////////////////////////////////////////////////////
-void ComputeKeypointAndDescriptor(const std::vector<std::string>& strPartFileList, std::map<std::string, cv::Mat>& strMap)
+// map an index file read-only. The planes and the descriptors point into the mapping (no copy).
+// return false : no file, or not an index of this version
+bool BaselineIndex::Open(const std::string& strFile)
 {
-	std::vector<std::string> strCopiedPartFileList = strPartFileList;
+	Close();
 
-	cv::Ptr<cv::AKAZE> akaze = cv::AKAZE::create();
+	int fd = open(strFile.c_str(), O_RDONLY);
+	if (fd<0)
+	{
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st)!=0 || st.st_size<(off_t)sizeof(BaselineIndexHeader))
+	{
+		close(fd);
+		return false;
+	}
+	size_t nFileSize = (size_t)st.st_size;
+	void* pMap = mmap(NULL, nFileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pMap==MAP_FAILED)
+	{
+		return false;
+	}
+	m_pMap = pMap;
+	m_nMapSize = nFileSize;
+
+	unsigned char* pData = (unsigned char*)pMap;
+	const BaselineIndexHeader* pHeader = (const BaselineIndexHeader*)pData;
+	uint64_t nTableSize = sizeof(BaselineIndexHeader) + (uint64_t)pHeader->nImageNum*sizeof(BaselineIndexImage)
+	                    + (uint64_t)pHeader->nStripNum*sizeof(uint64_t) + (uint64_t)pHeader->nPartNum*sizeof(BaselineIndexPart);
+	if (pHeader->nMagic!=kBaselineIndexMagic || pHeader->nVersion!=kBaselineIndexVersion || pHeader->nStripH!=(uint32_t)kStripHeight
+	 || pHeader->nImageNum<2 || nTableSize>nFileSize)
+	{
+		Close();
+		return false;
+	}
 
-	unsigned int i = 0;
-	for (std::vector<std::string>::iterator itr=strCopiedPartFileList.begin(); itr!=strCopiedPartFileList.end(); ++itr)
+	// color, gray and gray pyramid
+	const BaselineIndexImage* pImage = (const BaselineIndexImage*)(pData + sizeof(BaselineIndexHeader));
+	for (uint32_t i=0; i<pHeader->nImageNum; ++i)
+	{
+		int nType = (i==0) ? CV_8UC3 : CV_8UC1;
+		uint64_t nSize = (uint64_t)std::max(0, pImage[i].nRows) * std::max(0, pImage[i].nCols) * ((i==0) ? 3 : 1);
+		if (pImage[i].nType!=nType || pImage[i].nRows<=0 || pImage[i].nCols<=0 || pImage[i].nOffset + nSize > nFileSize)
+		{
+			Close();
+			return false;
+		}
+		cv::Mat img(pImage[i].nRows, pImage[i].nCols, nType, pData + pImage[i].nOffset);
+		if (i==0)
+		{
+			m_clrImg = img;
+		}
+		else
+		{
+			m_gryPyramidList.push_back(img);
+		}
+	}
+	if (m_gryPyramidList.at(0).size()!=m_clrImg.size())
 	{
-		std::clog << "    File No. " << ++i << " : " << std::flush;
+		Close();
+		return false;
+	}
+
+	m_segmenterType = (pHeader->nSegmenterType==kSegmenterBlocks) ? kSegmenterBlocks : kSegmenterWatershed;
+	m_nBandH = (int)pHeader->nBandH;
 
-		//std::string strBasePartFile = *itr;
-		cv::Mat gryImg = cv::imread(*itr, cv::IMREAD_GRAYSCALE);
-		if (gryImg.data==NULL) { continue; }
+	// strip hashes
+	const uint64_t* pStripHash = (const uint64_t*)(pImage + pHeader->nImageNum);
+	m_stripHashList.assign(pStripHash, pStripHash + pHeader->nStripNum);
 
-		std::vector<cv::KeyPoint> kpList;
-		akaze->detect(gryImg, kpList);
-		if (kpList.size()==0)
+	// parts
+	const cv::Rect frameRect(0, 0, m_clrImg.cols, m_clrImg.rows);
+	const BaselineIndexPart* pPart = (const BaselineIndexPart*)(pStripHash + pHeader->nStripNum);
+	for (uint32_t i=0; i<pHeader->nPartNum; ++i)
+	{
+		const BaselineIndexPart& part = pPart[i];
+		cv::Rect rect(part.nX, part.nY, part.nW, part.nH);
+		uint64_t nSize = (uint64_t)std::max(0, part.nRows) * std::max(0, part.nCols);
+		if (rect.width<=0 || rect.height<=0 || (rect & frameRect)!=rect || part.nRows<0 || part.nCols<0 || part.nOffset + nSize > nFileSize)
 		{
-			std::clog << "key point size = 0." << std::endl;
-			strMap[*itr] = cv::Mat();
-			continue;
+			Close();
+			return false;
 		}
-		cv::Mat descriptors;
-		akaze->compute(gryImg, kpList, descriptors);
-		descriptors.convertTo(descriptors, CV_32F);
-		strMap[*itr] = descriptors;
-		std::clog << "OK" << std::endl;
+		m_partRectList.push_back(rect);
+		m_descriptorList.push_back(part.nRows>0 ? cv::Mat(part.nRows, part.nCols, CV_8UC1, pData + part.nOffset) : cv::Mat());
+	}
+	return true;
+}
+// the parts are the same as ImgSeg01 of the image with options (segmenter and band height of --max-memory)
+bool BaselineIndex::IsSegmentedBy(const DiffOptions& options) const
+{
+	return m_segmenterType==options.segmenterType && m_nBandH==GetBandHeight(m_clrImg.cols, m_clrImg.rows, options.nMaxMemoryMB);
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// 64 bit hash, 8 bytes per step (multiply-rotate mixing in the style of xxHash64)
+uint64_t ComputeHash(const unsigned char* pData, const size_t& nSize, const uint64_t& nSeed)
+{
+	const uint64_t nPrime1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t nPrime2 = 0xC2B2AE3D27D4EB4FULL;
+	uint64_t nHash = nSeed + nPrime1 + (uint64_t)nSize;
+	size_t i = 0;
+	for (; i+8<=nSize; i+=8)
+	{
+		uint64_t nWord;
+		memcpy(&nWord, pData+i, 8);
+		nHash ^= ((nWord * nPrime2) << 31 | (nWord * nPrime2) >> 33) * nPrime1;
+		nHash = (nHash << 27 | nHash >> 37) * nPrime1 + nPrime2;
 	}
+	for (; i<nSize; ++i)
+	{
+		nHash ^= pData[i] * nPrime1;
+		nHash = (nHash << 11 | nHash >> 53) * nPrime2;
+	}
+	nHash ^= nHash >> 33;
+	nHash *= nPrime2;
+	nHash ^= nHash >> 29;
+	return nHash;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void ExecuteTemplateMatch(const std::string& strImgFile, const std::vector<std::string>& strPartFileList, cv::Mat& clrImg, std::vector<SegmentedRegionInfo>& segRegionInfoList)
+// FIPS 180-4
+SHA256Digest::SHA256Digest()
+	: m_nBlockSize(0)
+	, m_nTotalSize(0)
 {
-	// current image
-	cv::Mat curClrImg, curGryImg;
-	curClrImg = cv::imread(strImgFile, cv::IMREAD_COLOR);
-	cv::cvtColor(curClrImg, curGryImg, cv::COLOR_BGR2GRAY);
-	for (unsigned int i=0; i<strPartFileList.size(); ++i)
+	const uint32_t nInitList[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(m_nState, nInitList, sizeof(m_nState));
+}
+void SHA256Digest::Update(const unsigned char* pData, const size_t& nSize)
+{
+	m_nTotalSize += nSize;
+	size_t i = 0;
+	if (m_nBlockSize>0)
 	{
-		// part image
-		std::string strPartFile = strPartFileList.at(i);
-		cv::Mat partClrImg = cv::imread(strPartFile, cv::IMREAD_COLOR);
-		if (partClrImg.data==NULL)
+		size_t nCopy = std::min(nSize, sizeof(m_block)-m_nBlockSize);
+		memcpy(m_block+m_nBlockSize, pData, nCopy);
+		m_nBlockSize += nCopy;
+		i = nCopy;
+		if (m_nBlockSize<sizeof(m_block))
 		{
-			continue;
+			return;
 		}
-		cv::Mat partGryImg;
-		cv::cvtColor(partClrImg, partGryImg, cv::COLOR_BGR2GRAY);
-
-		// global minimum
-		double dMinVal;
-		cv::Point ptMin;
-		cv::Mat retImg;
-		cv::matchTemplate(curGryImg, partGryImg, retImg, cv::TM_SQDIFF);
-		cv::minMaxLoc(retImg, &dMinVal, NULL, &ptMin, NULL);
-
-		int nPartH = partClrImg.rows;
-		int nPartW = partClrImg.cols;
-
-		SegmentedRegionInfo info;
-		info.ptOrigin = ptMin;
-		info.nW = nPartW;
-		info.nH = nPartH;
-		info.clrFrame = CV_RGB(0,255,0);
-		segRegionInfoList.push_back(info);
+		Transform(m_block);
+		m_nBlockSize = 0;
+	}
+	for (; i+64<=nSize; i+=64)
+	{
+		Transform(pData+i);
 	}
+	memcpy(m_block, pData+i, nSize-i);
+	m_nBlockSize = nSize-i;
+}
+std::string SHA256Digest::GetHex()
+{
+	uint64_t nBitSize = m_nTotalSize*8;
+	unsigned char padding[72] = { 0x80 };
+	size_t nPadSize = (m_nBlockSize<56) ? 56-m_nBlockSize : 120-m_nBlockSize;
+	for (int i=0; i<8; ++i)
+	{
+		padding[nPadSize+i] = (unsigned char)(nBitSize >> (56-i*8));
+	}
+	Update(padding, nPadSize+8);
 
-	clrImg = curClrImg;
+	std::ostringstream strHex;
+	for (int i=0; i<8; ++i)
+	{
+		strHex << std::hex << std::setw(8) << std::setfill('0') << m_nState[i];
+	}
+	return strHex.str();
+}
+void SHA256Digest::Transform(const unsigned char* pBlock)
+{
+	static const uint32_t nRoundList[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+	#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+	uint32_t w[64];
+	for (int i=0; i<16; ++i)
+	{
+		w[i] = (uint32_t)pBlock[i*4] << 24 | (uint32_t)pBlock[i*4+1] << 16 | (uint32_t)pBlock[i*4+2] << 8 | (uint32_t)pBlock[i*4+3];
+	}
+	for (int i=16; i<64; ++i)
+	{
+		uint32_t s0 = SHA256_ROTR(w[i-15], 7) ^ SHA256_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = SHA256_ROTR(w[i-2], 17) ^ SHA256_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	uint32_t a = m_nState[0], b = m_nState[1], c = m_nState[2], d = m_nState[3];
+	uint32_t e = m_nState[4], f = m_nState[5], g = m_nState[6], h = m_nState[7];
+	for (int i=0; i<64; ++i)
+	{
+		uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + nRoundList[i] + w[i];
+		uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	#undef SHA256_ROTR
+	m_nState[0] += a; m_nState[1] += b; m_nState[2] += c; m_nState[3] += d;
+	m_nState[4] += e; m_nState[5] += f; m_nState[6] += g; m_nState[7] += h;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void ExecuteTemplateMatchEx(const std::string& strImgFile, const std::vector<std::string>& strPartFileList, cv::Mat& clrImg, std::vector<SegmentedRegionInfo>& segRegionInfoList)
+// one hash per nStripH rows
+void ComputeStripHash(const cv::Mat& img, const int& nStripH, std::vector<uint64_t>& hashList)
 {
-	// current image
-	cv::Mat curClrImg, curGryImg;
-	curClrImg = cv::imread(strImgFile, cv::IMREAD_COLOR);
-	cv::cvtColor(curClrImg, curGryImg, cv::COLOR_BGR2GRAY);
-	for (unsigned int i=0; i<strPartFileList.size(); ++i)
+	size_t nRowSize = img.cols * img.elemSize();
+	hashList.clear();
+	for (int y=0; y<img.rows; y+=nStripH)
 	{
-		// part image
-		std::string strPartFile = strPartFileList.at(i);
-		cv::Mat partClrImg = cv::imread(strPartFile, cv::IMREAD_COLOR);
-		if (partClrImg.data==NULL)
+		uint64_t nHash = 0;
+		int nYe = std::min(img.rows, y+nStripH);
+		for (int yy=y; yy<nYe; ++yy)
 		{
-			continue;
+			nHash = ComputeHash(img.ptr<unsigned char>(yy), nRowSize, nHash);
 		}
-		cv::Mat partGryImg;
-		cv::cvtColor(partClrImg, partGryImg, cv::COLOR_BGR2GRAY);
+		hashList.push_back(nHash);
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-		// global minimum
-		double dMinVal;
-		cv::Point ptMin;
-		cv::Mat retImg;
-		cv::matchTemplate(curGryImg, partGryImg, retImg, cv::TM_SQDIFF);
-		cv::minMaxLoc(retImg, &dMinVal, NULL, &ptMin, NULL);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Rows of newImg which differ from oldImg, by nStripH rows (adjacent strips are merged).
+// Empty : same images. Images of different size : all rows.
+void GetChangedBand(const cv::Mat& oldImg, const cv::Mat& newImg, const int& nStripH, std::vector<cv::Range>& changedBandList)
+{
+	changedBandList.clear();
+	if (oldImg.size()!=newImg.size() || oldImg.type()!=newImg.type())
+	{
+		changedBandList.push_back(cv::Range(0, newImg.rows));
+		return;
+	}
 
-		int nPartH = partClrImg.rows;
-		int nPartW = partClrImg.cols;
-		int nXs = ptMin.x;
-		int nYs = ptMin.y;
-		int nXe = nXs + nPartW;
-		int nYe = nYs + nPartH;
-		std::vector<cv::Point> ptPixList;
-		for (int y=nYs; y<nYe; ++y)
+	std::vector<uint64_t> oldHashList, newHashList;
+	ComputeStripHash(oldImg, nStripH, oldHashList);
+	ComputeStripHash(newImg, nStripH, newHashList);
+	GetChangedBand(oldHashList, newHashList, oldImg, newImg, nStripH, changedBandList);
+}
+// same as above from the strip hashes of 2 images of the same size and type.
+// A different hash is a changed strip, and a same hash is confirmed by comparing the rows,
+// so a hash collision can't hide a change.
+void GetChangedBand(const std::vector<uint64_t>& oldHashList, const std::vector<uint64_t>& newHashList, const cv::Mat& oldImg, const cv::Mat& newImg, const int& nStripH, std::vector<cv::Range>& changedBandList)
+{
+	const int nRows = newImg.rows;
+	changedBandList.clear();
+	if (oldHashList.size()!=newHashList.size())
+	{
+		changedBandList.push_back(cv::Range(0, nRows));
+		return;
+	}
+
+	for (unsigned int i=0; i<newHashList.size(); ++i)
+	{
+		int nYs = i*nStripH;
+		int nYe = std::min(nRows, nYs+nStripH);
+		if (oldHashList.at(i)==newHashList.at(i) && IsSameRows(oldImg, newImg, nYs, nYe)) continue;
+
+		if (changedBandList.empty()==false && changedBandList.back().end==nYs)
 		{
-			for (int x=nXs; x<nXe; ++x)
-			{
-				unsigned char clrCur[3] = {	curClrImg.at<cv::Vec3b>(y, x)[0],
-											curClrImg.at<cv::Vec3b>(y, x)[1],
-											curClrImg.at<cv::Vec3b>(y, x)[2]};
-				unsigned char clrPart[3] = {partClrImg.at<cv::Vec3b>(y-nYs, x-nXs)[0],
-											partClrImg.at<cv::Vec3b>(y-nYs, x-nXs)[1],
-											partClrImg.at<cv::Vec3b>(y-nYs, x-nXs)[2]};
-				if (clrPart[0]!=clrCur[0] || clrPart[1]!=clrCur[1] || clrPart[2]!=clrCur[2])
-				{
-					ptPixList.push_back(cv::Point(x-nXs, y-nYs));
-				}
-			}
+			changedBandList.back().end = nYe;
 		}
+		else
+		{
+			changedBandList.push_back(cv::Range(nYs, nYe));
+		}
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-		SegmentedRegionInfo info;
-		info.ptOrigin = ptMin;
-		info.nW = nPartW;
-		info.nH = nPartH;
-		info.clrFrame = CV_RGB(255,0,0);
-		info.ptPixList = ptPixList;
-		segRegionInfoList.push_back(info);
-	}//for(i)
-
-	clrImg = curClrImg;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// rows nYs - nYe-1 of 2 images of the same size and type have the same bytes
+bool IsSameRows(const cv::Mat& oldImg, const cv::Mat& newImg, const int& nYs, const int& nYe)
+{
+	size_t nRowSize = newImg.cols * newImg.elemSize();
+	for (int y=nYs; y<nYe; ++y)
+	{
+		if (memcmp(oldImg.ptr<unsigned char>(y), newImg.ptr<unsigned char>(y), nRowSize)!=0)
+		{
+			return false;
+		}
+	}
+	return true;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -832,6 +4397,71 @@ std::vector<std::string> Split(const std::string& s, char delim)
 
 	return elems;
 }
+std::string EscapeJSON(const std::string& str)
+{
+	std::string strEscaped;
+	for (unsigned int i=0; i<str.size(); ++i)
+	{
+		char ch = str[i];
+		switch (ch)
+		{
+		case '"':  strEscaped += "\\\""; break;
+		case '\\': strEscaped += "\\\\"; break;
+		case '\n': strEscaped += "\\n"; break;
+		case '\r': strEscaped += "\\r"; break;
+		case '\t': strEscaped += "\\t"; break;
+		default:
+			if ((unsigned char)ch<0x20)
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)ch);
+				strEscaped += buf;
+			}
+			else
+			{
+				strEscaped += ch;
+			}
+			break;
+		}
+	}
+	return strEscaped;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compare 2 BGR images of the same size pixel by pixel.
+// diffMask : CV_8UC1, 255 where any channel differs. return the number of changed pixels.
+int ComputeDiffMask(const cv::Mat& clrImg1, const cv::Mat& clrImg2, cv::Mat& diffMask)
+{
+	int nH = clrImg1.rows;
+	int nW = clrImg1.cols;
+	diffMask.create(nH, nW, CV_8UC1);
+	int nDiffPixelNum = 0;
+	for (int y=0; y<nH; ++y)
+	{
+		// row pointers (ROI safe), and no branch in the loop so that the compiler can vectorize it
+		const unsigned char* pClr1 = clrImg1.ptr<unsigned char>(y);
+		const unsigned char* pClr2 = clrImg2.ptr<unsigned char>(y);
+		unsigned char* pMask = diffMask.ptr<unsigned char>(y);
+		for (int x=0; x<nW; ++x)
+		{
+			unsigned char nDiff = (pClr1[3*x]^pClr2[3*x]) | (pClr1[3*x+1]^pClr2[3*x+1]) | (pClr1[3*x+2]^pClr2[3*x+2]);
+			unsigned char nIsDiff = (nDiff!=0);
+			pMask[x] = (unsigned char)(0 - nIsDiff);
+			nDiffPixelNum += nIsDiff;
+		}
+	}
+	return nDiffPixelNum;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Paint the changed pixels of diffMask on img (BGR) at ptOrigin.
+void DrawDiffMask(cv::Mat& img, const cv::Point& ptOrigin, const cv::Mat& diffMask, const cv::Scalar& clr)
+{
+	cv::Mat roiImg = img(cv::Rect(ptOrigin.x, ptOrigin.y, diffMask.cols, diffMask.rows));
+	roiImg.setTo(clr, diffMask);
+}
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -841,13 +4471,14 @@ void ConvertColorToGray(cv::Mat& img)
 	int nW = img.cols;
 	for (int y=0; y<nH; ++y)
 	{
-		int idx = y*nW*3;
+		unsigned char* pImg = img.ptr<unsigned char>(y);
 		for (int x=0; x<nW; ++x)
 		{
-			img.at<cv::Vec3b>(y, x)[0] = (img.at<cv::Vec3b>(y, x)[0] + img.at<cv::Vec3b>(y, x)[1] + img.at<cv::Vec3b>(y, x)[2])/3;
-			img.at<cv::Vec3b>(y, x)[1] = img.at<cv::Vec3b>(y, x)[0];
-			img.at<cv::Vec3b>(y, x)[2] = img.at<cv::Vec3b>(y, x)[0];
-			idx += 3;
+			unsigned char nGray = (unsigned char)((pImg[0] + pImg[1] + pImg[2])/3);
+			pImg[0] = nGray;
+			pImg[1] = nGray;
+			pImg[2] = nGray;
+			pImg += 3;
 		}
 	}
 }
@@ -887,12 +4518,6 @@ std::string GetPNGFile(const int& nNum, const std::string& strOutputFolder)
 
 	int nFileNo = nNum;
 
-	bool bIsPartFile = (1<=nNum && nNum<5000) ? true : false;
-	if (bIsPartFile==true)
-	{
-		nFileNo = g_nPartFileNo;
-	}
-
 	std::ostringstream strFileNo;
 	strFileNo<<nFileNo;
 
@@ -904,20 +4529,14 @@ std::string GetPNGFile(const int& nNum, const std::string& strOutputFolder)
 
     switch (nNum)
     {
-    case 8000:  strPNGFile = g_strFileName + "_delete.png"; break;
-    case 9000:  strPNGFile = g_strFileName + "_add.png";    break;
-    case 10000: strPNGFile = g_strFileName + "_diff.png";   break;
+    case 8000:  strPNGFile = "_delete.png"; break;
+    case 9000:  strPNGFile = "_add.png";    break;
+    case 10000: strPNGFile = "_diff.png";   break;
     default: break;
     }
 
 	std::string strPNGFileRelativePath = strOutputFolder + strPNGFile;
 
-	if (bIsPartFile==true)
-	{
-		g_strFileList.push_back(strPNGFileRelativePath);
-		++g_nPartFileNo;
-	}
-
 	return strPNGFileRelativePath;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -948,137 +4567,97 @@ void CreatePNGfromCVMAT(const int& nNum, const cv::Mat& img, const std::string&
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void CreatePNGfromUCHAR(const int& nNum, const int& nW, const int& nH, unsigned char* pImg, const std::string& strOutputFolder)
+// CreatePNGfromCVMAT with the encode time and the bytes written
+void CreatePNGfromCVMATEx(const int& nNum, const cv::Mat& img, const std::string& strOutputFolder, Profiler* pProfiler)
 {
-	std::string strBMPFile = "ImgSeg_Tmp.bmp";
-	std::string strBMPFileRelativePath = strOutputFolder + strBMPFile;
-	CreateBMP(strBMPFileRelativePath, nW, nH, pImg);
-
-	fpos_t fsize;
-	FILE* pF = fopen(strBMPFileRelativePath.c_str(), "rb");
-	if (pF)
+	long long nStartNs = StartProfile(pProfiler);
+	CreatePNGfromCVMAT(nNum, img, strOutputFolder);
+	if (pProfiler!=NULL)
 	{
-		fseek(pF, 0, SEEK_END);
-		fgetpos(pF, &fsize);
-		fclose(pF);
-#ifdef __linux
-		if (fsize.__pos<1024) /* for LINUX */
-#else
-		if (fsize<1024) /* for LINUX */
-#endif
-		{
-			remove(strBMPFileRelativePath.c_str());
-			return;
-		}
+		long long nFileSize = std::max(0LL, GetFileSize(GetPNGFile(nNum, strOutputFolder)));
+		pProfiler->AddTime("encode", nStartNs, nFileSize);
+		pProfiler->AddCount("bytes_written", nFileSize);
 	}
-
-	std::string strPNGFileRelativePath = GetPNGFile(nNum, strOutputFolder);
-	ConvertBMPtoPNG(strBMPFileRelativePath, strPNGFileRelativePath);
-
-	remove(strBMPFileRelativePath.c_str());
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void ConvertBMPtoPNG(const std::string& strBMPFile, const std::string& strPNGFile)
+// return -1 : no file
+long long GetFileSize(const std::string& strFile)
 {
-	cv::Mat bmpImg = cv::imread(strBMPFile, -1);
-	cv::Mat pngImg;
-	bmpImg.convertTo(pngImg, CV_8UC3);
-
-	cv::imwrite(strPNGFile, pngImg);
+	struct stat st;
+	if (stat(strFile.c_str(), &st)!=0)
+	{
+		return -1;
+	}
+	return (long long)st.st_size;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void CreateBMP(const std::string& strFile, const int& nW, const int& nH, unsigned char* pImg)
+bool ReadFileBuffer(const std::string& strFile, std::vector<unsigned char>& buf)
 {
-	FILE *pF = NULL;
-	//fopen_s(&pF, strFile.c_str(), "wb"); /* for visual studio */
-	pF = fopen(strFile.c_str(), "wb"); /* for LINUX */
-	if (pF==NULL) return;
-
-	const int kFileHeaderSize = 14;
-	const int kInfoHeaderSize = 40;
-	const int kHeaderSize = kFileHeaderSize + kInfoHeaderSize;
-	unsigned char HeaderBuffer[kHeaderSize];
+	std::ifstream ifs(strFile.c_str(), std::ios::binary);
+	if (ifs.is_open()==false)
+	{
+		return false;
+	}
+	buf.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+	return buf.empty()==false;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	int nRealW = nW*3 + nW%4;
-	unsigned int nFileSize = nH*nRealW + kHeaderSize;
-	unsigned int nOffsetToData = kHeaderSize;
-	unsigned long nInfoHeaderSize = kInfoHeaderSize;
-	unsigned int nPlanes = 1;
-	unsigned int nColor = 24;
-	unsigned long nCompress = 0;
-	unsigned long nDataSize = nH*nRealW;
-	long nXppm = 1;
-	long nYppm = 1;
-
-	HeaderBuffer[0] = 'B';
-	HeaderBuffer[1] = 'M';
-	memcpy(HeaderBuffer+2, &nFileSize, sizeof(nFileSize));
-	HeaderBuffer[6] = 0;
-	HeaderBuffer[7] = 0;
-	HeaderBuffer[8] = 0;
-	HeaderBuffer[9] = 0;
-	memcpy(HeaderBuffer+10, &nOffsetToData, sizeof(nOffsetToData));
-	HeaderBuffer[11] = 0;
-	HeaderBuffer[12] = 0;
-	HeaderBuffer[13] = 0;
-	memcpy(HeaderBuffer+14, &nInfoHeaderSize, sizeof(nInfoHeaderSize));
-	HeaderBuffer[15] = 0;
-	HeaderBuffer[16] = 0;
-	HeaderBuffer[17] = 0;
-	memcpy(HeaderBuffer+18, &nW, sizeof(nW));
-	memcpy(HeaderBuffer+22, &nH, sizeof(nH));
-	memcpy(HeaderBuffer+26, &nPlanes, sizeof(nPlanes));
-	memcpy(HeaderBuffer+28, &nColor, sizeof(nColor));
-	memcpy(HeaderBuffer+30, &nCompress, sizeof(nCompress));
-	memcpy(HeaderBuffer+34, &nDataSize, sizeof(nDataSize));
-	memcpy(HeaderBuffer+38, &nXppm, sizeof(nXppm));
-	memcpy(HeaderBuffer+42, &nYppm, sizeof(nYppm));
-	HeaderBuffer[46] = 0;
-	HeaderBuffer[47] = 0;
-	HeaderBuffer[48] = 0;
-	HeaderBuffer[49] = 0;
-	HeaderBuffer[50] = 0;
-	HeaderBuffer[51] = 0;
-	HeaderBuffer[52] = 0;
-	HeaderBuffer[53] = 0;
-
-	fwrite(HeaderBuffer, sizeof(unsigned char), kHeaderSize, pF);
-
-	unsigned char* pBMP = new unsigned char[nRealW];
-	for (int y=0; y<nH; ++y)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// relative to the current directory (empty path : as it is)
+std::string GetAbsolutePath(const std::string& strFile)
+{
+	if (strFile.empty() || strFile[0]=='/')
 	{
-		int idx = (nH-1-y)*nW*3;
-		for (int x=0; x<nW; ++x, idx+=3)
-		{
-			pBMP[x*3+0] = pImg[idx+0];
-			pBMP[x*3+1] = pImg[idx+1];
-			pBMP[x*3+2] = pImg[idx+2];
-		}
-		//for (int x=nW*3; x<nRealW; ++x)
-		//{
-		//	pBMP[x] = 0;
-		//}
-		fwrite(pBMP, sizeof(unsigned char), nRealW, pF);
+		return strFile;
+	}
+	char szCurDir[4096];
+	if (getcwd(szCurDir, sizeof(szCurDir))==NULL)
+	{
+		return strFile;
 	}
+	return std::string(szCurDir) + "/" + strFile;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	delete [] pBMP;
-	pBMP = NULL;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Parts whose 24bit BMP (header + padded rows) is smaller than 1KB are ignored as noise
+bool IsTooSmallPart(const int& nW, const int& nH)
+{
+	const int kHeaderSize = 54;
+	int nRealW = nW*3 + nW%4;
+	return (nH*nRealW + kHeaderSize < 1024) ? true : false;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	fclose(pF);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// rows of one band of the segmentation, so that its working memory fits in nMaxMemoryMB (0 : whole image)
+int GetBandHeight(const int& nW, const int& nH, const unsigned int& nMaxMemoryMB)
+{
+	if (nMaxMemoryMB==0 || nW<=0)
+	{
+		return std::max(1, nH);
+	}
+	long long nRowBytes = (long long)nW * kSegmentationBytesPerPixel;
+	long long nBandH = (long long)nMaxMemoryMB*1024*1024 / nRowBytes - 2*kBandOverlap;
+	// a band thinner than the overlap would segment more overlap rows than band rows
+	nBandH = std::max((long long)kBandOverlap, nBandH);
+	return (int)std::min((long long)std::max(1, nH), nBandH);
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 bool GetTimeYYYYMMDDHHMMSS(tm* pTM, std::string& strYYYYMMDD, std::string& strHHMMSS)
 {
+	tm tmNow;
 	if (pTM==NULL)
 	{
 		time_t now = time(NULL);
-		pTM = localtime(&now);
+		pTM = localtime_r(&now, &tmNow);
 	}
 
 	return GetTimeYYYYMMDD(pTM, strYYYYMMDD) && GetTimeHHMMSS(pTM, strHHMMSS);
@@ -1086,10 +4665,11 @@ bool GetTimeYYYYMMDDHHMMSS(tm* pTM, std::string& strYYYYMMDD, std::string& strHH
 }
 bool GetTimeYYYYMMDD(tm* pTM, std::string& strYYYYMMDD)
 {
+	tm tmNow;
 	if (pTM==NULL)
 	{
 		time_t now = time(NULL);
-		pTM = localtime(&now);
+		pTM = localtime_r(&now, &tmNow);
 	}
 
 	std::ostringstream str[3];
@@ -1108,10 +4688,11 @@ bool GetTimeYYYYMMDD(tm* pTM, std::string& strYYYYMMDD)
 }
 bool GetTimeHHMMSS(tm* pTM, std::string& strHHMMSS)
 {
+	tm tmNow;
 	if (pTM==NULL)
 	{
 		time_t now = time(NULL);
-		pTM = localtime(&now);
+		pTM = localtime_r(&now, &tmNow);
 	}
 
 	std::ostringstream str[3];
@@ -1265,3 +4846,138 @@ bool GetGroupedDataTest(const int& nSrcW, const int& nSrcH, unsigned char* pSrcI
 	return true;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+PartGrouper::PartGrouper(const int& nW, WorkArena* pArena/*=NULL*/)
+	: m_nW(nW)
+	, m_nY(0)
+	, m_nPrevLabelList(nW, -1, ArenaAllocator<int>(pArena))
+	, m_nCurLabelList(nW, -1, ArenaAllocator<int>(pArena))
+	, m_nPrevClrList(nW, 128, ArenaAllocator<unsigned char>(pArena))
+	, m_nParentList(ArenaAllocator<int>(pArena))
+	, m_nBoxList(ArenaAllocator<cv::Vec4i>(pArena))
+{
+}
+int PartGrouper::FindRoot(int nLabel)
+{
+	while (m_nParentList[nLabel]!=nLabel)
+	{
+		m_nParentList[nLabel] = m_nParentList[m_nParentList[nLabel]];
+		nLabel = m_nParentList[nLabel];
+	}
+	return nLabel;
+}
+// equivalent labels are merged into the smaller one, with their bounding box
+void PartGrouper::Merge(const int& nRoot, const int& nChildRoot)
+{
+	m_nParentList[nChildRoot] = nRoot;
+	cv::Vec4i& box = m_nBoxList[nRoot];
+	const cv::Vec4i& childBox = m_nBoxList[nChildRoot];
+	box[0] = std::min(box[0], childBox[0]);
+	box[1] = std::min(box[1], childBox[1]);
+	box[2] = std::max(box[2], childBox[2]);
+	box[3] = std::max(box[3], childBox[3]);
+}
+void PartGrouper::AddRow(const unsigned char* pRow)
+{
+	const int nW = m_nW;
+	const int y = m_nY;
+	for (int x=0; x<nW; ++x)
+	{
+		unsigned char clr = pRow[x*3];
+		m_nCurLabelList[x] = -1;
+		if (clr==128) continue;
+
+		// already visited neighbors : left, upper-left, upper, upper-right
+		int nNeighborLabel[4] = { -1, -1, -1, -1 };
+		if (x>0 && pRow[(x-1)*3]==clr) nNeighborLabel[0] = m_nCurLabelList[x-1];
+		if (x>0 && m_nPrevClrList[x-1]==clr) nNeighborLabel[1] = m_nPrevLabelList[x-1];
+		if (m_nPrevClrList[x]==clr) nNeighborLabel[2] = m_nPrevLabelList[x];
+		if (x+1<nW && m_nPrevClrList[x+1]==clr) nNeighborLabel[3] = m_nPrevLabelList[x+1];
+
+		int nLabel = -1;
+		for (int n=0; n<4; ++n)
+		{
+			if (nNeighborLabel[n]==-1) continue;
+
+			int nRoot = FindRoot(nNeighborLabel[n]);
+			if (nLabel==-1)
+			{
+				nLabel = nRoot;
+			}
+			else if (nRoot<nLabel)
+			{
+				Merge(nRoot, nLabel);
+				nLabel = nRoot;
+			}
+			else if (nRoot>nLabel)
+			{
+				Merge(nLabel, nRoot);
+			}
+		}
+		if (nLabel==-1)
+		{
+			nLabel = (int)m_nParentList.size();
+			m_nParentList.push_back(nLabel);
+			m_nBoxList.push_back(cv::Vec4i(x, y, x, y));
+		}
+		else
+		{
+			cv::Vec4i& box = m_nBoxList[nLabel];
+			if (x<box[0]) box[0]=x;
+			if (x>box[2]) box[2]=x;
+			if (y>box[3]) box[3]=y;
+		}
+		m_nCurLabelList[x] = nLabel;
+	}
+
+	m_nPrevLabelList.swap(m_nCurLabelList);
+	for (int x=0; x<nW; ++x)
+	{
+		m_nPrevClrList[x] = pRow[x*3];
+	}
+	++m_nY;
+}
+void PartGrouper::GetPartRectList(std::vector<cv::Rect>& partRectList) const
+{
+	// parent is always smaller than the label itself, so the roots are in the order of their first pixel
+	partRectList.clear();
+	for (unsigned int i=0; i<m_nParentList.size(); ++i)
+	{
+		if (m_nParentList[i]!=(int)i) continue;
+
+		const cv::Vec4i& box = m_nBoxList[i];
+		partRectList.push_back(cv::Rect(box[0], box[1], box[2]-box[0]+1, box[3]-box[1]+1));
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Label 8-connected regions of the watershed image (128 = boundary) in two raster passes with
+// union-find, and return the bounding box of each region.
+// Regions are returned in the order of their first pixel in raster order, which is the same part
+// set and order as GetGroupedDataTest (kept as the reference implementation).
+bool GetGroupedData(const int& nSrcW, const int& nSrcH, unsigned char* pSrcImg, std::vector<cv::Rect>& partRectList)
+{
+	{
+		std::string strHHMMSS;
+		GetTimeHHMMSS(NULL, strHHMMSS);
+		std::clog << " -> Grouping Start : " << strHHMMSS.c_str() << std::endl;
+	}
+	PartGrouper grouper(nSrcW);
+	for (int y=0; y<nSrcH; ++y)
+	{
+		grouper.AddRow(pSrcImg + y*nSrcW*3);
+	}
+	grouper.GetPartRectList(partRectList);
+	{
+		std::string strHHMMSS;
+		GetTimeHHMMSS(NULL, strHHMMSS);
+		std::clog << " -> Grouping End : " << strHHMMSS.c_str() << std::endl;
+	}
+
+	std::clog << "*** Part count after grouping : " << partRectList.size() << std::endl;
+
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////////////////////
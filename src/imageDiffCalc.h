@@ -0,0 +1,274 @@
+///////////////////////////////////////////////////////////////////////////
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+
+//   * Neither the names of the copyright holders nor the names of the contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall copyright holders or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef IMAGE_DIFF_CALC_H
+#define IMAGE_DIFF_CALC_H
+
+#include <opencv2/core/core.hpp>
+#include <string> // for std::string
+#include <vector> // for std::vector
+#include <map> // for std::map
+#include <mutex> // for std::mutex
+#include <thread> // for std::thread::id
+#include <stdint.h> // for uint64_t
+#include <iosfwd> // for std::ostream
+
+// descriptor type for part matching
+enum DescriptorType
+{
+	kDescriptorBinary, // native AKAZE (MLDB) descriptor, brute-force Hamming distance
+	kDescriptorFloat   // descriptor converted to CV_32F, FLANN (L2 distance)
+};
+// part segmentation
+enum SegmenterType
+{
+	kSegmenterWatershed, // gradient, contours and watershed by row bands
+	kSegmenterBlocks     // 8-connected blocks of the dilated content by the runs of each row (near linear time)
+};
+// max median distance of "full or almost match" for each descriptor type.
+// The binary one is kept at 1 bit, the Hamming distance of one changed comparison : the parts of the same
+// content have the same descriptors (0), and other parts are tens of bits apart, so any larger value only
+// accepts more near misses. --check-descriptor gives no different decision on tests/images with it.
+const float kMaxMatchDistanceBinary = 1.0f; // Hamming distance [bit]
+const float kMaxMatchDistanceFloat = 1.0f;  // L2 distance on byte values (0-255), one byte changed by 1
+
+// Monotonic timings [ns] and counters of diff runs, written as JSON (thread safe).
+class Profiler
+{
+public:
+	Profiler();
+
+	static long long GetTimeNs(); // steady clock
+	void StartStep(const std::string& strName);
+	void EndStep(const std::string& strName);
+	void AddTime(const std::string& strName, const long long& nStartNs, const long long& nValue = -1); // nStartNs -> now
+	void AddCount(const std::string& strName, const long long& nCount);
+	bool WriteJSON(const std::string& strFile) const;
+	void WriteStageJSON(std::ostream& os, const std::string& strIndent) const; // {"name": {"count", "total_ns", "max_ns"}, ...}
+
+private:
+	struct Record
+	{
+		std::string strName;
+		int nThreadNo;
+		long long nStartNs;
+		long long nTimeNs;
+		long long nValue; // e.g. key points of the part (-1 : none)
+	};
+	int GetThreadNo(); // call with m_mtx locked
+	void WriteStageList(std::ostream& os, const std::string& strIndent) const; // call with m_mtx locked
+
+	mutable std::mutex m_mtx;
+	long long m_nOriginNs;
+	std::vector<Record> m_recordList;
+	std::map<std::string, long long> m_nCountMap;
+	std::map<std::thread::id, int> m_nThreadNoMap;
+	std::map<std::pair<int, std::string>, long long> m_nStepStartNsMap;
+};
+
+// block size of WorkArena [byte], larger buffers get a block of their own
+const size_t kArenaBlockSize = 4*1024*1024;
+
+// Monotonic arena of the working buffers of the segmentation. Allocate() takes the next bytes of
+// a block, Rewind() and Reset() give back all buffers after a mark at once (no free per buffer),
+// and the blocks are kept, so a worker which diffs many pairs (batch, serve) reuses the same memory.
+// Not thread safe : one arena per thread.
+class WorkArena
+{
+public:
+	struct Mark
+	{
+		size_t nBlockNo;
+		size_t nPos;
+	};
+
+	explicit WorkArena(const size_t& nBlockSize = kArenaBlockSize);
+	~WorkArena();
+
+	void* Allocate(const size_t& nSize); // aligned to 64 bytes
+	cv::Mat CreateMat(const int& nRows, const int& nCols, const int& nType); // continuous, valid until rewound
+	Mark GetMark() const;
+	void Rewind(const Mark& mark); // buffers allocated after the mark are given back
+	void Reset();                  // all buffers are given back
+	void Release();                // the blocks are freed
+	size_t GetCapacity() const;    // bytes of the kept blocks
+
+private:
+	WorkArena(const WorkArena&) = delete;
+	WorkArena& operator=(const WorkArena&) = delete;
+
+	struct Block
+	{
+		unsigned char* pData;
+		size_t nSize;
+	};
+	size_t m_nBlockSize;
+	std::vector<Block> m_blockList;
+	size_t m_nBlockNo; // current block
+	size_t m_nPos;     // used bytes of the current block
+};
+
+// options of one diff run (no global state, so several pairs can be diffed at the same time)
+struct DiffOptions
+{
+	std::string strFileName;       // output file name prefix (command line only)
+	bool bCreateDiffImg;           // create _diff.png (command line only)
+	bool bCreateChangeImg;         // create _delete.png and _add.png (command line only)
+	double dFailRatio;             // result images only when the changed area / old image pixels is over this (negative : off, command line only)
+	long long nFailPixelNum;       // result images only when the changed area [px] is over this (negative : off, command line only)
+	bool bAlwaysRender;            // result images even under the fail threshold (command line only)
+	unsigned int nThreadNum;       // number of worker threads (0 : hardware concurrency)
+	double dPruneRatio;            // max width/height ratio between old and new part to be matched (0 : match all pairs)
+	DescriptorType descriptorType; // descriptor type for part matching
+	bool bHistogramCheck;          // treat pairs with the same color histogram as no difference
+	unsigned int nMaxMemoryMB;     // memory budget of the segmentation working buffers [MB] (0 : whole image at once)
+	SegmenterType segmenterType;   // part segmentation
+	int nSearchMargin;             // template search window around the part position [px] (0 : full frame only)
+	int nPyramidLevel;             // levels of the coarse-to-fine template search before the full frame (0 : none)
+	Profiler* pProfiler;           // stage timings and counters (NULL : off, not owned)
+	WorkArena* pArena;             // working buffers of the segmentation, one per thread (NULL : per run, not owned)
+	std::string strCacheDir;       // part and descriptor cache shared by processes (empty : off)
+	unsigned int nCacheMaxMB;      // cache size limit [MB], least recently used images are removed (0 : no limit)
+	std::vector<cv::Rect> ignoreRectList; // regions excluded from the diff, same for both images (ad slots, timestamps, ...)
+	cv::Mat ignoreMask;            // CV_8UC1 from the top left of both images, non-zero : pixel excluded from the diff (empty : none)
+	cv::Rect roiRect;              // only this region of both images is diffed (empty : whole image)
+
+	DiffOptions()
+		: strFileName("image_difference")
+		, bCreateDiffImg(true)
+		, bCreateChangeImg(false)
+		, dFailRatio(-1.0)
+		, nFailPixelNum(-1)
+		, bAlwaysRender(false)
+		, nThreadNum(0)
+		, dPruneRatio(0.0)
+		, descriptorType(kDescriptorBinary)
+		, bHistogramCheck(false)
+		, nMaxMemoryMB(0)
+		, segmenterType(kSegmenterWatershed)
+		, nSearchMargin(64)
+		, nPyramidLevel(0)
+		, pProfiler(NULL)
+		, pArena(NULL)
+		, strCacheDir("")
+		, nCacheMaxMB(1024)
+	{
+	}
+};
+
+// part found in both images
+struct DiffRegion
+{
+	cv::Rect oldRect;  // location in the old image
+	cv::Rect newRect;  // location in the new image
+	cv::Mat diffMask;  // CV_8UC1, size of the part, 255 : changed pixel
+	int nDiffPixelNum; // number of changed pixels
+};
+
+// result of one diff run
+struct DiffResult
+{
+	std::vector<DiffRegion> matchedRegionList; // parts found in both images
+	std::vector<cv::Rect> deletedRectList;     // old parts not found in the new image (old image coordinate)
+	std::vector<cv::Rect> addedRectList;       // new parts not found in the old image (new image coordinate)
+	std::vector<cv::Range> changedBandList;    // rows of the new image which differ from the old image
+	cv::Size oldSize;                          // size of the old image (0 x 0 : can't load)
+	cv::Size newSize;                          // size of the new image (0 x 0 : can't load)
+};
+
+// Old (baseline) image precomputed by "gazosan index" : decoded pixels, gray image and pyramid,
+// strip hashes, parts and their descriptors. The index file is mapped read-only, so processes
+// which diff against the same baseline share its pages.
+class BaselineIndex
+{
+public:
+	BaselineIndex();
+	~BaselineIndex();
+
+	static bool Create(const cv::Mat& img, const DiffOptions& options, const std::string& strFile);
+	bool Open(const std::string& strFile);
+	void Close();
+
+	const cv::Mat& GetColor() const { return m_clrImg; }
+	const std::vector<cv::Mat>& GetGrayPyramidList() const { return m_gryPyramidList; } // [0] : gray
+	const std::vector<uint64_t>& GetStripHashList() const { return m_stripHashList; }
+	const std::vector<cv::Rect>& GetPartRectList() const { return m_partRectList; }
+	const std::vector<cv::Mat>& GetDescriptorList() const { return m_descriptorList; } // native AKAZE (empty : no key point)
+	SegmenterType GetSegmenterType() const { return m_segmenterType; } // of the parts
+	bool IsSegmentedBy(const DiffOptions& options) const; // false : the parts can't be used with options
+
+private:
+	BaselineIndex(const BaselineIndex&) = delete;
+	BaselineIndex& operator=(const BaselineIndex&) = delete;
+
+	void* m_pMap;
+	size_t m_nMapSize;
+	SegmenterType m_segmenterType;
+	int m_nBandH; // segmentation band [rows]
+	cv::Mat m_clrImg;
+	std::vector<cv::Mat> m_gryPyramidList;
+	std::vector<uint64_t> m_stripHashList;
+	std::vector<cv::Rect> m_partRectList;
+	std::vector<cv::Mat> m_descriptorList;
+};
+
+// Reentrant diff of two images. It keeps no global state and doesn't touch the file system
+// (except DiffOptions::strCacheDir), so one engine can be shared by several threads
+// (with DiffOptions::pArena NULL).
+// Diff() returns 0 : success, -1 : no difference, -2 : can't load images,
+// -4 : the index was created with other segmentation options (DiffOptions::segmenterType, nMaxMemoryMB)
+class DiffEngine
+{
+public:
+	explicit DiffEngine(const DiffOptions& options = DiffOptions());
+
+	// decoded images (BGR, BGRA or gray, 8 bit)
+	int Diff(const cv::Mat& newImg, const cv::Mat& oldImg, DiffResult& result) const;
+	// encoded images (png, jpeg, ...)
+	int Diff(const std::vector<unsigned char>& newBuf, const std::vector<unsigned char>& oldBuf, DiffResult& result) const;
+	// old image from an index file (BaselineIndex::Open), its segmentation and descriptors are not computed again
+	int Diff(const cv::Mat& newImg, const BaselineIndex& oldIndex, DiffResult& result) const;
+
+	const DiffOptions& GetOptions() const { return m_options; }
+
+private:
+	DiffOptions m_options;
+};
+
+// exit code of a difference over --fail-threshold
+const int kExitCodeOverThreshold = 2;
+// exit code of an error (invalid option, image which can't be loaded, ...)
+const int kExitCodeError = 3;
+// exit code of --check-descriptor when the binary and float descriptor decide differently
+const int kExitCodeDecisionDiffer = 1;
+
+// command line entry point, which returns the exit code
+// return 0 : success (with or without difference), kExitCodeOverThreshold, kExitCodeError,
+//        kExitCodeDecisionDiffer (--check-descriptor)
+int ImgSegMain(int argc, const char** argv);
+
+#endif // IMAGE_DIFF_CALC_H
@@ -11,12 +11,13 @@ int main(int argc, const char** argv)
 	std::cout << "Start detection" << std::endl;
 
 	//ImgSeg
-	ImgSegMain(argc, argv);
+	int nRet = ImgSegMain(argc, argv);
 
 	std::string strHHMMSS_End;
 	GetTimeHHMMSS(NULL, strHHMMSS_End);
 
 	std::cout << "Process time : " << strHHMMSS_Start << " - " << strHHMMSS_End << std::endl;
 
-	return 0;
+	// exit code for CI (a difference over --fail-threshold or an error)
+	return nRet;
 }
\ No newline at end of file
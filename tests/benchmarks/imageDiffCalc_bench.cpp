@@ -0,0 +1,422 @@
+///////////////////////////////////////////////////////////////////////////
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+
+//   * Neither the names of the copyright holders nor the names of the contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall copyright holders or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+///////////////////////////////////////////////////////////////////////////
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <functional>
+#include "imageDiffCalc.cpp"
+
+// pipeline stages measured in one child process, in this order
+const int kStageNum = 6;
+const char* const kStageNameList[kStageNum] = { "ImgSeg00", "ImgSeg01", "ImgSeg02", "ExecuteFeatureDetectorAndMatching", "ImgSeg03", "ImgSeg01Blocks" };
+// the reference grouping keeps a PixelConnectivity per pixel, so it is measured only up to this size
+const long long kMaxReferencePixels = 16LL*1000*1000;
+
+// One block of a page : text lines, a picture or a button, drawn with rng
+void DrawBlock(cv::Mat& img, const cv::Rect& rect, cv::RNG& rng)
+{
+    int nType = rng.uniform(0, 3);
+    if (nType==0)
+    {
+        // text : lines of glyph like strokes
+        for (int y=rect.y+4; y+12<=rect.y+rect.height; y+=18)
+        {
+            for (int x=rect.x+4; x+8<=rect.x+rect.width; x+=rng.uniform(9, 14))
+            {
+                int nGlyphW = rng.uniform(4, 9);
+                cv::line(img, cv::Point(x, y+rng.uniform(0, 4)), cv::Point(x+nGlyphW, y+12-rng.uniform(0, 4)), cv::Scalar::all(rng.uniform(0, 80)), 1);
+                cv::line(img, cv::Point(x, y+12), cv::Point(x+nGlyphW/2, y+rng.uniform(0, 12)), cv::Scalar::all(rng.uniform(0, 80)), 1);
+            }
+        }
+    }
+    else if (nType==1)
+    {
+        // picture : gradient with noise
+        cv::Mat picImg(rect.size(), CV_8UC3);
+        cv::Scalar clr(rng.uniform(0, 200), rng.uniform(0, 200), rng.uniform(0, 200));
+        for (int y=0; y<picImg.rows; ++y)
+        {
+            for (int x=0; x<picImg.cols; ++x)
+            {
+                int nNoise = rng.uniform(-24, 24) + (x+y)%64;
+                picImg.at<cv::Vec3b>(y, x) = cv::Vec3b(cv::saturate_cast<uchar>(clr[0]+nNoise), cv::saturate_cast<uchar>(clr[1]+nNoise), cv::saturate_cast<uchar>(clr[2]+nNoise));
+            }
+        }
+        picImg.copyTo(img(rect));
+    }
+    else
+    {
+        // button : framed color box with a label
+        cv::rectangle(img, rect, cv::Scalar(rng.uniform(0, 200), rng.uniform(0, 200), rng.uniform(0, 200)), cv::FILLED);
+        cv::rectangle(img, rect, cv::Scalar::all(0), 2);
+        cv::putText(img, "Button", cv::Point(rect.x+4, rect.y+rect.height/2), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar::all(255), 1);
+    }
+}
+
+// Page like old and new images : a grid of cells with dDensity blocks per mega pixel.
+// dChangeRatio of the cells are redrawn, removed or shifted in the new image. Same seed, same images.
+void CreateSyntheticPage(const cv::Size& size, const double& dDensity, const double& dChangeRatio, const unsigned int& nSeed, cv::Mat& oldImg, cv::Mat& newImg)
+{
+    oldImg = cv::Mat(size, CV_8UC3, cv::Scalar::all(255));
+    newImg = cv::Mat(size, CV_8UC3, cv::Scalar::all(255));
+    int nCell = std::max(48, (int)std::sqrt(1000.0*1000.0/std::max(0.01, dDensity)));
+    cv::RNG changeRng(nSeed);
+    int nCellNo = 0;
+    for (int y=0; y+nCell<=size.height; y+=nCell)
+    {
+        for (int x=0; x+nCell<=size.width; x+=nCell, ++nCellNo)
+        {
+            cv::RNG rng(nSeed*1000003u + nCellNo);
+            int nBlockW = rng.uniform(nCell/2, nCell*7/8);
+            int nBlockH = rng.uniform(nCell/3, nCell*7/8);
+            cv::Rect rect(x+rng.uniform(4, nCell-nBlockW), y+rng.uniform(4, nCell-nBlockH), nBlockW-4, nBlockH-4);
+            uint64 nState = rng.state;
+            DrawBlock(oldImg, rect, rng);
+
+            rng.state = nState;
+            if (changeRng.uniform(0.0, 1.0)>=dChangeRatio)
+            {
+                DrawBlock(newImg, rect, rng); // same block
+                continue;
+            }
+            int nChange = changeRng.uniform(0, 3);
+            if (nChange==0)
+            {
+                cv::RNG otherRng(~(nSeed*1000003u + nCellNo));
+                DrawBlock(newImg, rect, otherRng); // redrawn
+            }
+            else if (nChange==1)
+            {
+                // removed
+            }
+            else
+            {
+                cv::Rect shiftRect = rect + cv::Point(std::min(3, nCell-(rect.x-x)-rect.width), 0);
+                DrawBlock(newImg, shiftRect, rng); // shifted
+            }
+        }
+    }
+}
+
+// Run func in a child process, and get its nValueNum values and the peak RSS [KB] of the child.
+// Each run starts from the same memory state, so runs don't affect each other.
+bool RunInChild(const std::function<void(std::vector<long long>&)>& func, const unsigned int& nValueNum, std::vector<long long>& nValueList, long& nPeakRssKB)
+{
+    int fd[2];
+    if (pipe(fd)!=0) return false;
+
+    pid_t pid = fork();
+    if (pid==0)
+    {
+        close(fd[0]);
+        std::vector<long long> nChildValueList(nValueNum, -1);
+        func(nChildValueList);
+        ssize_t nSize = sizeof(long long)*nValueNum;
+        if (write(fd[1], nChildValueList.data(), nSize)!=nSize) _exit(1);
+        close(fd[1]);
+        _exit(0);
+    }
+    close(fd[1]);
+    nValueList.assign(nValueNum, -1);
+    ssize_t nSize = sizeof(long long)*nValueNum;
+    bool bRet = (pid>0 && read(fd[0], nValueList.data(), nSize)==nSize);
+    close(fd[0]);
+
+    int nStatus = 0;
+    struct rusage usage;
+    if (pid<=0 || wait4(pid, &nStatus, 0, &usage)!=pid) return false;
+    nPeakRssKB = usage.ru_maxrss;
+    return bRet && WIFEXITED(nStatus) && WEXITSTATUS(nStatus)==0;
+}
+
+long GetPeakRssKB()
+{
+    struct rusage usage;
+    return (getrusage(RUSAGE_SELF, &usage)==0) ? usage.ru_maxrss : -1;
+}
+
+// Contours of a page of nGridNum x nGridNum framed boxes (one top level contour and one hole each),
+// as Step4 of CreateWatershedImage gets them from the gradient image
+void CreateFrameContours(const int& nGridNum, cv::Size& size, std::vector<std::vector<cv::Point> >& contours, std::vector<cv::Vec4i>& hierarchy)
+{
+    const int nPitch = 20;
+    size = cv::Size(nGridNum*nPitch, nGridNum*nPitch);
+    cv::Mat binImg = cv::Mat::zeros(size, CV_8UC1);
+    for (int y=0; y<nGridNum; ++y)
+    {
+        for (int x=0; x<nGridNum; ++x)
+        {
+            cv::rectangle(binImg, cv::Rect(x*nPitch+2, y*nPitch+2, nPitch-6, nPitch-6), cv::Scalar(255), 2);
+        }
+    }
+    cv::findContours(binImg, contours, hierarchy, cv::RETR_CCOMP, cv::CHAIN_APPROX_SIMPLE);
+}
+
+// time [ns] and peak RSS [KB] after each stage (values : ns0, rss0, ns1, rss1, ...)
+void RunPipeline(const cv::Mat& oldImg, const cv::Mat& newImg, const DiffOptions& options, std::vector<long long>& nValueList)
+{
+    ImageContext oldImgContext(oldImg);
+    ImageContext newImgContext(newImg);
+    int nStage = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::function<void()> record = [&]()
+    {
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        nValueList.at(nStage*2) = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        nValueList.at(nStage*2+1) = GetPeakRssKB();
+        ++nStage;
+        start = std::chrono::steady_clock::now();
+    };
+
+    std::vector<cv::Range> changedBandList;
+    ImgSeg00(oldImgContext, newImgContext, options, changedBandList);
+    record();
+
+    std::vector<Part> newPartList, oldPartList;
+    ImgSeg01(newImgContext, options, newPartList);
+    ImgSeg01(oldImgContext, options, oldPartList);
+    record();
+
+    PartTable oldPartTable, newPartTable;
+    ImgSeg02(oldPartList, newPartList, changedBandList, options, oldPartTable, newPartTable);
+    record();
+
+    // all pairs, without the same position matching of ImgSeg02
+    PartTable featureOldPartTable, featureNewPartTable;
+    featureOldPartTable.Init(oldPartList);
+    featureNewPartTable.Init(newPartList);
+    ExecuteFeatureDetectorAndMatching(oldPartList, newPartList, options, featureOldPartTable, featureNewPartTable);
+    record();
+
+    DiffResult result;
+    ImgSeg03(oldImgContext, newPartList, oldPartTable, newPartTable, options, result);
+    record();
+
+    // ImgSeg01 by the block segmenter, on images decoded again (no cached gray image)
+    ImageContext oldBlockImgContext(oldImg);
+    ImageContext newBlockImgContext(newImg);
+    DiffOptions blockOptions = options;
+    blockOptions.segmenterType = kSegmenterBlocks;
+    std::vector<Part> newBlockPartList, oldBlockPartList;
+    start = std::chrono::steady_clock::now();
+    ImgSeg01(newBlockImgContext, blockOptions, newBlockPartList);
+    ImgSeg01(oldBlockImgContext, blockOptions, oldBlockPartList);
+    record();
+}
+
+// nearest rank percentile of sorted values
+long long GetPercentile(const std::vector<long long>& nSortedList, const double& dPercent)
+{
+    if (nSortedList.empty()) return -1;
+    int nRank = (int)std::ceil(dPercent/100.0*nSortedList.size());
+    return nSortedList.at(std::min((int)nSortedList.size(), std::max(1, nRank)) - 1);
+}
+
+void PrintResult(const std::string& strStage, const cv::Size& size, const double& dDensity, const double& dChangeRatio, std::vector<long long> nTimeNsList, const long& nPeakRssKB, const bool& bIsFirst)
+{
+    std::sort(nTimeNsList.begin(), nTimeNsList.end());
+    long long nMedianNs = GetPercentile(nTimeNsList, 50.0);
+    double dMegaPixel = (double)size.area() / 1000000.0;
+    std::cout << (bIsFirst ? "" : ",\n")
+              << "    {\"stage\": \"" << strStage << "\""
+              << ", \"width\": " << size.width << ", \"height\": " << size.height
+              << ", \"density\": " << dDensity << ", \"change_ratio\": " << dChangeRatio
+              << ", \"runs\": " << nTimeNsList.size()
+              << ", \"median_ns\": " << nMedianNs
+              << ", \"p95_ns\": " << GetPercentile(nTimeNsList, 95.0)
+              << ", \"mp_per_s\": " << ((nMedianNs>0) ? dMegaPixel*1e9/nMedianNs : 0.0)
+              << ", \"peak_rss_kb\": " << nPeakRssKB << "}";
+}
+
+std::vector<double> ParseList(const std::string& str)
+{
+    std::vector<double> dList;
+    std::vector<std::string> strItemList = Split(str, ',');
+    for (unsigned int i=0; i<strItemList.size(); ++i)
+    {
+        dList.push_back(std::atof(strItemList[i].c_str()));
+    }
+    return dList;
+}
+
+// Usage : ./gazosan_bench [WIDTHxHEIGHT ...] [--full] [--density 20,80] [--change 0.05,0.3] [--repeat 5] [--threads N] [--seed N] [--label STR]
+// Synthetic pages are generated for each size, density [blocks per mega pixel] and change ratio,
+// and each stage is run --repeat times in a fresh child process. The result is printed as JSON.
+int main(int argc, const char** argv)
+{
+    std::clog.setstate(std::ios_base::failbit);
+
+    std::vector<cv::Size> sizeList;
+    std::vector<double> dDensityList(1, 40.0);
+    std::vector<double> dChangeRatioList(1, 0.1);
+    int nRepeat = 5;
+    unsigned int nSeed = 1;
+    std::string strLabel; // e.g. commit id, to compare results
+    DiffOptions options;
+    options.nThreadNum = std::max(1u, std::thread::hardware_concurrency());
+    for (int i=1; i<argc; ++i)
+    {
+        std::string strArg = argv[i];
+        bool bHasValue = (i+1<argc);
+        if (strArg=="--full")
+        {
+            // 1, 8, 24 and 60 mega pixels
+            sizeList.push_back(cv::Size(1000, 1000));
+            sizeList.push_back(cv::Size(1280, 6250));
+            sizeList.push_back(cv::Size(1920, 12500));
+            sizeList.push_back(cv::Size(1920, 31250));
+        }
+        else if (strArg=="--density" && bHasValue) dDensityList = ParseList(argv[++i]);
+        else if (strArg=="--change" && bHasValue) dChangeRatioList = ParseList(argv[++i]);
+        else if (strArg=="--repeat" && bHasValue) nRepeat = std::max(1, std::atoi(argv[++i]));
+        else if (strArg=="--threads" && bHasValue) options.nThreadNum = std::max(1, std::atoi(argv[++i]));
+        else if (strArg=="--seed" && bHasValue) nSeed = (unsigned int)std::atoi(argv[++i]);
+        else if (strArg=="--label" && bHasValue) strLabel = argv[++i];
+        else
+        {
+            std::vector<std::string> strWH = Split(strArg, 'x');
+            if (strWH.size()==2)
+            {
+                sizeList.push_back(cv::Size(std::atoi(strWH[0].c_str()), std::atoi(strWH[1].c_str())));
+            }
+        }
+    }
+    if (sizeList.empty())
+    {
+        sizeList.push_back(cv::Size(1000, 1000));
+        sizeList.push_back(cv::Size(1280, 6250));
+    }
+
+    std::cout << "{\n  \"label\": \"" << EscapeJSON(strLabel) << "\", \"repeat\": " << nRepeat << ", \"threads\": " << options.nThreadNum << ", \"seed\": " << nSeed << ",\n  \"results\": [\n";
+    bool bIsFirst = true;
+    for (unsigned int s=0; s<sizeList.size(); ++s)
+    {
+        for (unsigned int d=0; d<dDensityList.size(); ++d)
+        {
+            for (unsigned int c=0; c<dChangeRatioList.size(); ++c)
+            {
+                cv::Mat oldImg, newImg;
+                CreateSyntheticPage(sizeList[s], dDensityList[d], dChangeRatioList[c], nSeed, oldImg, newImg);
+
+                // pipeline stages
+                std::vector<std::vector<long long> > nStageTimeNsList(kStageNum);
+                std::vector<long> nStagePeakRssKBList(kStageNum, -1);
+                for (int r=0; r<nRepeat; ++r)
+                {
+                    std::vector<long long> nValueList;
+                    long nPeakRssKB = -1;
+                    if (RunInChild(std::bind(RunPipeline, std::cref(oldImg), std::cref(newImg), std::cref(options), std::placeholders::_1), kStageNum*2, nValueList, nPeakRssKB)==false)
+                    {
+                        continue;
+                    }
+                    for (int k=0; k<kStageNum; ++k)
+                    {
+                        nStageTimeNsList[k].push_back(nValueList[k*2]);
+                        nStagePeakRssKBList[k] = std::max(nStagePeakRssKBList[k], (long)nValueList[k*2+1]);
+                    }
+                }
+                for (int k=0; k<kStageNum; ++k)
+                {
+                    PrintResult(kStageNameList[k], sizeList[s], dDensityList[d], dChangeRatioList[c], nStageTimeNsList[k], nStagePeakRssKBList[k], bIsFirst);
+                    bIsFirst = false;
+                }
+
+                // grouping of the watershed image of the new page
+                ImageContext newImgContext(newImg);
+                cv::Mat wsdImg;
+                if (CreateWatershedImage(newImgContext.GetColor(), newImgContext.GetBinary(), wsdImg)==false)
+                {
+                    continue;
+                }
+                const std::string strFuncNameList[2] = { "GetGroupedData", "GetGroupedDataTest" };
+                for (int j=0; j<2; ++j)
+                {
+                    if (j==1 && (long long)wsdImg.total()>kMaxReferencePixels) continue;
+
+                    std::vector<long long> nTimeNsList;
+                    long nMaxPeakRssKB = -1;
+                    for (int r=0; r<nRepeat; ++r)
+                    {
+                        std::vector<long long> nValueList;
+                        long nPeakRssKB = -1;
+                        bool bRet = RunInChild([&](std::vector<long long>& nChildValueList)
+                        {
+                            unsigned char* pSrcImg = ConvertCVMATtoUCHAR(wsdImg);
+                            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                            if (j==1)
+                            {
+                                std::vector<std::vector<PixelConnectivity*>*> solid;
+                                GetGroupedDataTest(wsdImg.cols, wsdImg.rows, pSrcImg, solid);
+                            }
+                            else
+                            {
+                                std::vector<cv::Rect> partRectList;
+                                GetGroupedData(wsdImg.cols, wsdImg.rows, pSrcImg, partRectList);
+                            }
+                            nChildValueList.at(0) = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                        }, 1, nValueList, nPeakRssKB);
+                        if (bRet==false) continue;
+                        nTimeNsList.push_back(nValueList[0]);
+                        nMaxPeakRssKB = std::max(nMaxPeakRssKB, nPeakRssKB);
+                    }
+                    PrintResult(strFuncNameList[j], sizeList[s], dDensityList[d], dChangeRatioList[c], nTimeNsList, nMaxPeakRssKB, bIsFirst);
+                }
+            }
+        }
+    }
+    // marker seeding of the watershed alone, 10k top level contours
+    {
+        cv::Size size;
+        std::vector<std::vector<cv::Point> > contours;
+        std::vector<cv::Vec4i> hierarchy;
+        CreateFrameContours(100, size, contours, hierarchy);
+        std::vector<long long> nTimeNsList;
+        long nMaxPeakRssKB = -1;
+        for (int r=0; r<nRepeat; ++r)
+        {
+            std::vector<long long> nValueList;
+            long nPeakRssKB = -1;
+            bool bRet = RunInChild([&](std::vector<long long>& nChildValueList)
+            {
+                cv::Mat markers;
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                CreateMarkerImage(size, contours, hierarchy, markers);
+                nChildValueList.at(0) = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            }, 1, nValueList, nPeakRssKB);
+            if (bRet==false) continue;
+            nTimeNsList.push_back(nValueList[0]);
+            nMaxPeakRssKB = std::max(nMaxPeakRssKB, nPeakRssKB);
+        }
+        PrintResult("CreateMarkerImage", size, 10000*1e6/size.area(), 0.0, nTimeNsList, nMaxPeakRssKB, bIsFirst);
+        bIsFirst = false;
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+
+    return 0;
+}
@@ -47,70 +47,564 @@ protected:
     }
 };
 
-class ImgSeg01Test : public ::ImageDiffCalcTest {
-protected:
-    int CountFileInDirectory(const std::string& str)
-    {
-        std::array<char, 3> buffer;
-        std::string resultStr;
-        int resultInt;
-        std::string cmd = "ls ./" + str + " | wc -l";
-        std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
-        if (!pipe) {
-            throw std::runtime_error("popen() failed!");
-        }
-        while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-            resultStr += buffer.data();
-        }
-        resultInt = std::atoi(resultStr.c_str());
-        return resultInt;
-    }
-};
-
 class ImgSeg03Test : public :: ImageDiffCalcTest {
 protected:
-    std::map<int, std::vector<std::string> > strPartFileListMap;
-    void SetPartFileListMap()
+    std::vector<Part> newPartList;
+    PartTable oldPartTable, newPartTable;
+    void SetPartTable()
     {
-        std::vector<std::string> partsVector;
-        partsVector.push_back("tests/images/image_diff_temp/new/ImgSeg-0001.png");
-        partsVector.push_back("tests/images/image_diff_temp/new/ImgSeg-0002.png");
-        partsVector.push_back("tests/images/image_diff_temp/new/ImgSeg-0003.png");
-        partsVector.push_back("tests/images/image_diff_temp/new/ImgSeg-0009.png");
-        partsVector.push_back("tests/images/image_diff_temp/new/ImgSeg-0010.png");
-        strPartFileListMap[2] = partsVector;
+        std::vector<std::string> strPartFileList;
+        strPartFileList.push_back("tests/images/image_diff_temp/new/ImgSeg-0001.png");
+        strPartFileList.push_back("tests/images/image_diff_temp/new/ImgSeg-0002.png");
+        strPartFileList.push_back("tests/images/image_diff_temp/new/ImgSeg-0003.png");
+        strPartFileList.push_back("tests/images/image_diff_temp/new/ImgSeg-0009.png");
+        strPartFileList.push_back("tests/images/image_diff_temp/new/ImgSeg-0010.png");
+        for (unsigned int i=0; i<strPartFileList.size(); ++i)
+        {
+            Part part;
+            part.clrImg = cv::imread(strPartFileList.at(i), cv::IMREAD_COLOR);
+            cv::cvtColor(part.clrImg, part.gryImg, cv::COLOR_BGR2GRAY);
+            part.rect = cv::Rect(0, 0, part.clrImg.cols, part.clrImg.rows);
+            newPartList.push_back(part);
+        }
+        oldPartTable.Init(std::vector<Part>());
+        newPartTable.Init(newPartList);
+        newPartTable.statusList.assign(newPartList.size(), kPartFeatureMatch);
     }
 };
 
 TEST(ImgSeg00Test, SameImage) {
     int result;
-    result = ImgSeg00("tests/images/test_image_old.png","tests/images/test_image_old.png");
+    ImageContext oldImg("tests/images/test_image_old.png");
+    ImageContext newImg("tests/images/test_image_old.png");
+    std::vector<cv::Range> changedBandList;
+    result = ImgSeg00(oldImg, newImg, DiffOptions(), changedBandList);
     ASSERT_EQ(-1, result);
+    ASSERT_TRUE(changedBandList.empty());
 }
 
 TEST(ImgSeg00Test, DifferentImage) {
     int result;
-    result = ImgSeg00("tests/images/test_image_old.png","tests/images/test_image_new.png");
+    ImageContext oldImg("tests/images/test_image_old.png");
+    ImageContext newImg("tests/images/test_image_new.png");
+    std::vector<cv::Range> changedBandList;
+    result = ImgSeg00(oldImg, newImg, DiffOptions(), changedBandList);
+    ASSERT_EQ(0, result);
+    ASSERT_FALSE(changedBandList.empty());
+}
+
+TEST(ImgSeg00Test, DifferentImageWithHistogramCheck) {
+    int result;
+    ImageContext oldImg("tests/images/test_image_old.png");
+    ImageContext newImg("tests/images/test_image_new.png");
+    DiffOptions options;
+    options.bHistogramCheck = true;
+    std::vector<cv::Range> changedBandList;
+    result = ImgSeg00(oldImg, newImg, options, changedBandList);
     ASSERT_EQ(0, result);
 }
 
 TEST(ImgSeg00Test, LoadImageFailed) {
     int result;
-    result = ImgSeg00("wrong/path.png","wrong/path.png");
+    ImageContext oldImg("wrong/path.png");
+    ImageContext newImg("wrong/path.png");
+    std::vector<cv::Range> changedBandList;
+    result = ImgSeg00(oldImg, newImg, DiffOptions(), changedBandList);
     ASSERT_EQ(-2, result);
 }
 
-TEST_F(ImgSeg01Test, CheckNumOfParts) {
-    int got;
-    ImgSeg01("tests/images/test_image_old.png","./image_diff_temp/");
-    got = CountFileInDirectory("image_diff_temp");
-    ASSERT_EQ(8, got);
+TEST(ImgSeg01Test, CheckNumOfParts) {
+    std::vector<Part> partList;
+    ImageContext img("tests/images/test_image_old.png");
+    ImgSeg01(img, DiffOptions(), partList);
+    ASSERT_EQ(7, (int)partList.size());
 }
 
-TEST_F(ImgSeg03Test, CreateDiff) {
-    std::string want = "./image_diff_temp/ImgSeg03_diff.png";
-    SetPartFileListMap();
-    ImgSeg03("tests/images/test_image_old.png", strPartFileListMap, "./image_diff_temp/ImgSeg03");
+TEST(ImgSeg01Test, BlockSegmenter) {
+    DiffOptions options;
+    options.segmenterType = kSegmenterBlocks;
+    std::vector<Part> partList;
+    ImageContext img("tests/images/test_image_old.png");
+    ImgSeg01(img, options, partList);
+    ASSERT_LT(0, (int)partList.size());
+    cv::Rect imgRect(0, 0, img.GetColor().cols, img.GetColor().rows);
+    for (unsigned int i=0; i<partList.size(); ++i) {
+        ASSERT_EQ(partList[i].rect, partList[i].rect & imgRect);
+    }
+
+    cv::Mat newImg = cv::imread("tests/images/test_image_new.png", cv::IMREAD_COLOR);
+    DiffResult result;
+    ASSERT_EQ(0, DiffEngine(options).Diff(newImg, img.GetColor(), result));
+    ASSERT_LT(0, (int)result.matchedRegionList.size());
+}
+
+TEST(ImgSeg01Test, PartIsROIOfSourceImage) {
+    cv::Mat clrImg = cv::imread("tests/images/test_image_old.png", cv::IMREAD_COLOR);
+    std::vector<Part> partList;
+    ImageContext img("tests/images/test_image_old.png");
+    ImgSeg01(img, DiffOptions(), partList);
+    ASSERT_GT((int)partList.size(), 0);
+    for (unsigned int i=0; i<partList.size(); ++i) {
+        const Part& part = partList.at(i);
+        ASSERT_EQ(part.rect.size(), part.clrImg.size());
+        ASSERT_EQ(part.rect.size(), part.gryImg.size());
+        bool isEqual = (cv::sum(clrImg(part.rect) != part.clrImg) == cv::Scalar(0,0,0));
+        ASSERT_TRUE(isEqual);
+    }
+}
+
+TEST(ImgSeg01Test, SamePartsWithMaxMemory) {
+    std::vector<std::string> strFileList;
+    strFileList.push_back("tests/images/test_image_old.png");
+    strFileList.push_back("tests/images/test_image_new.png");
+    SegmenterType segmenterTypeList[] = { kSegmenterWatershed, kSegmenterBlocks };
+    for (unsigned int n=0; n<strFileList.size(); ++n) {
+        for (int t=0; t<2; ++t) {
+            ImageContext img(strFileList.at(n));
+            std::vector<Part> wantPartList, gotPartList;
+            DiffOptions wholeOptions;
+            wholeOptions.segmenterType = segmenterTypeList[t];
+            ImgSeg01(img, wholeOptions, wantPartList);
+            DiffOptions options;
+            options.segmenterType = segmenterTypeList[t];
+            options.nMaxMemoryMB = 4; // about 80 rows per band
+            ASSERT_LT(GetBandHeight(img.GetColor().cols, img.GetColor().rows, options.nMaxMemoryMB), img.GetColor().rows);
+            ImgSeg01(img, options, gotPartList);
+            ASSERT_FALSE(wantPartList.empty());
+            ASSERT_EQ(wantPartList.size(), gotPartList.size());
+            for (unsigned int i=0; i<wantPartList.size(); ++i) {
+                ASSERT_EQ(wantPartList.at(i).rect, gotPartList.at(i).rect);
+            }
+        }
+    }
+}
+
+TEST(ImgSeg01Test, IgnoredParts) {
+    // part A inside the ignored region, part B crossing its right border at x=130
+    cv::Mat img(cv::Size(200, 100), CV_8UC3, cv::Scalar(255,255,255));
+    cv::rectangle(img, cv::Rect(20, 20, 30, 30), cv::Scalar(0,0,0), -1);
+    cv::rectangle(img, cv::Rect(100, 20, 60, 30), cv::Scalar(0,0,0), -1);
+    cv::Mat orgImg = img.clone();
+    // the same page without A and with B cut at the border
+    cv::Mat cutImg(img.size(), CV_8UC3, cv::Scalar(255,255,255));
+    cv::rectangle(cutImg, cv::Rect(130, 20, 30, 30), cv::Scalar(0,0,0), -1);
+
+    DiffOptions rectOptions;
+    rectOptions.ignoreRectList.push_back(cv::Rect(0, 0, 130, 100));
+    DiffOptions maskOptions;
+    maskOptions.ignoreMask = cv::Mat::zeros(img.size(), CV_8UC1);
+    maskOptions.ignoreMask(cv::Rect(0, 0, 130, 100)).setTo(255);
+    const DiffOptions* pOptionsList[] = { &rectOptions, &maskOptions };
+    SegmenterType segmenterTypeList[] = { kSegmenterWatershed, kSegmenterBlocks };
+    for (int n=0; n<2; ++n) {
+        for (int t=0; t<2; ++t) {
+            DiffOptions options = *pOptionsList[n];
+            options.segmenterType = segmenterTypeList[t];
+            ImageContext imgContext(img);
+            imgContext.ApplyIgnoreRegion(options);
+            ASSERT_EQ(255, imgContext.GetGray().at<unsigned char>(30, 30));
+            std::vector<Part> gotPartList, wantPartList;
+            ImgSeg01(imgContext, options, gotPartList);
+            ImageContext cutContext(cutImg);
+            DiffOptions cutOptions;
+            cutOptions.segmenterType = segmenterTypeList[t];
+            ImgSeg01(cutContext, cutOptions, wantPartList);
+            ASSERT_FALSE(gotPartList.empty());
+            ASSERT_EQ(wantPartList.size(), gotPartList.size());
+            for (unsigned int i=0; i<gotPartList.size(); ++i) {
+                ASSERT_EQ(wantPartList.at(i).rect, gotPartList.at(i).rect);
+                ASSERT_GT(gotPartList.at(i).rect.br().x, 130); // no part inside the ignored region
+            }
+            if (options.segmenterType==kSegmenterBlocks) {
+                // B from the border, with the block margin
+                ASSERT_EQ(1, (int)gotPartList.size());
+                ASSERT_EQ(cv::Rect(130-kBlockMargin, 20-kBlockMargin, 30+2*kBlockMargin, 30+2*kBlockMargin), gotPartList.at(0).rect);
+            }
+        }
+    }
+    // the image of the caller isn't changed
+    ASSERT_EQ(0, cv::norm(img, orgImg, cv::NORM_INF));
+}
+
+// watershed image by the marker seeding of drawing each contour and adding 1 to the whole image
+void CreateWatershedImageByPerContourAdd(const cv::Mat& clrImg, const cv::Mat& binImg, cv::Mat& markers, cv::Mat& wsdImg) {
+    cv::Mat grdImg;
+    cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3,3));
+    cv::morphologyEx(binImg, grdImg, cv::MORPH_GRADIENT, kernel, cv::Point(-1,-1), 7);
+    std::vector< std::vector<cv::Point> > contours;
+    std::vector<cv::Vec4i> hierarchy;
+    grdImg.convertTo(grdImg, CV_32SC1, 1.0);
+    cv::findContours(grdImg, contours, hierarchy, cv::RETR_CCOMP, cv::CHAIN_APPROX_SIMPLE);
+    int compCount = 0;
+    markers = cv::Mat::zeros(grdImg.rows, grdImg.cols, CV_32SC1);
+    for (int idx=0; idx>=0; idx=hierarchy[idx][0], compCount++) {
+        cv::drawContours(markers, contours, idx, cv::Scalar::all(compCount+1), -1, 8, hierarchy, INT_MAX);
+        markers = markers + 1;
+    }
+    cv::Mat wsdMarkers = markers.clone();
+    cv::watershed(clrImg, wsdMarkers);
+    wsdImg.create(wsdMarkers.size(), CV_8UC3);
+    for (int y=0; y<wsdMarkers.rows; ++y) {
+        for (int x=0; x<wsdMarkers.cols; ++x) {
+            int index = wsdMarkers.at<int>(y, x);
+            bool bIsPart = (index==0 || index>compCount);
+            wsdImg.at<cv::Vec3b>(y, x) = bIsPart ? cv::Vec3b(0,0,0) : cv::Vec3b(128,128,128);
+        }
+    }
+}
+
+TEST(CreateMarkerImageTest, SamePartsAsPerContourAdd) {
+    std::vector<std::string> strFileList;
+    strFileList.push_back("tests/images/test_image_old.png");
+    strFileList.push_back("tests/images/test_image_new.png");
+    for (unsigned int n=0; n<strFileList.size(); ++n) {
+        ImageContext img(strFileList.at(n));
+        cv::Mat wantMarkers, wantWsdImg;
+        CreateWatershedImageByPerContourAdd(img.GetColor(), img.GetBinary(), wantMarkers, wantWsdImg);
+
+        // same markers
+        cv::Mat grdImg;
+        cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3,3));
+        cv::morphologyEx(img.GetBinary(), grdImg, cv::MORPH_GRADIENT, kernel, cv::Point(-1,-1), 7);
+        std::vector< std::vector<cv::Point> > contours;
+        std::vector<cv::Vec4i> hierarchy;
+        grdImg.convertTo(grdImg, CV_32SC1, 1.0);
+        cv::findContours(grdImg, contours, hierarchy, cv::RETR_CCOMP, cv::CHAIN_APPROX_SIMPLE);
+        cv::Mat gotMarkers;
+        CreateMarkerImage(grdImg.size(), contours, hierarchy, gotMarkers);
+        ASSERT_EQ(0, cv::countNonZero(wantMarkers != gotMarkers));
+
+        // same part list
+        cv::Mat gotWsdImg;
+        ASSERT_TRUE(CreateWatershedImage(img.GetColor(), img.GetBinary(), gotWsdImg));
+        std::vector<cv::Rect> wantRectList, gotRectList;
+        PartGrouper wantGrouper(wantWsdImg.cols), gotGrouper(gotWsdImg.cols);
+        for (int y=0; y<wantWsdImg.rows; ++y) {
+            wantGrouper.AddRow(wantWsdImg.ptr<unsigned char>(y));
+            gotGrouper.AddRow(gotWsdImg.ptr<unsigned char>(y));
+        }
+        wantGrouper.GetPartRectList(wantRectList);
+        gotGrouper.GetPartRectList(gotRectList);
+        ASSERT_LT(0, (int)wantRectList.size());
+        ASSERT_EQ(wantRectList, gotRectList);
+    }
+}
+
+TEST(ImgSeg01Test, SamePartsWithArena) {
+    const SegmenterType segmenterTypeList[2] = { kSegmenterWatershed, kSegmenterBlocks };
+    for (int k=0; k<2; ++k) {
+        ImageContext img("tests/images/test_image_new.png");
+        DiffOptions options;
+        options.segmenterType = segmenterTypeList[k];
+        std::vector<Part> wantPartList;
+        ImgSeg01(img, options, wantPartList);
+
+        // banded, then whole image twice : the second run reuses the blocks of the first one
+        WorkArena arena;
+        options.pArena = &arena;
+        size_t nCapacity = 0;
+        for (int r=0; r<3; ++r) {
+            options.nMaxMemoryMB = (r==0) ? 4 : 0;
+            std::vector<Part> gotPartList;
+            ImgSeg01(img, options, gotPartList);
+            ASSERT_EQ(wantPartList.size(), gotPartList.size());
+            for (unsigned int i=0; i<wantPartList.size(); ++i) {
+                ASSERT_EQ(wantPartList.at(i).rect, gotPartList.at(i).rect);
+            }
+            if (r==2) {
+                ASSERT_EQ(nCapacity, arena.GetCapacity());
+            }
+            nCapacity = arena.GetCapacity();
+            arena.Reset();
+        }
+        ASSERT_LT(0u, nCapacity);
+    }
+}
+
+TEST(ImgSeg02Test, EachPartMatchedOnce) {
+    ImageContext oldImg("tests/images/test_image_old.png");
+    ImageContext newImg("tests/images/test_image_new.png");
+    DiffOptions options;
+    std::vector<cv::Range> changedBandList;
+    ASSERT_EQ(0, ImgSeg00(oldImg, newImg, options, changedBandList));
+    std::vector<Part> oldPartList, newPartList;
+    ImgSeg01(oldImg, options, oldPartList);
+    ImgSeg01(newImg, options, newPartList);
+    PartTable oldTable, newTable;
+    ImgSeg02(oldPartList, newPartList, changedBandList, options, oldTable, newTable);
+    ASSERT_EQ((int)oldPartList.size(), oldTable.GetSize());
+    ASSERT_EQ((int)newPartList.size(), newTable.GetSize());
+    int nMatchNum = 0;
+    for (int j=0; j<newTable.GetSize(); ++j) {
+        ASSERT_NE(kPartPending, newTable.statusList[j]);
+        int i = newTable.nMatchIdList[j];
+        if (newTable.statusList[j]==kPartNoMatch) {
+            ASSERT_EQ(-1, i);
+            continue;
+        }
+        ++nMatchNum;
+        ASSERT_EQ(newTable.statusList[j], oldTable.statusList.at(i));
+        ASSERT_EQ(j, oldTable.nMatchIdList.at(i));
+        if (newTable.statusList[j]==kPartFeatureMatch) {
+            ASSERT_EQ(newTable.GetDescriptors(j).type(), newTable.descriptors.type());
+            ASSERT_LT(0, newTable.GetDescriptors(j).rows);
+        }
+    }
+    ASSERT_LT(0, nMatchNum);
+    for (int i=0; i<oldTable.GetSize(); ++i) {
+        ASSERT_NE(kPartPending, oldTable.statusList[i]);
+    }
+}
+
+TEST(LocateTemplateTest, FindExactMatch) {
+    ImageContext img("tests/images/test_image_old.png");
+    std::vector<Part> partList;
+    ImgSeg01(img, DiffOptions(), partList);
+    ASSERT_GT((int)partList.size(), 0);
+    DiffOptions windowOptions;
+    DiffOptions pyramidOptions;
+    pyramidOptions.nSearchMargin = 0;
+    pyramidOptions.nPyramidLevel = 2;
+    for (unsigned int i=0; i<partList.size(); ++i) {
+        const Part& part = partList.at(i);
+        cv::Point ptWindow, ptPyramid;
+        ASSERT_TRUE(LocateTemplate(img, part, part.rect, windowOptions, NULL, ptWindow));
+        ASSERT_TRUE(LocateTemplate(img, part, part.rect, pyramidOptions, NULL, ptPyramid));
+        cv::Mat windowImg = img.GetGray()(cv::Rect(ptWindow, part.rect.size()));
+        cv::Mat pyramidImg = img.GetGray()(cv::Rect(ptPyramid, part.rect.size()));
+        ASSERT_EQ(0, cv::countNonZero(windowImg != part.gryImg)); // the part itself is in the first window
+        ASSERT_LE(cv::norm(pyramidImg, part.gryImg, cv::NORM_L2SQR), kMaxLocalMatchScore * part.gryImg.total());
+    }
+}
+
+TEST(LocateTemplateTest, ChangedPartNearItsPosition) {
+    ImageContext img("tests/images/test_image_old.png");
+    std::vector<Part> partList;
+    ImgSeg01(img, DiffOptions(), partList);
+    ASSERT_GT((int)partList.size(), 0);
+    Part part = partList.at(0);
+    part.gryImg = part.gryImg.clone();
+    part.gryImg.at<unsigned char>(0, 0) ^= 0x10; // changed pixel : not an exact match anywhere
+    cv::Point ptMin;
+    ASSERT_TRUE(LocateTemplate(img, part, part.rect, DiffOptions(), NULL, ptMin));
+    ASSERT_EQ(part.rect.tl(), ptMin);
+}
+
+TEST(LocateTemplateTest, MovedPartNotTakenForItsNeighbor) {
+    cv::Mat gryImg(cv::Size(200, 400), CV_8UC1);
+    srand(1);
+    for (int y=0; y<gryImg.rows; ++y) {
+        for (int x=0; x<gryImg.cols; ++x) {
+            gryImg.at<unsigned char>(y, x) = rand()%256;
+        }
+    }
+    // card B at (10, 300) is card A at (10, 10) with a few changed pixels
+    gryImg(cv::Rect(10, 10, 40, 40)).copyTo(gryImg(cv::Rect(10, 300, 40, 40)));
+    for (int n=0; n<5; ++n) {
+        gryImg.at<unsigned char>(300+n*7, 10+n*7) ^= 0x10;
+    }
+    cv::Mat clrImg;
+    cv::cvtColor(gryImg, clrImg, cv::COLOR_GRAY2BGR);
+    ImageContext img(clrImg);
+
+    // A changed by a pixel and moved next to B, paired with A by the descriptors
+    Part part;
+    part.rect = cv::Rect(10, 300, 40, 40);
+    part.gryImg = gryImg(cv::Rect(10, 10, 40, 40)).clone();
+    part.gryImg.at<unsigned char>(20, 20) ^= 0x10;
+    const cv::Rect matchedRect(10, 10, 40, 40);
+    DiffOptions fullOptions;
+    fullOptions.nSearchMargin = 0;
+    cv::Point ptWindow, ptFull;
+    ASSERT_TRUE(LocateTemplate(img, part, matchedRect, DiffOptions(), NULL, ptWindow));
+    ASSERT_TRUE(LocateTemplate(img, part, matchedRect, fullOptions, NULL, ptFull));
+    ASSERT_EQ(matchedRect.tl(), ptFull);
+    ASSERT_EQ(ptFull, ptWindow);
+
+    // a close match in the window which isn't the paired part : the full frame is searched
+    Part neighborPart = part;
+    neighborPart.rect = cv::Rect(10, 10, 40, 40);
+    ASSERT_TRUE(LocateTemplate(img, neighborPart, cv::Rect(10, 250, 40, 40), DiffOptions(), NULL, ptWindow));
+    ASSERT_EQ(matchedRect.tl(), ptWindow);
+}
+
+TEST(ImageContextTest, DecodeOnce) {
+    ImageContext img("tests/images/test_image_old.png");
+    const cv::Mat& clrImg = img.GetColor();
+    ASSERT_EQ(clrImg.data, img.GetColor().data);
+    ASSERT_EQ(img.GetGray().data, img.GetGray().data);
+    ASSERT_EQ(clrImg.size(), img.GetBinary().size());
+    ASSERT_EQ(CV_8UC3, img.GetHSV().type());
+}
+
+TEST_F(ImgSeg03Test, FindDiffRegion) {
+    SetPartTable();
+    ImageContext oldImg("tests/images/test_image_old.png");
+    DiffResult result;
+    ImgSeg03(oldImg, newPartList, oldPartTable, newPartTable, DiffOptions(), result);
+    ASSERT_EQ(5, (int)result.matchedRegionList.size());
+    for (unsigned int i=0; i<result.matchedRegionList.size(); ++i) {
+        const DiffRegion& region = result.matchedRegionList.at(i);
+        ASSERT_EQ(region.oldRect.size(), region.diffMask.size());
+        ASSERT_EQ(region.nDiffPixelNum, cv::countNonZero(region.diffMask));
+    }
+}
+
+TEST_F(ImageDiffCalcTest, ImgSeg04CreateDiff) {
+    std::string want = "./image_diff_temp/ImgSeg04_diff.png";
+    ImageContext oldImg("tests/images/test_image_old.png");
+    ImageContext newImg("tests/images/test_image_new.png");
+    DiffOptions options;
+    options.strFileName = "ImgSeg04";
+    DiffResult result;
+    ASSERT_EQ(0, ExecuteDiff(oldImg, newImg, options, result));
+    ImgSeg04(oldImg, newImg, result, options, "./image_diff_temp/");
     bool isExists = FileExists(want);
     ASSERT_TRUE(isExists);
-}
\ No newline at end of file
+}
+
+TEST(DiffEngineTest, DiffDecodedImages) {
+    cv::Mat oldImg = cv::imread("tests/images/test_image_old.png", cv::IMREAD_COLOR);
+    cv::Mat newImg = cv::imread("tests/images/test_image_new.png", cv::IMREAD_COLOR);
+    DiffEngine engine;
+    DiffResult result;
+    ASSERT_EQ(0, engine.Diff(newImg, oldImg, result));
+    ASSERT_GT((int)result.matchedRegionList.size(), 0);
+    ASSERT_EQ(-1, engine.Diff(oldImg, oldImg, result));
+}
+
+TEST(DiffEngineTest, SameResultWithSearchWindow) {
+    cv::Mat oldImg = cv::imread("tests/images/test_image_old.png", cv::IMREAD_COLOR);
+    cv::Mat newImg = cv::imread("tests/images/test_image_new.png", cv::IMREAD_COLOR);
+    DiffOptions fullOptions;
+    fullOptions.nSearchMargin = 0;
+    for (int r=0; r<2; ++r) {
+        const cv::Mat& curNewImg = (r==0) ? newImg : oldImg;
+        const cv::Mat& curOldImg = (r==0) ? oldImg : newImg;
+        DiffResult want, got;
+        ASSERT_EQ(0, DiffEngine(fullOptions).Diff(curNewImg, curOldImg, want));
+        ASSERT_EQ(0, DiffEngine().Diff(curNewImg, curOldImg, got));
+        ASSERT_GT((int)want.matchedRegionList.size(), 0);
+        ASSERT_EQ(want.matchedRegionList.size(), got.matchedRegionList.size());
+        for (unsigned int i=0; i<want.matchedRegionList.size(); ++i) {
+            ASSERT_EQ(want.matchedRegionList[i].newRect, got.matchedRegionList[i].newRect);
+            ASSERT_EQ(want.matchedRegionList[i].oldRect, got.matchedRegionList[i].oldRect);
+            ASSERT_EQ(want.matchedRegionList[i].nDiffPixelNum, got.matchedRegionList[i].nDiffPixelNum);
+        }
+        ASSERT_EQ(want.deletedRectList, got.deletedRectList);
+        ASSERT_EQ(want.addedRectList, got.addedRectList);
+    }
+}
+
+TEST(DiffEngineTest, DiffEncodedImages) {
+    cv::Mat oldImg = cv::imread("tests/images/test_image_old.png", cv::IMREAD_COLOR);
+    cv::Mat newImg = cv::imread("tests/images/test_image_new.png", cv::IMREAD_COLOR);
+    std::vector<unsigned char> oldBuf, newBuf;
+    cv::imencode(".png", oldImg, oldBuf);
+    cv::imencode(".png", newImg, newBuf);
+    DiffEngine engine;
+    DiffResult bufResult, matResult;
+    ASSERT_EQ(0, engine.Diff(newBuf, oldBuf, bufResult));
+    ASSERT_EQ(0, engine.Diff(newImg, oldImg, matResult));
+    ASSERT_EQ(matResult.matchedRegionList.size(), bufResult.matchedRegionList.size());
+    ASSERT_EQ(matResult.deletedRectList.size(), bufResult.deletedRectList.size());
+    ASSERT_EQ(matResult.addedRectList.size(), bufResult.addedRectList.size());
+}
+
+TEST(DiffEngineTest, LoadImageFailed) {
+    DiffEngine engine;
+    DiffResult result;
+    ASSERT_EQ(-2, engine.Diff(std::vector<unsigned char>(), std::vector<unsigned char>(), result));
+}
+
+TEST(CheckDescriptorMatchDecisionTest, SameDecisionOnTestImages) {
+    std::vector<Part> oldPartList, newPartList;
+    ImageContext oldImg("tests/images/test_image_old.png");
+    ImageContext newImg("tests/images/test_image_new.png");
+    ImgSeg01(oldImg, DiffOptions(), oldPartList);
+    ImgSeg01(newImg, DiffOptions(), newPartList);
+    int got = CheckDescriptorMatchDecision(oldPartList, newPartList, 1);
+    ASSERT_EQ(0, got);
+}
+
+TEST(DiffEngineTest, SameResultWithPartCache) {
+    cv::Mat newImg = cv::imread("tests/images/test_image_new.png", cv::IMREAD_COLOR);
+    cv::Mat oldImg = cv::imread("tests/images/test_image_old.png", cv::IMREAD_COLOR);
+    DiffResult want;
+    ASSERT_EQ(0, DiffEngine().Diff(newImg, oldImg, want));
+
+    DiffOptions options;
+    options.strCacheDir = "./part_cache_diff_test";
+    DiffEngine engine(options);
+    for (int i=0; i<2; ++i) { // miss, then hit
+        DiffResult got;
+        ASSERT_EQ(0, engine.Diff(newImg, oldImg, got));
+        ASSERT_EQ(want.matchedRegionList.size(), got.matchedRegionList.size());
+        for (unsigned int j=0; j<want.matchedRegionList.size(); ++j) {
+            ASSERT_EQ(want.matchedRegionList[j].oldRect, got.matchedRegionList[j].oldRect);
+            ASSERT_EQ(want.matchedRegionList[j].newRect, got.matchedRegionList[j].newRect);
+        }
+        ASSERT_EQ(want.deletedRectList, got.deletedRectList);
+        ASSERT_EQ(want.addedRectList, got.addedRectList);
+    }
+    ASSERT_EQ(0, system("rm -rf ./part_cache_diff_test"));
+}
+
+TEST(BaselineIndexTest, SameResultAsOldImage) {
+    cv::Mat newImg = cv::imread("tests/images/test_image_new.png", cv::IMREAD_COLOR);
+    cv::Mat oldImg = cv::imread("tests/images/test_image_old.png", cv::IMREAD_COLOR);
+    DiffResult want;
+    ASSERT_EQ(0, DiffEngine().Diff(newImg, oldImg, want));
+
+    std::string strIndexFile = "./baseline_index_test.gzi";
+    ASSERT_TRUE(BaselineIndex::Create(oldImg, DiffOptions(), strIndexFile));
+    BaselineIndex index;
+    ASSERT_TRUE(index.Open(strIndexFile));
+    remove(strIndexFile.c_str()); // the mapping is kept
+    ASSERT_EQ(0, cv::norm(oldImg, index.GetColor(), cv::NORM_L1));
+    ASSERT_FALSE(index.GetPartRectList().empty());
+
+    DiffResult got;
+    ASSERT_EQ(0, DiffEngine().Diff(newImg, index, got));
+    ASSERT_EQ(want.changedBandList.size(), got.changedBandList.size());
+    ASSERT_EQ(want.matchedRegionList.size(), got.matchedRegionList.size());
+    for (unsigned int i=0; i<want.matchedRegionList.size(); ++i) {
+        ASSERT_EQ(want.matchedRegionList[i].oldRect, got.matchedRegionList[i].oldRect);
+        ASSERT_EQ(want.matchedRegionList[i].nDiffPixelNum, got.matchedRegionList[i].nDiffPixelNum);
+    }
+    ASSERT_EQ(want.deletedRectList, got.deletedRectList);
+    ASSERT_EQ(want.addedRectList, got.addedRectList);
+
+    // the parts of other segmentation options aren't used
+    DiffOptions blockOptions;
+    blockOptions.segmenterType = kSegmenterBlocks;
+    ASSERT_FALSE(index.IsSegmentedBy(blockOptions));
+    ASSERT_EQ(-4, DiffEngine(blockOptions).Diff(newImg, index, got));
+    DiffOptions bandOptions;
+    bandOptions.nMaxMemoryMB = 1; // bands of a few rows
+    ASSERT_FALSE(index.IsSegmentedBy(bandOptions));
+    ASSERT_EQ(-4, DiffEngine(bandOptions).Diff(newImg, index, got));
+
+    ASSERT_FALSE(index.Open("tests/images/test_image_old.png")); // not an index
+}
+
+TEST(DiffEngineTest, IgnoreRegion) {
+    cv::Mat oldImg = cv::imread("tests/images/test_image_old.png", cv::IMREAD_COLOR);
+    cv::Mat newImg = oldImg.clone();
+    cv::rectangle(newImg, cv::Rect(40, 40, 120, 60), cv::Scalar(0, 0, 255), -1);
+    DiffResult result;
+    ASSERT_EQ(0, DiffEngine().Diff(newImg, oldImg, result));
+
+    DiffOptions ignoreOptions;
+    ignoreOptions.ignoreRectList.push_back(cv::Rect(30, 30, 140, 80));
+    ASSERT_EQ(-1, DiffEngine(ignoreOptions).Diff(newImg, oldImg, result));
+
+    DiffOptions maskOptions;
+    maskOptions.ignoreMask = cv::Mat::zeros(oldImg.size(), CV_8UC1);
+    maskOptions.ignoreMask(cv::Rect(30, 30, 140, 80)).setTo(255);
+    ASSERT_EQ(-1, DiffEngine(maskOptions).Diff(newImg, oldImg, result));
+
+    DiffOptions roiOptions;
+    roiOptions.roiRect = cv::Rect(0, 200, oldImg.cols, oldImg.rows-200);
+    ASSERT_EQ(-1, DiffEngine(roiOptions).Diff(newImg, oldImg, result));
+}
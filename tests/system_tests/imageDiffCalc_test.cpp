@@ -132,6 +132,31 @@ TEST_F(ImgSegMainTest, HelpOption) {
     want.append("                           rectangle on the old image. 2.Output_add.png: An\n  ");
     want.append("                           image shows increasing part as the green rectangle\n  ");
     want.append("                           on the new image.\n  ");
+    want.append("    --threads arg          Number of worker threads\n  ");
+    want.append("    --prune-ratio arg      Max part size ratio to match\n  ");
+    want.append("    --descriptor arg       Descriptor type (binary or float)\n  ");
+    want.append("    --check-descriptor     Compare binary and float match results\n  ");
+    want.append("    --histogram-check      Treat same color histogram as no difference\n  ");
+    want.append("    --max-memory arg       Segmentation memory budget in MB\n  ");
+    want.append("    --search-margin arg    Template search window margin in px\n  ");
+    want.append("    --pyramid arg          Pyramid levels of template search\n  ");
+    want.append("    --profile arg          Write stage timings to a JSON file\n  ");
+    want.append("    --cache-dir arg        Part and descriptor cache directory\n  ");
+    want.append("    --cache-size arg       Cache size limit in MB\n  ");
+    want.append("    --old-index arg        Index file of the old image\n  ");
+    want.append("    --batch arg            Diff image pairs listed in a TSV file\n  ");
+    want.append("    --jobs arg             Number of pairs diffed at once\n  ");
+    want.append("    --socket arg           Unix socket of serve mode\n  ");
+    want.append("    --queue arg            Max requests waiting in serve mode\n  ");
+    want.append("    --inline               Send image data to serve mode\n  ");
+    want.append("    --report arg           Write the diff result to a JSON file\n  ");
+    want.append("    --no-images            Don't write result images\n  ");
+    want.append("    --fail-threshold arg   Fail over this changed ratio or pixels\n  ");
+    want.append("    --always-render        Write result images under the threshold\n  ");
+    want.append("    --ignore-rects arg     Regions to ignore (x,y,w,h;...)\n  ");
+    want.append("    --ignore-mask arg      Mask image of pixels to ignore\n  ");
+    want.append("    --roi arg              Region to diff (x,y,w,h)\n  ");
+    want.append("    --segmenter arg        Part segmenter (watershed or blocks)\n  ");
     want.append("-h, --help                 Print help\n\n");
     StartRecordCout();
     ImgSegMain(argc, argv);
@@ -155,4 +180,147 @@ TEST_F(ImgSegMainTest, CreateChangeImageOption) {
     ImgSegMain(argc, argv);
     std::string got = FindChangeImage();
     ASSERT_EQ(want, got);
-}
\ No newline at end of file
+}
+
+TEST_F(ImgSegMainTest, BatchOption) {
+    std::string want = "./image_difference_diff.png";
+    std::string strManifestFile = "./batch_manifest.tsv";
+    {
+        std::ofstream ofs(strManifestFile);
+        ofs << "# new\told\toutput" << std::endl;
+        ofs << "tests/images/test_image_new.png\ttests/images/test_image_old.png\timage_difference" << std::endl;
+    }
+    int argc = 3;
+    const char* argv[] = {(char*)"./test", (char*)"--batch", (char*)"./batch_manifest.tsv"};
+    StartRecordCout();
+    int ret = ImgSegMain(argc, argv);
+    std::string got = GetRecordCout();
+    remove(strManifestFile.c_str());
+    ASSERT_EQ(0, ret);
+    ASSERT_NE(std::string::npos, got.find("\"status\": \"diff\""));
+    ASSERT_TRUE(FileExists(want));
+}
+
+TEST_F(ImgSegMainTest, ProfileOption) {
+    std::string strProfileFile = "./profile.json";
+    int argc = 5;
+    const char* argv[] = {(char*)"./test", (char*)"tests/images/test_image_new.png", (char*)"tests/images/test_image_old.png", (char*)"--profile", (char*)"./profile.json"};
+    int ret = ImgSegMain(argc, argv);
+    std::ifstream ifs(strProfileFile);
+    std::string got((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    remove(strProfileFile.c_str());
+    ASSERT_EQ(0, ret);
+    ASSERT_NE(std::string::npos, got.find("\"peak_rss_kb\""));
+    ASSERT_NE(std::string::npos, got.find("\"decode\""));
+    ASSERT_NE(std::string::npos, got.find("\"akaze\""));
+    ASSERT_NE(std::string::npos, got.find("\"encode\""));
+    ASSERT_NE(std::string::npos, got.find("\"bytes_written\""));
+    // step records of each stage
+    ASSERT_NE(std::string::npos, got.find("\"ImgSeg01.Step3\""));
+    ASSERT_NE(std::string::npos, got.find("\"ImgSeg02.Step2\""));
+    ASSERT_NE(std::string::npos, got.find("\"ImgSeg03.Step1\""));
+    ASSERT_NE(std::string::npos, got.find("\"ImgSeg04.Step1\""));
+}
+
+TEST_F(ImgSegMainTest, ReportOption) {
+    std::string strReportFile = "./report.json";
+    int argc = 6;
+    const char* argv[] = {(char*)"./test", (char*)"tests/images/test_image_new.png", (char*)"tests/images/test_image_old.png", (char*)"--report", (char*)"./report.json", (char*)"--no-images"};
+    int ret = ImgSegMain(argc, argv);
+    std::ifstream ifs(strReportFile);
+    std::string got((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    remove(strReportFile.c_str());
+    ASSERT_EQ(0, ret);
+    ASSERT_NE(std::string::npos, got.find("\"status\": \"diff\""));
+    ASSERT_NE(std::string::npos, got.find("\"changed_pixels\""));
+    ASSERT_NE(std::string::npos, got.find("\"diff_ratio\""));
+    ASSERT_NE(std::string::npos, got.find("\"output\": []"));
+    ASSERT_NE(std::string::npos, got.find("\"akaze\""));
+    ASSERT_FALSE(FileExists("./image_difference_diff.png"));
+}
+
+TEST_F(ImgSegMainTest, FailThresholdOption) {
+    std::string want = "./image_difference_diff.png";
+    const char* argvPass[] = {(char*)"./test", (char*)"tests/images/test_image_new.png", (char*)"tests/images/test_image_old.png", (char*)"--fail-threshold", (char*)"100%"};
+    ASSERT_EQ(0, ImgSegMain(5, argvPass));
+    ASSERT_FALSE(FileExists(want));
+
+    const char* argvFail[] = {(char*)"./test", (char*)"tests/images/test_image_new.png", (char*)"tests/images/test_image_old.png", (char*)"--fail-threshold", (char*)"0"};
+    ASSERT_EQ(kExitCodeOverThreshold, ImgSegMain(5, argvFail));
+    ASSERT_TRUE(FileExists(want));
+}
+
+TEST_F(ImgSegMainTest, FailThresholdWithError) {
+    const char* argvMissing[] = {(char*)"./test", (char*)"tests/images/test_image_new.png", (char*)"tests/images/not_exist.png", (char*)"--fail-threshold", (char*)"100%"};
+    ASSERT_EQ(kExitCodeError, ImgSegMain(5, argvMissing));
+
+    const char* argvInvalid[] = {(char*)"./test", (char*)"tests/images/test_image_new.png", (char*)"tests/images/test_image_old.png", (char*)"--fail-threshold", (char*)"1e3"};
+    ASSERT_EQ(kExitCodeError, ImgSegMain(5, argvInvalid));
+}
+
+TEST_F(ImgSegMainTest, CheckDescriptorOption) {
+    const char* argvCheck[] = {(char*)"./test", (char*)"tests/images/test_image_new.png", (char*)"tests/images/test_image_old.png", (char*)"--check-descriptor"};
+    ASSERT_EQ(0, ImgSegMain(4, argvCheck)); // same decisions
+
+    const char* argvMissing[] = {(char*)"./test", (char*)"tests/images/test_image_new.png", (char*)"tests/images/not_exist.png", (char*)"--check-descriptor"};
+    ASSERT_EQ(kExitCodeError, ImgSegMain(4, argvMissing));
+}
+
+TEST_F(ImgSegMainTest, IndexSubcommand) {
+    std::string want = "./image_difference_diff.png";
+    std::string strIndexFile = "./baseline_test.gzi";
+    const char* argvIndex[] = {(char*)"./test", (char*)"index", (char*)"tests/images/test_image_old.png", (char*)"./baseline_test.gzi"};
+    ASSERT_EQ(0, ImgSegMain(4, argvIndex));
+    ASSERT_TRUE(FileExists(strIndexFile));
+
+    const char* argvDiff[] = {(char*)"./test", (char*)"diff", (char*)"--old-index", (char*)"./baseline_test.gzi", (char*)"tests/images/test_image_new.png"};
+    int ret = ImgSegMain(5, argvDiff);
+    const char* argvOutput[] = {(char*)"./test", (char*)"diff", (char*)"--old-index", (char*)"./baseline_test.gzi", (char*)"tests/images/test_image_new.png", (char*)"-o", (char*)"index_output"};
+    int outputRet = ImgSegMain(7, argvOutput);
+    const char* argvPositional[] = {(char*)"./test", (char*)"diff", (char*)"--old-index", (char*)"./baseline_test.gzi", (char*)"tests/images/test_image_new.png", (char*)"index_output"};
+    int positionalRet = ImgSegMain(6, argvPositional);
+    const char* argvMismatch[] = {(char*)"./test", (char*)"diff", (char*)"--old-index", (char*)"./baseline_test.gzi", (char*)"tests/images/test_image_new.png", (char*)"--segmenter", (char*)"blocks"};
+    int mismatchRet = ImgSegMain(7, argvMismatch);
+    remove(strIndexFile.c_str());
+    ASSERT_EQ(0, ret);
+    ASSERT_TRUE(FileExists(want));
+    ASSERT_EQ(0, outputRet);
+    ASSERT_TRUE(FileExists("./index_output_diff.png"));
+    remove("./index_output_diff.png");
+    ASSERT_EQ(kExitCodeError, positionalRet);
+    ASSERT_EQ(kExitCodeError, mismatchRet);
+}
+
+TEST_F(ImgSegMainTest, ServeSubcommand) {
+    std::string want = "./image_difference_diff.png";
+    std::string strSocketFile = "./gazosan_test.sock";
+    int serveRet = -1;
+    std::thread server([&]() {
+        const char* argvServe[] = {(char*)"./test", (char*)"serve", (char*)"--socket", (char*)"./gazosan_test.sock", (char*)"--jobs", (char*)"2"};
+        serveRet = ImgSegMain(6, argvServe);
+    });
+    struct stat st;
+    for (int i=0; i<500 && stat(strSocketFile.c_str(), &st)!=0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const char* argvPath[] = {(char*)"./test", (char*)"client", (char*)"--socket", (char*)"./gazosan_test.sock", (char*)"tests/images/test_image_new.png", (char*)"tests/images/test_image_old.png"};
+    const char* argvInline[] = {(char*)"./test", (char*)"client", (char*)"--socket", (char*)"./gazosan_test.sock", (char*)"--inline", (char*)"tests/images/test_image_new.png", (char*)"tests/images/test_image_old.png"};
+    StartRecordCout();
+    int pathRet = ImgSegMain(6, argvPath);
+    int inlineRet = ImgSegMain(7, argvInline);
+    std::string got = GetRecordCout();
+
+    const char* argvStop[] = {(char*)"./test", (char*)"stop", (char*)"--socket", (char*)"./gazosan_test.sock"};
+    int stopRet = ImgSegMain(4, argvStop);
+    server.join();
+    ASSERT_EQ(0, pathRet);
+    ASSERT_EQ(0, inlineRet);
+    ASSERT_EQ(0, stopRet);
+    ASSERT_EQ(0, serveRet);
+    ASSERT_NE(std::string::npos, got.find("\"status\": \"diff\""));
+    ASSERT_NE(std::string::npos, got.find("image_difference_diff.png"));
+    ASSERT_TRUE(FileExists(want));
+    ASSERT_NE(0, stat(strSocketFile.c_str(), &st));
+}
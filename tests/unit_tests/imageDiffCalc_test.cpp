@@ -151,6 +151,73 @@ TEST(ConvertColorToGrayTest, FuncConvertColorToGray) {
     ASSERT_TRUE(isEqual);
 }
 
+TEST(ComputeDiffMaskTest, FuncComputeDiffMask) {
+    cv::Mat img1(cv::Size(7, 5), CV_8UC3, cv::Scalar(220,68,198));
+    cv::Mat img2 = img1.clone();
+    img2.at<cv::Vec3b>(1, 2)[0] = 221;
+    img2.at<cv::Vec3b>(4, 6)[2] = 0;
+    cv::Mat diffMask;
+    int got = ComputeDiffMask(img1, img2, diffMask);
+    ASSERT_EQ(2, got);
+    ASSERT_EQ(CV_8UC1, diffMask.type());
+    ASSERT_EQ(255, diffMask.at<unsigned char>(1, 2));
+    ASSERT_EQ(255, diffMask.at<unsigned char>(4, 6));
+    ASSERT_EQ(2, cv::countNonZero(diffMask));
+}
+
+TEST(DrawDiffMaskTest, FuncDrawDiffMask) {
+    cv::Mat img(cv::Size(5, 5), CV_8UC3, cv::Scalar(0,0,0));
+    cv::Mat diffMask = cv::Mat::zeros(2, 2, CV_8UC1);
+    diffMask.at<unsigned char>(1, 1) = 255;
+    DrawDiffMask(img, cv::Point(2, 3), diffMask, CV_RGB(255,0,0));
+    ASSERT_EQ(cv::Vec3b(0,0,255), img.at<cv::Vec3b>(4, 3));
+    ASSERT_EQ(cv::Vec3b(0,0,0), img.at<cv::Vec3b>(3, 2));
+}
+
+TEST(GetChangedBandTest, FuncGetChangedBand) {
+    cv::Mat oldImg(cv::Size(10, 100), CV_8UC3, cv::Scalar(255,255,255));
+    cv::Mat newImg = oldImg.clone();
+    std::vector<cv::Range> changedBandList;
+    GetChangedBand(oldImg, newImg, 16, changedBandList);
+    ASSERT_TRUE(changedBandList.empty());
+
+    newImg.at<cv::Vec3b>(20, 3)[1] = 0;
+    newImg.at<cv::Vec3b>(33, 9)[0] = 0;
+    newImg.at<cv::Vec3b>(99, 0)[2] = 0;
+    GetChangedBand(oldImg, newImg, 16, changedBandList);
+    ASSERT_EQ(2, (int)changedBandList.size());
+    ASSERT_EQ(16, changedBandList.at(0).start);
+    ASSERT_EQ(48, changedBandList.at(0).end);
+    ASSERT_EQ(96, changedBandList.at(1).start);
+    ASSERT_EQ(100, changedBandList.at(1).end);
+
+    cv::Mat otherSizeImg(cv::Size(10, 50), CV_8UC3, cv::Scalar(255,255,255));
+    GetChangedBand(oldImg, otherSizeImg, 16, changedBandList);
+    ASSERT_EQ(1, (int)changedBandList.size());
+    ASSERT_EQ(50, changedBandList.at(0).end);
+}
+
+TEST(GetChangedBandTest, SameHashIsConfirmedByBytes) {
+    cv::Mat oldImg(cv::Size(10, 40), CV_8UC3, cv::Scalar(255,255,255));
+    cv::Mat newImg = oldImg.clone();
+    newImg.at<cv::Vec3b>(20, 3)[1] = 0;
+    // colliding hashes : all strips have the same hash
+    std::vector<uint64_t> hashList(3, 1);
+    std::vector<cv::Range> changedBandList;
+    GetChangedBand(hashList, hashList, oldImg, newImg, 16, changedBandList);
+    ASSERT_EQ(1, (int)changedBandList.size());
+    ASSERT_EQ(16, changedBandList.at(0).start);
+    ASSERT_EQ(32, changedBandList.at(0).end);
+}
+
+TEST(IsInUnchangedBandTest, FuncIsInUnchangedBand) {
+    std::vector<cv::Range> changedBandList;
+    changedBandList.push_back(cv::Range(16, 48));
+    ASSERT_TRUE(IsInUnchangedBand(cv::Rect(0, 0, 10, 16), changedBandList));
+    ASSERT_FALSE(IsInUnchangedBand(cv::Rect(0, 0, 10, 17), changedBandList));
+    ASSERT_TRUE(IsInUnchangedBand(cv::Rect(0, 48, 10, 10), changedBandList));
+}
+
 TEST_F(CreateDirectoryTest, FuncCreateDirectory) {
     want = "./CreateDirectoryTest";
     CreateDirectory(want);
@@ -204,18 +271,9 @@ TEST_F(GetPNGFileTest, FuncGetPNGFile) {
     ASSERT_EQ(want, got);
 }
 
-typedef CreatePNGfromCVMATTest CreatePNGfromUCHARTest;
-TEST_F(CreatePNGfromUCHARTest, FuncCreatePNGfromUCHAR) {
-    std::string strOutputFolder = "./";
-    int nNum = 10;
-    int w = 100;
-    int h = 100;
-    unsigned char* pDstImg = new unsigned char[3];
-    CreatePNGfromUCHAR(nNum, w, h, pDstImg, strOutputFolder);
-    want = "ImgSeg_" + strYYYYMMDDHHMMSS + "-0000.png";
-    bool isExists = FileExists(want);
-    ASSERT_TRUE(isExists);
-    delete[] pDstImg;
+TEST(IsTooSmallPartTest, FuncIsTooSmallPart) {
+    ASSERT_TRUE(IsTooSmallPart(10, 10));
+    ASSERT_FALSE(IsTooSmallPart(100, 100));
 }
 
 TEST_F(SetProcesstMsgTest, FuncSetProcessStartMsg) {
@@ -241,3 +299,423 @@ TEST_F(SetProcesstMsgTest, FuncSetProcessErrorMsg) {
     std::string got = GetRecordClog();
     ASSERT_EQ(want, got);
 }
+
+TEST(GetGroupedDataTest, SamePartsAsReference) {
+    // watershed like image : 128 boundary frame and separators, 0 regions
+    cv::Mat wsdImg(cv::Size(40, 30), CV_8UC3, cv::Scalar(0,0,0));
+    cv::rectangle(wsdImg, cv::Point(0,0), cv::Point(39,29), cv::Scalar(128,128,128), 1);
+    cv::rectangle(wsdImg, cv::Point(0,10), cv::Point(39,10), cv::Scalar(128,128,128), 1);
+    cv::rectangle(wsdImg, cv::Point(20,10), cv::Point(20,29), cv::Scalar(128,128,128), 1);
+    cv::rectangle(wsdImg, cv::Point(5,15), cv::Point(12,25), cv::Scalar(128,128,128), 1);
+    wsdImg.at<cv::Vec3b>(25, 30) = cv::Vec3b(128,128,128);
+
+    unsigned char* pSrcImg = ConvertCVMATtoUCHAR(wsdImg);
+    std::vector<std::vector<PixelConnectivity*>*> solid;
+    GetGroupedDataTest(wsdImg.cols, wsdImg.rows, pSrcImg, solid);
+    std::vector<cv::Rect> want;
+    for (unsigned int i=0; i<solid.size(); ++i) {
+        int nMinX = INT_MAX, nMinY = INT_MAX, nMaxX = -1, nMaxY = -1;
+        for (unsigned int j=0; j<solid[i]->size(); ++j) {
+            int x = solid[i]->at(j)->nIdx % wsdImg.cols;
+            int y = solid[i]->at(j)->nIdx / wsdImg.cols;
+            nMinX = std::min(nMinX, x); nMinY = std::min(nMinY, y);
+            nMaxX = std::max(nMaxX, x); nMaxY = std::max(nMaxY, y);
+            delete solid[i]->at(j);
+        }
+        delete solid[i];
+        want.push_back(cv::Rect(nMinX, nMinY, nMaxX-nMinX+1, nMaxY-nMinY+1));
+    }
+
+    std::vector<cv::Rect> got;
+    GetGroupedData(wsdImg.cols, wsdImg.rows, pSrcImg, got);
+    delete[] pSrcImg;
+    ASSERT_EQ(want.size(), got.size());
+    for (unsigned int i=0; i<want.size(); ++i) {
+        ASSERT_EQ(want[i], got[i]);
+    }
+}
+
+TEST(PartGrouperTest, SamePartsAsWholeImage) {
+    cv::Mat wsdImg(cv::Size(40, 30), CV_8UC3, cv::Scalar(128,128,128));
+    cv::rectangle(wsdImg, cv::Point(2, 2), cv::Point(10, 25), cv::Scalar(0,0,0), -1);
+    cv::rectangle(wsdImg, cv::Point(20, 5), cv::Point(30, 6), cv::Scalar(0,0,0), -1);
+    cv::rectangle(wsdImg, cv::Point(25, 6), cv::Point(26, 20), cv::Scalar(0,0,0), -1);
+    std::vector<cv::Rect> got;
+    PartGrouper grouper(wsdImg.cols);
+    for (int y=0; y<wsdImg.rows; ++y) {
+        grouper.AddRow(wsdImg.ptr<unsigned char>(y));
+    }
+    grouper.GetPartRectList(got);
+    ASSERT_EQ(2, (int)got.size());
+    ASSERT_EQ(cv::Rect(2, 2, 9, 24), got.at(0));
+    ASSERT_EQ(cv::Rect(20, 5, 11, 16), got.at(1));
+}
+
+TEST(GetBandHeightTest, FuncGetBandHeight) {
+    ASSERT_EQ(1300, GetBandHeight(1200, 1300, 0));
+    ASSERT_EQ(1300, GetBandHeight(1200, 1300, 1024));
+    ASSERT_EQ(77, GetBandHeight(1200, 1300, 4));
+    ASSERT_EQ(16, GetBandHeight(100000, 1300, 1));
+}
+
+TEST(FrameCorrelatorTest, SameAsMatchTemplate) {
+    cv::Mat gryImg(cv::Size(300, 200), CV_8UC1);
+    srand(1);
+    for (int y=0; y<gryImg.rows; ++y) {
+        for (int x=0; x<gryImg.cols; ++x) {
+            gryImg.at<unsigned char>(y, x) = rand()%256;
+        }
+    }
+    std::vector<cv::Rect> partRectList;
+    partRectList.push_back(cv::Rect(57, 33, 120, 100));
+    partRectList.push_back(cv::Rect(0, 150, 300, 50));
+    FrameCorrelator correlator(gryImg);
+    for (unsigned int i=0; i<partRectList.size(); ++i) {
+        cv::Mat partGryImg = gryImg(partRectList.at(i)).clone();
+        partGryImg.at<unsigned char>(10, 10) ^= 1; // not an exact match
+        double dGotVal, dWantVal;
+        cv::Point ptGot, ptWant;
+        correlator.MatchTemplate(partGryImg, dGotVal, ptGot);
+        ASSERT_TRUE(MatchTemplateInRect(gryImg, partGryImg, cv::Rect(0, 0, gryImg.cols, gryImg.rows), dWantVal, ptWant));
+        ASSERT_EQ(ptWant, ptGot);
+        ASSERT_NEAR(dWantVal, dGotVal, 1.0);
+    }
+
+    // a tall page is over the default budget, and searched by cv::matchTemplate
+    ASSERT_GT(FrameCorrelator::GetMemorySize(cv::Size(1440, 40000)), (size_t)kMaxFFTMemoryMB*1024*1024);
+    ASSERT_LE(FrameCorrelator::GetMemorySize(cv::Size(1920, 1920)), (size_t)kMaxFFTMemoryMB*1024*1024);
+}
+
+TEST(IsMatchCandidateTest, FuncIsMatchCandidate) {
+    ASSERT_TRUE(IsMatchCandidate(cv::Rect(0, 0, 10, 10), cv::Rect(0, 0, 100, 100), 0.0));
+    ASSERT_TRUE(IsMatchCandidate(cv::Rect(0, 0, 10, 10), cv::Rect(50, 50, 20, 15), 2.0));
+    ASSERT_FALSE(IsMatchCandidate(cv::Rect(0, 0, 10, 10), cv::Rect(0, 0, 10, 21), 2.0));
+}
+
+TEST(EscapeJSONTest, FuncEscapeJSON) {
+    ASSERT_EQ("a\\\\b\\\"c\\n", EscapeJSON("a\\b\"c\n"));
+}
+
+TEST(ProfilerTest, AggregateStagesAndCounters) {
+    Profiler profiler;
+    long long nStartNs = Profiler::GetTimeNs();
+    profiler.AddTime("akaze", nStartNs, 12);
+    profiler.AddTime("akaze", nStartNs);
+    profiler.StartStep("ImgSeg01.Step1");
+    profiler.EndStep("ImgSeg01.Step1");
+    profiler.EndStep("ImgSeg01.Step2"); // not started, ignored
+    profiler.AddCount("matcher_calls", 3);
+    profiler.AddCount("matcher_calls", 4);
+
+    std::string strFile = "./profiler_test.json";
+    ASSERT_TRUE(profiler.WriteJSON(strFile));
+    std::ifstream ifs(strFile);
+    std::string got((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    remove(strFile.c_str());
+    ASSERT_NE(std::string::npos, got.find("\"matcher_calls\": 7"));
+    ASSERT_NE(std::string::npos, got.find("\"akaze\": {\"count\": 2"));
+    ASSERT_NE(std::string::npos, got.find("\"ImgSeg01.Step1\": {\"count\": 1"));
+    ASSERT_EQ(std::string::npos, got.find("ImgSeg01.Step2"));
+    ASSERT_NE(std::string::npos, got.find("\"value\": 12}"));
+}
+
+TEST(PartCacheTest, StoreAndLoad) {
+    std::string strDir = "./part_cache_test/";
+    PartCache cache(strDir, 0);
+    cv::Size imgSize(100, 100);
+    std::vector<cv::Rect> partRectList;
+    partRectList.push_back(cv::Rect(1, 2, 30, 40));
+    partRectList.push_back(cv::Rect(5, 6, 70, 80));
+    std::vector<cv::Mat> descriptorList;
+    descriptorList.push_back(cv::Mat(3, 61, CV_8UC1, cv::Scalar(7)));
+    descriptorList.push_back(cv::Mat()); // no key point
+    ASSERT_TRUE(cache.Store("0123", imgSize, partRectList, descriptorList));
+
+    std::vector<cv::Rect> gotRectList;
+    std::vector<cv::Mat> gotDescriptorList;
+    ASSERT_TRUE(cache.Load("0123", imgSize, gotRectList, gotDescriptorList));
+    ASSERT_EQ(partRectList, gotRectList);
+    ASSERT_EQ(2, (int)gotDescriptorList.size());
+    ASSERT_EQ(0, cv::norm(descriptorList[0], gotDescriptorList[0], cv::NORM_L1));
+    ASSERT_TRUE(gotDescriptorList[1].empty());
+    ASSERT_FALSE(cache.Load("4567", imgSize, gotRectList, gotDescriptorList));
+
+    // broken file is a miss
+    {
+        std::ofstream ofs(strDir + "89ab.gzc", std::ios::binary);
+        ofs << "broken";
+    }
+    ASSERT_FALSE(cache.Load("89ab", imgSize, gotRectList, gotDescriptorList));
+
+    // an entry of another image size, a part out of the image or a file renamed to another key is a miss
+    ASSERT_FALSE(cache.Load("0123", cv::Size(100, 80), gotRectList, gotDescriptorList));
+    ASSERT_TRUE(gotRectList.empty());
+    std::vector<cv::Rect> outsideRectList(1, cv::Rect(90, 90, 20, 20));
+    std::vector<cv::Mat> outsideDescriptorList(1, cv::Mat());
+    ASSERT_TRUE(cache.Store("cdef", imgSize, outsideRectList, outsideDescriptorList));
+    ASSERT_FALSE(cache.Load("cdef", imgSize, gotRectList, gotDescriptorList));
+    ASSERT_EQ(0, rename((strDir + "0123.gzc").c_str(), (strDir + "4567.gzc").c_str()));
+    ASSERT_FALSE(cache.Load("4567", imgSize, gotRectList, gotDescriptorList));
+    ASSERT_EQ(0, rename((strDir + "4567.gzc").c_str(), (strDir + "0123.gzc").c_str()));
+
+    remove((strDir + "0123.gzc").c_str());
+    remove((strDir + "89ab.gzc").c_str());
+    remove((strDir + "cdef.gzc").c_str());
+    remove((strDir + ".lock").c_str());
+    rmdir(strDir.c_str());
+}
+
+// last use of a cache file at nTimeSec (since the epoch), not depending on the file time resolution
+void SetFileTime(const std::string& strFile, const time_t& nTimeSec) {
+    struct timespec times[2];
+    times[0].tv_sec = nTimeSec;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    ASSERT_EQ(0, utimensat(AT_FDCWD, strFile.c_str(), times, 0));
+}
+
+TEST(PartCacheTest, EvictLeastRecentlyUsed) {
+    std::string strDir = "./part_cache_evict_test/";
+    PartCache cache(strDir, 1);
+    cv::Size imgSize(100, 100);
+    std::vector<cv::Rect> partRectList(1, cv::Rect(0, 0, 10, 10));
+    std::vector<cv::Mat> descriptorList(1, cv::Mat(6000, 61, CV_8UC1, cv::Scalar(1))); // about 360KB
+    std::vector<cv::Rect> gotRectList;
+    std::vector<cv::Mat> gotDescriptorList;
+    ASSERT_TRUE(cache.Store("0001", imgSize, partRectList, descriptorList));
+    ASSERT_TRUE(cache.Store("0002", imgSize, partRectList, descriptorList));
+    SetFileTime(strDir + "0001.gzc", 1000);
+    SetFileTime(strDir + "0002.gzc", 2000);
+    ASSERT_TRUE(cache.Load("0001", imgSize, gotRectList, gotDescriptorList)); // used now, 0002 is the least recently used
+    ASSERT_TRUE(cache.Store("0003", imgSize, partRectList, descriptorList));
+    ASSERT_TRUE(cache.Load("0001", imgSize, gotRectList, gotDescriptorList));
+    ASSERT_FALSE(cache.Load("0002", imgSize, gotRectList, gotDescriptorList));
+    ASSERT_TRUE(cache.Load("0003", imgSize, gotRectList, gotDescriptorList));
+
+    remove((strDir + "0001.gzc").c_str());
+    remove((strDir + "0003.gzc").c_str());
+    remove((strDir + ".lock").c_str());
+    rmdir(strDir.c_str());
+}
+
+TEST(SHA256DigestTest, KnownDigest) {
+    SHA256Digest digest;
+    digest.Update((const unsigned char*)"ab", 2);
+    digest.Update((const unsigned char*)"c", 1);
+    ASSERT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", digest.GetHex());
+
+    std::string strData(1000, 'a'); // over some blocks
+    SHA256Digest longDigest;
+    longDigest.Update((const unsigned char*)strData.data(), strData.size());
+    ASSERT_EQ("41edece42d63e8d9bf515a9ba6932e1c20cbc9f5a5d134645adb5db1b9737ea3", longDigest.GetHex());
+}
+
+TEST(FailThresholdTest, ParseAndCompare) {
+    DiffOptions ratioOptions, percentOptions, pixelOptions, invalidOptions;
+    ASSERT_TRUE(ParseFailThreshold("0.01", ratioOptions));
+    ASSERT_TRUE(ParseFailThreshold("1%", percentOptions));
+    ASSERT_TRUE(ParseFailThreshold("150", pixelOptions));
+    ASSERT_FALSE(ParseFailThreshold("1px", invalidOptions));
+    ASSERT_FALSE(ParseFailThreshold("1e3", invalidOptions));
+    ASSERT_FALSE(ParseFailThreshold("nan", invalidOptions));
+    ASSERT_FALSE(HasFailThreshold(invalidOptions));
+    ASSERT_DOUBLE_EQ(0.01, ratioOptions.dFailRatio);
+    ASSERT_DOUBLE_EQ(0.01, percentOptions.dFailRatio);
+    ASSERT_EQ(150, pixelOptions.nFailPixelNum);
+    DiffOptions exponentOptions;
+    ASSERT_TRUE(ParseFailThreshold("1e-3", exponentOptions));
+    ASSERT_DOUBLE_EQ(0.001, exponentOptions.dFailRatio);
+    ASSERT_EQ(-1, exponentOptions.nFailPixelNum);
+
+    DiffResult result;
+    result.oldSize = cv::Size(100, 100);
+    result.addedRectList.push_back(cv::Rect(0, 0, 10, 10)); // 100 px
+    ASSERT_EQ(100, GetChangedArea(result));
+    ASSERT_FALSE(IsOverFailThreshold(result, ratioOptions));
+    ASSERT_FALSE(IsOverFailThreshold(result, pixelOptions));
+    ASSERT_FALSE(IsRenderNeeded(result, pixelOptions));
+    result.deletedRectList.push_back(cv::Rect(0, 0, 10, 10));
+    ASSERT_TRUE(IsOverFailThreshold(result, ratioOptions));
+    ASSERT_TRUE(IsOverFailThreshold(result, pixelOptions));
+    ASSERT_TRUE(IsRenderNeeded(result, pixelOptions));
+    ASSERT_TRUE(IsRenderNeeded(result, DiffOptions()));
+}
+
+TEST(WriteReportTest, DiffRatioOfChangedArea) {
+    std::string strReportFile = "./report_unit.json";
+    DiffResult result;
+    result.oldSize = cv::Size(100, 100);
+    result.newSize = cv::Size(100, 100);
+    DiffRegion region;
+    region.nDiffPixelNum = 50;
+    result.matchedRegionList.push_back(region);
+    result.addedRectList.push_back(cv::Rect(0, 0, 10, 10)); // 100 px
+    ASSERT_TRUE(WriteReport(strReportFile, "new.png", "old.png", 0, result, DiffOptions(), "", 0));
+    std::ifstream ifs(strReportFile);
+    std::string got((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    remove(strReportFile.c_str());
+    ASSERT_NE(std::string::npos, got.find("\"changed_pixels\": 150,"));
+    ASSERT_NE(std::string::npos, got.find("\"diff_ratio\": 0.015,"));
+}
+
+TEST(GetRunLengthPartRectListTest, EightConnectedBlocks) {
+    cv::Mat binImg = cv::Mat::zeros(cv::Size(40, 30), CV_8UC1);
+    cv::rectangle(binImg, cv::Point(2, 2), cv::Point(4, 20), cv::Scalar(255), -1);   // U shape, merged at the bottom
+    cv::rectangle(binImg, cv::Point(8, 2), cv::Point(10, 20), cv::Scalar(255), -1);
+    cv::rectangle(binImg, cv::Point(2, 20), cv::Point(10, 22), cv::Scalar(255), -1);
+    binImg.at<unsigned char>(5, 20) = 255;                                           // diagonal neighbors
+    binImg.at<unsigned char>(6, 21) = 255;
+    cv::rectangle(binImg, cv::Point(30, 10), cv::Point(35, 12), cv::Scalar(255), -1);
+    std::vector<cv::Rect> got;
+    GetRunLengthPartRectList(binImg, got);
+    ASSERT_EQ(3, (int)got.size());
+    ASSERT_EQ(cv::Rect(2, 2, 9, 21), got.at(0));
+    ASSERT_EQ(cv::Rect(20, 5, 2, 2), got.at(1));
+    ASSERT_EQ(cv::Rect(30, 10, 6, 3), got.at(2));
+}
+
+TEST(WorkArenaTest, RewindAndReuse) {
+    WorkArena arena(1024);
+    ASSERT_EQ(0u, arena.GetCapacity());
+    WorkArena::Mark mark = arena.GetMark();
+    unsigned char* p1 = static_cast<unsigned char*>(arena.Allocate(10));
+    unsigned char* p2 = static_cast<unsigned char*>(arena.Allocate(10));
+    ASSERT_EQ(0u, (size_t)p1 % 64);
+    ASSERT_EQ(p1+64, p2);
+    unsigned char* pLarge = static_cast<unsigned char*>(arena.Allocate(4096)); // block of its own
+    ASSERT_EQ(1024u+4096u, arena.GetCapacity());
+
+    // given back, and the same memory is used again without a new block
+    arena.Rewind(mark);
+    ASSERT_EQ(p1, arena.Allocate(10));
+    arena.Reset();
+    ASSERT_EQ(p1, arena.Allocate(1000));
+    ASSERT_EQ(pLarge, arena.Allocate(2000)); // the first block has no room
+    ASSERT_EQ(1024u+4096u, arena.GetCapacity());
+
+    cv::Mat img = arena.CreateMat(3, 5, CV_32SC1);
+    ASSERT_TRUE(img.isContinuous());
+    ASSERT_EQ(cv::Size(5, 3), img.size());
+
+    arena.Release();
+    ASSERT_EQ(0u, arena.GetCapacity());
+}
+
+TEST(WorkArenaTest, SamePartsOnArena) {
+    cv::Mat wsdImg(cv::Size(40, 30), CV_8UC3, cv::Scalar(128,128,128));
+    cv::rectangle(wsdImg, cv::Point(2, 2), cv::Point(10, 25), cv::Scalar(0,0,0), -1);
+    cv::rectangle(wsdImg, cv::Point(20, 5), cv::Point(30, 6), cv::Scalar(0,0,0), -1);
+    cv::rectangle(wsdImg, cv::Point(25, 6), cv::Point(26, 20), cv::Scalar(0,0,0), -1);
+    cv::Mat binImg = cv::Mat::zeros(wsdImg.size(), CV_8UC1);
+    cv::rectangle(binImg, cv::Point(2, 2), cv::Point(10, 25), cv::Scalar(255), -1);
+    cv::rectangle(binImg, cv::Point(20, 5), cv::Point(30, 6), cv::Scalar(255), -1);
+    cv::rectangle(binImg, cv::Point(25, 6), cv::Point(26, 20), cv::Scalar(255), -1);
+
+    std::vector<cv::Rect> wantGrouperList, gotGrouperList, wantRunList, gotRunList;
+    WorkArena arena(64);
+    PartGrouper wantGrouper(wsdImg.cols), gotGrouper(wsdImg.cols, &arena);
+    for (int y=0; y<wsdImg.rows; ++y) {
+        wantGrouper.AddRow(wsdImg.ptr<unsigned char>(y));
+        gotGrouper.AddRow(wsdImg.ptr<unsigned char>(y));
+    }
+    wantGrouper.GetPartRectList(wantGrouperList);
+    gotGrouper.GetPartRectList(gotGrouperList);
+    ASSERT_EQ(2, (int)wantGrouperList.size());
+    ASSERT_EQ(wantGrouperList, gotGrouperList);
+
+    GetRunLengthPartRectList(binImg, wantRunList);
+    GetRunLengthPartRectList(binImg, gotRunList, &arena);
+    ASSERT_EQ(2, (int)wantRunList.size());
+    ASSERT_EQ(wantRunList, gotRunList);
+}
+
+TEST(PartTableTest, MatchSamePositionPart) {
+    std::vector<Part> oldPartList(3), newPartList(3);
+    oldPartList[0].rect = cv::Rect(0, 0, 10, 10);
+    oldPartList[1].rect = cv::Rect(0, 40, 10, 10);
+    oldPartList[2].rect = cv::Rect(0, 80, 10, 10);
+    newPartList[0].rect = cv::Rect(0, 0, 10, 10);  // same position, unchanged rows
+    newPartList[1].rect = cv::Rect(0, 40, 10, 10); // same position, changed rows
+    newPartList[2].rect = cv::Rect(5, 80, 10, 10);
+    std::vector<cv::Range> changedBandList(1, cv::Range(45, 46));
+    PartTable oldTable, newTable;
+    oldTable.Init(oldPartList);
+    newTable.Init(newPartList);
+    MatchSamePositionPart(changedBandList, oldTable, newTable);
+    ASSERT_EQ(kPartSamePosition, newTable.statusList[0]);
+    ASSERT_EQ(0, newTable.nMatchIdList[0]);
+    ASSERT_EQ(kPartSamePosition, oldTable.statusList[0]);
+    ASSERT_EQ(0, oldTable.nMatchIdList[0]);
+    ASSERT_EQ(kPartPending, newTable.statusList[1]);
+    ASSERT_EQ(kPartPending, newTable.statusList[2]);
+    std::vector<int> nPendingIdList;
+    oldTable.GetIdList(kPartPending, nPendingIdList);
+    ASSERT_EQ(std::vector<int>({1, 2}), nPendingIdList);
+}
+
+TEST(PartTableTest, DescriptorsInOneMatrix) {
+    std::vector<Part> partList(3);
+    PartTable table;
+    table.Init(partList);
+    std::vector<int> nIdList;
+    nIdList.push_back(0);
+    nIdList.push_back(2);
+    std::vector<cv::Mat> descriptorList;
+    descriptorList.push_back(cv::Mat(2, 61, CV_8UC1, cv::Scalar(1)));
+    descriptorList.push_back(cv::Mat(3, 61, CV_8UC1, cv::Scalar(2)));
+    table.SetDescriptors(nIdList, descriptorList);
+    ASSERT_EQ(5, table.descriptors.rows);
+    ASSERT_EQ(2, table.GetDescriptors(0).rows);
+    ASSERT_TRUE(table.GetDescriptors(1).empty());
+    ASSERT_EQ(3, table.GetDescriptors(2).rows);
+    ASSERT_EQ(table.descriptors.ptr<unsigned char>(2), table.GetDescriptors(2).ptr<unsigned char>(0)); // no copy
+    ASSERT_EQ(0, cv::countNonZero(table.GetDescriptors(2) != 2));
+}
+
+TEST(ComputeMatchTableTest, StopAtFirstMatch) {
+    std::vector<Part> oldPartList(3), newPartList(2);
+    PartTable oldTable, newTable;
+    oldTable.Init(oldPartList);
+    newTable.Init(newPartList);
+    std::vector<int> nOldIdList({0, 1, 2}), nNewIdList({0, 1});
+    std::vector<cv::Mat> oldDescriptorList, newDescriptorList;
+    oldDescriptorList.push_back(cv::Mat(4, 61, CV_8UC1, cv::Scalar(0)));
+    oldDescriptorList.push_back(cv::Mat(4, 61, CV_8UC1, cv::Scalar(0)));
+    oldDescriptorList.push_back(cv::Mat(4, 61, CV_8UC1, cv::Scalar(255)));
+    newDescriptorList.push_back(cv::Mat(4, 61, CV_8UC1, cv::Scalar(0)));
+    newDescriptorList.push_back(cv::Mat(4, 61, CV_8UC1, cv::Scalar(255)));
+    oldTable.SetDescriptors(nOldIdList, oldDescriptorList);
+    newTable.SetDescriptors(nNewIdList, newDescriptorList);
+
+    std::vector<int> nFullTable, nFirstTable;
+    ComputeMatchTable(oldTable, nOldIdList, newTable, nNewIdList, nFullTable, 1, kDescriptorBinary, 0.0, false);
+    ComputeMatchTable(oldTable, nOldIdList, newTable, nNewIdList, nFirstTable, 1, kDescriptorBinary, 0.0, true);
+    ASSERT_EQ(std::vector<int>({1, 1, 0, 0, 0, 1}), nFullTable);
+    ASSERT_EQ(std::vector<int>({1, kMatchUnknown, kMatchUnknown, 0, 0, 1}), nFirstTable);
+
+    // an entry which isn't computed is the same as in the full table
+    cv::Ptr<cv::DescriptorMatcher> matcher = CreatePartMatcher(newTable, 0, kDescriptorBinary);
+    ASSERT_EQ(1, ComputePartMatch(oldTable, 1, newTable, 0, matcher, kDescriptorBinary, 0.0));
+    ASSERT_EQ(0, ComputePartMatch(oldTable, 2, newTable, 0, matcher, kDescriptorBinary, 0.0));
+}
+
+TEST(ImgSeg02Test, SamePositionPartWithoutKeypoint) {
+    // plain parts have no key point : matched only by the same position in unchanged rows
+    cv::Mat clrImg(cv::Size(100, 100), CV_8UC3, cv::Scalar(200,200,200));
+    cv::Mat gryImg(cv::Size(100, 100), CV_8UC1, cv::Scalar(200));
+    std::vector<Part> oldPartList(2), newPartList(2);
+    for (int i=0; i<2; ++i) {
+        cv::Rect rect(10, 10+50*i, 30, 30);
+        oldPartList[i].rect = rect;
+        oldPartList[i].clrImg = clrImg(rect);
+        oldPartList[i].gryImg = gryImg(rect);
+        newPartList[i] = oldPartList[i];
+    }
+    std::vector<cv::Range> changedBandList(1, cv::Range(64, 80)); // rows of the second part
+    PartTable oldTable, newTable;
+    ImgSeg02(oldPartList, newPartList, changedBandList, DiffOptions(), oldTable, newTable);
+    ASSERT_EQ(kPartSamePosition, oldTable.statusList[0]);
+    ASSERT_EQ(kPartSamePosition, newTable.statusList[0]);
+    ASSERT_EQ(kPartNoMatch, oldTable.statusList[1]);
+    ASSERT_EQ(kPartNoMatch, newTable.statusList[1]);
+}